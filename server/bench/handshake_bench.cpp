@@ -0,0 +1,392 @@
+/* Measures what opening a spreadsheet costs a client, with and without compression (the compress=zlib
+    handshake option), in both wire protocols. Bytes on the wire are everything the client reads from the
+    end of the spreadsheet list to its id. Time to interactive runs from connecting to the client holding
+    every cell and its id, including inflating and parsing, as a client would before showing the sheet.
+
+    Loopback hides the cost of sending the bytes, so the time on a slower link is also estimated, as the
+    time measured here plus the time to carry the bytes at each of the --link-mbps speeds.
+
+    A paste is measured the same way: the bytes a second client on the spreadsheet reads to receive one
+    editCells batch of --paste-cells cells.
+
+    The spreadsheets are filled through the server before measuring, with numbers and short text, and
+    named <sheet-prefix><cells>, so the server keeps them between runs and they are only filled once.
+
+    Build from the server directory:
+        g++ -std=c++17 -O2 -I. bench/handshake_bench.cpp protocol.cpp request.cpp trace.cpp -o handshake_bench -lboost_system -lpthread -lz
+
+    Run against a server on port 1100, for example:
+        ./handshake_bench --cells=1000,10000,100000 --opens=5 --link-mbps=2,20,200
+
+    Prints a single JSON document with the configuration and the results of each case, so runs can be
+    compared between commits.
+*/
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <boost/asio.hpp>
+#include <nlohmann/json.hpp>
+
+#include "protocol.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+struct bench_config {
+    string host = "127.0.0.1";
+    uint16_t port = 1100;
+    vector<int> cells = { 1000, 10000, 100000 };
+    // Times each spreadsheet is opened in each case. The median is reported
+    int opens = 5;
+    vector<double> link_mbps = { 2, 20, 200 };
+    int paste_cells = 1000;
+    string sheet_prefix = "handshake";
+};
+bench_config config;
+
+// Cells sent in each editCells request while filling a spreadsheet
+const int FILL_BATCH = 500;
+
+/* Name of the i-th cell of a sheet that fills columns A to Z a row at a time */
+string cell_at(int i) {
+    return string(1, (char) ('A' + i % 26)) + to_string(i / 26 + 1);
+}
+
+/* Contents of the i-th cell, alternating numbers and short text as a typical sheet would */
+string contents_at(int i) {
+    return i % 2 == 0 ? to_string(i * 7919 % 100000) : "Item " + to_string(i);
+}
+
+/* A client connection with blocking reads, which counts every byte it reads */
+class bench_client {
+    boost::asio::ip::tcp::socket socket;
+    string buffer;
+    size_t bytes_read = 0;
+
+public:
+    wire_protocol protocol;
+    // Current contents of every cell the client has been sent
+    unordered_map<string, string> cells;
+    size_t updates = 0;
+    int id = -1;
+
+    bench_client(boost::asio::io_context& io_context, wire_protocol protocol) : socket(io_context), protocol(protocol) {}
+
+    /* Goes through the handshake up to the spreadsheet list, returning the bytes read from here on */
+    void connect(const string& username, bool compress) {
+        socket.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::make_address(config.host), config.port));
+        socket.set_option(boost::asio::ip::tcp::no_delay(true));
+        string options = protocol == wire_protocol::binary ? "protocol=binary" : "protocol=json";
+        if(compress)
+            options += " compress=zlib";
+        write(username + "\t" + options + "\n");
+
+        // The list ends with an empty line
+        size_t end;
+        while((end = buffer.find("\n\n")) == string::npos && buffer != "\n")
+            read_more();
+        buffer.erase(0, buffer == "\n" ? 1 : end + 2);
+        bytes_read = buffer.size();
+    }
+
+    void write(const string& data) {
+        boost::asio::write(socket, boost::asio::buffer(data));
+    }
+
+    size_t received() const {
+        return bytes_read;
+    }
+
+    /* Reads until the client has been sent its id */
+    void open(const string& sheet) {
+        write(sheet + "\n");
+        while(id < 0)
+            if(!take_messages())
+                read_more();
+    }
+
+    /* Reads until the client has been sent the given number of cellUpdated messages in total */
+    void wait_for_updates(size_t total) {
+        while(updates < total)
+            if(!take_messages())
+                read_more();
+    }
+
+private:
+    void read_more() {
+        char data[64 * 1024];
+        size_t length = socket.read_some(boost::asio::buffer(data));
+        buffer.append(data, length);
+        bytes_read += length;
+    }
+
+    /* Applies every complete message or compressed transfer at the front of the buffer. Returns false
+        when more has to be read first */
+    bool take_messages() {
+        if(protocol == wire_protocol::json) {
+            size_t newline = buffer.find('\n');
+            if(newline == string::npos)
+                return false;
+            // Quotes inside strings are escaped, so this can only be the type of the message
+            if(string_view(buffer).substr(0, newline).find("\"messageType\":\"compressed\"") != string_view::npos) {
+                json header = json::parse(buffer.substr(0, newline));
+                size_t length = header["length"];
+                if(buffer.size() - newline - 1 < length)
+                    return false;
+                string inflated;
+                if(!inflate_messages(string_view(buffer).substr(newline + 1, length), header["size"], inflated))
+                    throw runtime_error("bad compressed transfer");
+                apply_json(inflated);
+                buffer.erase(0, newline + 1 + length);
+                return true;
+            }
+            apply_json(string_view(buffer).substr(0, newline + 1));
+            buffer.erase(0, newline + 1);
+            return true;
+        }
+
+        char *body, *body_end;
+        frame_status status = next_binary_frame(&buffer[0], &buffer[0] + buffer.size(), &body, &body_end);
+        if(status == frame_status::invalid)
+            throw runtime_error("bad frame");
+        if(status == frame_status::incomplete)
+            return false;
+        if((message_type) *body == message_type::compressed) {
+            const char *pos = body + 1;
+            uint64_t size;
+            string inflated;
+            if(!get_varint(pos, body_end, &size) || !inflate_messages(string_view(pos, body_end - pos), size, inflated))
+                throw runtime_error("bad compressed frame");
+            apply_binary(inflated);
+        }
+        else
+            apply_binary(string(&buffer[0], body_end - &buffer[0]));
+        buffer.erase(0, body_end - &buffer[0]);
+        return true;
+    }
+
+    /* Applies newline terminated JSON messages. The id is a bare number on its own line */
+    void apply_json(string_view data) {
+        size_t pos = 0;
+        size_t newline;
+        while((newline = data.find('\n', pos)) != string_view::npos) {
+            string_view line = data.substr(pos, newline - pos);
+            pos = newline + 1;
+            if(!line.empty() && isdigit((unsigned char) line[0])) {
+                id = stoi(string(line));
+                continue;
+            }
+            json message = json::parse(line);
+            if(message["messageType"] == "cellUpdated") {
+                cells[message["cellName"]] = message["contents"];
+                updates++;
+            }
+        }
+    }
+
+    /* Applies complete binary frames */
+    void apply_binary(string data) {
+        char *pos = &data[0];
+        char *end = pos + data.size();
+        char *body, *body_end;
+        string names;
+        while(next_binary_frame(pos, end, &body, &body_end) == frame_status::complete) {
+            const char *field = body + 1;
+            message_type type = (message_type) *body;
+            if(type == message_type::cell_updated) {
+                string_view cell_name, contents;
+                names.clear();
+                names.reserve(32);
+                if(get_cell(field, body_end, names, &cell_name) && get_string(field, body_end, &contents)) {
+                    cells[string(cell_name)] = string(contents);
+                    updates++;
+                }
+            }
+            else if(type == message_type::client_id) {
+                uint64_t client_id;
+                if(get_varint(field, body_end, &client_id))
+                    id = client_id;
+            }
+            pos = body_end;
+        }
+    }
+};
+
+/* Edits the first cells of a spreadsheet until it has the given number. Every batch starts at A1,
+    the cell the filling client has selected */
+void fill_sheet(boost::asio::io_context& io_context, const string& sheet, int cells) {
+    bench_client filler(io_context, wire_protocol::json);
+    filler.connect("filler", false);
+    filler.open(sheet);
+    if(filler.cells.size() >= cells)
+        return;
+
+    filler.write(json({ { "requestType", "selectCell" }, { "cellName", "A1" } }).dump() + "\n");
+    size_t expected = filler.updates;
+    for(int start = 0; start < cells; start += FILL_BATCH) {
+        json request;
+        request["requestType"] = "editCells";
+        request["cells"].push_back({ { "cellName", "A1" }, { "contents", contents_at(0) } });
+        for(int i = max(start, 1); i < min(cells, start + FILL_BATCH); i++)
+            request["cells"].push_back({ { "cellName", cell_at(i) }, { "contents", contents_at(i) } });
+        filler.write(request.dump() + "\n");
+        expected += request["cells"].size();
+        filler.wait_for_updates(expected);
+    }
+}
+
+double median(vector<double> values) {
+    sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+/* Opens the spreadsheet config.opens times over and reports the median bytes and time to interactive */
+json bench_open(boost::asio::io_context& io_context, const string& sheet, int cells, wire_protocol protocol, bool compress) {
+    vector<double> bytes, times;
+    for(int r = 0; r < config.opens; r++) {
+        auto start = chrono::steady_clock::now();
+        bench_client client(io_context, protocol);
+        client.connect("reader", compress);
+        client.open(sheet);
+        times.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
+        bytes.push_back(client.received());
+        if(client.cells.size() < cells)
+            throw runtime_error("client was sent " + to_string(client.cells.size()) + " of " + to_string(cells) + " cells");
+    }
+
+    json result;
+    result["bytes"] = median(bytes);
+    result["time_to_interactive_us"] = median(times);
+    for(double mbps : config.link_mbps)
+        result["estimated_us_at_" + to_string((int) mbps) + "_mbps"] = median(times) + median(bytes) * 8 / mbps;
+    return result;
+}
+
+/* Pastes config.paste_cells cells from one client and reports the bytes another client reads to receive them */
+json bench_paste(boost::asio::io_context& io_context, const string& sheet, wire_protocol protocol, bool compress) {
+    bench_client paster(io_context, wire_protocol::json);
+    paster.connect("paster", false);
+    paster.open(sheet);
+    paster.write(json({ { "requestType", "selectCell" }, { "cellName", "A1" } }).dump() + "\n");
+
+    bench_client listener(io_context, protocol);
+    listener.connect("listener", compress);
+    listener.open(sheet);
+    size_t before = listener.received();
+
+    json request;
+    request["requestType"] = "editCells";
+    for(int i = 0; i < config.paste_cells; i++)
+        request["cells"].push_back({ { "cellName", cell_at(i) }, { "contents", "Pasted " + contents_at(i) } });
+    auto start = chrono::steady_clock::now();
+    paster.write(request.dump() + "\n");
+    listener.wait_for_updates(listener.updates + config.paste_cells);
+
+    json result;
+    result["bytes"] = listener.received() - before;
+    result["time_us"] = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+/* Splits a comma separated list */
+vector<string> split(const string& list) {
+    vector<string> items;
+    stringstream stream(list);
+    string item;
+    while(getline(stream, item, ','))
+        items.push_back(item);
+    return items;
+}
+
+/* Reads options of the form --name=value into config */
+bool parse_arguments(int argc, char** argv) {
+    for(int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        size_t equals = arg.find('=');
+        if(arg.compare(0, 2, "--") != 0 || equals == string::npos) {
+            cerr << "options must be of the form --name=value: " << arg << endl;
+            return false;
+        }
+        string name = arg.substr(2, equals - 2);
+        string value = arg.substr(equals + 1);
+
+        try {
+            if(name == "host")
+                config.host = value;
+            else if(name == "port")
+                config.port = stoul(value);
+            else if(name == "cells") {
+                config.cells.clear();
+                for(string& item : split(value))
+                    config.cells.push_back(stoi(item));
+            }
+            else if(name == "opens")
+                config.opens = stoi(value);
+            else if(name == "link-mbps") {
+                config.link_mbps.clear();
+                for(string& item : split(value))
+                    config.link_mbps.push_back(stod(item));
+            }
+            else if(name == "paste-cells")
+                config.paste_cells = stoi(value);
+            else if(name == "sheet-prefix")
+                config.sheet_prefix = value;
+            else {
+                cerr << "unknown option " << name << endl;
+                return false;
+            }
+        }
+        catch(...) {
+            cerr << "bad value for option " << name << ": " << value << endl;
+            return false;
+        }
+    }
+
+    if(config.opens <= 0 || config.paste_cells <= 0 || config.cells.empty()) {
+        cerr << "opens, paste-cells and every count of cells must be positive" << endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if(!parse_arguments(argc, argv))
+        return 1;
+
+    boost::asio::io_context io_context;
+    json report;
+    report["config"]["cells"] = config.cells;
+    report["config"]["opens"] = config.opens;
+    report["config"]["link_mbps"] = config.link_mbps;
+    report["config"]["paste_cells"] = config.paste_cells;
+
+    try {
+        for(int cells : config.cells) {
+            string sheet = config.sheet_prefix + to_string(cells);
+            fill_sheet(io_context, sheet, cells);
+            for(wire_protocol protocol : { wire_protocol::json, wire_protocol::binary }) {
+                string name = protocol == wire_protocol::json ? "json" : "binary";
+                report["open"][to_string(cells)][name] = bench_open(io_context, sheet, cells, protocol, false);
+                report["open"][to_string(cells)][name + "+zlib"] = bench_open(io_context, sheet, cells, protocol, true);
+            }
+        }
+
+        string sheet = config.sheet_prefix + "paste";
+        for(wire_protocol protocol : { wire_protocol::json, wire_protocol::binary }) {
+            string name = protocol == wire_protocol::json ? "json" : "binary";
+            report["paste"][name] = bench_paste(io_context, sheet, protocol, false);
+            report["paste"][name + "+zlib"] = bench_paste(io_context, sheet, protocol, true);
+        }
+    }
+    catch(exception& ex) {
+        cerr << "[error] " << ex.what() << endl;
+        return 1;
+    }
+
+    cout << report.dump(2) << endl;
+    return 0;
+}
@@ -0,0 +1,437 @@
+/* Load generator for the spreadsheet server. Connects many clients over loopback, each going
+    through the usual handshake (username, spreadsheet choice, id), then sends a mix of editCell,
+    selectCell, undo and revertCell requests at a fixed interval. Clients are spread evenly over
+    the given number of spreadsheets.
+
+    Edit latency is the time from a client sending an editCell request to that client receiving
+    the cellUpdated broadcast for it. Every edit has unique contents so the broadcast can be matched
+    to the request.
+
+    Build from the server directory:
+        g++ -std=c++17 -O2 -I. bench/load_generator.cpp metrics.cpp trace.cpp -o load_generator -lboost_system -lpthread
+
+    Run against a server on port 1100, for example:
+        ./load_generator --clients=2000 --sheets=20 --interval-ms=100 --duration-s=20 --mix=edit:60,select:30,undo:5,revert:5
+
+    Prints a single JSON document with the configuration, request counts, throughput and latency
+    percentiles, so runs can be compared between commits.
+*/
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <thread>
+#include <random>
+#include <atomic>
+#include <sstream>
+#include <unistd.h>
+#include <boost/asio.hpp>
+#include <nlohmann/json.hpp>
+
+#include "metrics.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+enum action { edit_action, select_action, undo_action, revert_action, ACTIONS };
+const char *action_names[ACTIONS] = { "edit", "select", "undo", "revert" };
+
+struct load_config {
+    string host = "127.0.0.1";
+    uint16_t port = 1100;
+    int clients = 1000;
+    int sheets = 10;
+    // Clients pick cells from the first columns * rows cells of their spreadsheet
+    int columns = 26;
+    int rows = 100;
+    int interval_ms = 100;
+    // Clients connect evenly over the ramp, then requests are measured for the duration
+    int ramp_ms = 2000;
+    int duration_s = 10;
+    int threads = thread::hardware_concurrency();
+    string sheet_prefix = "load";
+    int mix[ACTIONS] = { 60, 30, 5, 5 };
+};
+load_config config;
+
+/* Counters shared by every client */
+struct load_stats {
+    atomic<uint64_t> connected{0};
+    atomic<uint64_t> failed{0};
+    atomic<uint64_t> sent[ACTIONS];
+    atomic<uint64_t> received{0};
+    atomic<uint64_t> request_errors{0};
+    atomic<uint64_t> server_errors{0};
+    atomic<uint64_t> unmatched_edits{0};
+    latency_histogram edit_latency;
+};
+load_stats stats;
+
+// Requests are only counted between these times
+atomic<uint64_t> measure_start(0);
+atomic<uint64_t> measure_end(0);
+
+bool measuring(uint64_t ns) {
+    return ns >= measure_start.load() && ns < measure_end.load();
+}
+
+/* One simulated client. All of its handlers run on its own strand, so its state needs no lock */
+class load_client : public enable_shared_from_this<load_client>
+{
+    boost::asio::strand<boost::asio::io_context::executor_type> strand;
+    boost::asio::ip::tcp::socket socket;
+    boost::asio::steady_timer timer;
+    string read_buffer;
+    string write_buffer;
+    string writing;
+    bool write_in_flight = false;
+
+    int index;
+    string sheet;
+    string current_cell;
+    mt19937 random;
+    uint64_t sequence = 0;
+    // Send time of each edit that has not been broadcast back yet, by its contents
+    unordered_map<string, uint64_t> pending_edits;
+
+public:
+    load_client(boost::asio::io_context& io_context, int index)
+    : strand(boost::asio::make_strand(io_context)), socket(strand), timer(strand), index(index), random(index)
+    {
+        sheet = config.sheet_prefix + to_string(index % config.sheets);
+    }
+
+    /* Waits for this client's turn in the ramp, then connects */
+    void start(boost::asio::ip::tcp::endpoint endpoint)
+    {
+        timer.expires_after(chrono::milliseconds((long long) config.ramp_ms * index / config.clients));
+        timer.async_wait([self = shared_from_this(), endpoint] (boost::system::error_code error) {
+            self->socket.async_connect(endpoint, [self] (boost::system::error_code error) {
+                if(error) {
+                    stats.failed++;
+                    return;
+                }
+                self->socket.set_option(boost::asio::ip::tcp::no_delay(true));
+                self->send("load" + to_string(self->index) + "\n");
+                self->read_names();
+            });
+        });
+    }
+
+private:
+    /* The spreadsheet names are one per line, ending with an empty line */
+    void read_names()
+    {
+        boost::asio::async_read_until(socket, boost::asio::dynamic_buffer(read_buffer), '\n',
+        [self = shared_from_this()] (boost::system::error_code error, size_t bytes) {
+            if(error) {
+                stats.failed++;
+                return;
+            }
+            bool last = bytes == 1;
+            self->read_buffer.erase(0, bytes);
+            if(!last) {
+                self->read_names();
+                return;
+            }
+            self->send(self->sheet + "\n");
+            self->read_lines(false);
+        });
+    }
+
+    /* Reads the spreadsheet, which ends with this client's id, and then the messages broadcast
+        to the spreadsheet */
+    void read_lines(bool synced)
+    {
+        boost::asio::async_read(socket, boost::asio::dynamic_buffer(read_buffer), boost::asio::transfer_at_least(1),
+        [self = shared_from_this(), synced] (boost::system::error_code error, size_t bytes) {
+            if(error) {
+                if(!synced)
+                    stats.failed++;
+                return;
+            }
+
+            bool now_synced = synced;
+            size_t pos = 0, newline;
+            while((newline = self->read_buffer.find('\n', pos)) != string::npos) {
+                string_view line(self->read_buffer.data() + pos, newline - pos);
+                pos = newline + 1;
+
+                if(!now_synced) {
+                    //The id is the only line made of digits
+                    if(!line.empty() && line.find_first_not_of("0123456789") == string_view::npos) {
+                        now_synced = true;
+                        stats.connected++;
+                        self->schedule();
+                    }
+                    continue;
+                }
+                self->handle_line(line);
+            }
+            self->read_buffer.erase(0, pos);
+            self->read_lines(now_synced);
+        });
+    }
+
+    /* Matches broadcasts of this client's own edits to the time they were sent. The server writes the
+        fields of each message in alphabetical order, so contents always follow cellName */
+    void handle_line(string_view line)
+    {
+        uint64_t now = now_ns();
+        if(measuring(now))
+            stats.received++;
+
+        if(line.find("\"messageType\":\"cellUpdated\"") != string_view::npos) {
+            size_t start = line.find("\"contents\":\"");
+            if(start == string_view::npos)
+                return;
+            start += 12;
+            size_t end = line.find('"', start);
+            unordered_map<string, uint64_t>::iterator it = pending_edits.find(string(line.substr(start, end - start)));
+            if(it != pending_edits.end()) {
+                if(measuring(it->second))
+                    stats.edit_latency.record(now - it->second);
+                pending_edits.erase(it);
+            }
+        }
+        else if(line.find("\"messageType\":\"requestError\"") != string_view::npos) {
+            if(measuring(now))
+                stats.request_errors++;
+        }
+        else if(line.find("\"messageType\":\"serverError\"") != string_view::npos) {
+            stats.server_errors++;
+        }
+    }
+
+    /* Sends the next request after interval_ms, with the first one at a random point in the interval
+        so clients do not all send at once */
+    void schedule()
+    {
+        int delay = config.interval_ms;
+        if(current_cell.empty())
+            delay = uniform_int_distribution<int>(0, config.interval_ms)(random);
+
+        timer.expires_after(chrono::milliseconds(delay));
+        timer.async_wait([self = shared_from_this()] (boost::system::error_code error) {
+            if(error)
+                return;
+            self->send_request();
+            self->schedule();
+        });
+    }
+
+    string random_cell()
+    {
+        int column = uniform_int_distribution<int>(0, config.columns - 1)(random);
+        int row = uniform_int_distribution<int>(1, config.rows)(random);
+        string name;
+        for(int c = column + 1; c > 0; c = (c - 1) / 26)
+            name.insert(name.begin(), (char) ('A' + (c - 1) % 26));
+        return name + to_string(row);
+    }
+
+    /* Picks a request from the mix. A client must select a cell before it can edit or revert, so
+        its first request is always a selection */
+    void send_request()
+    {
+        int total = 0;
+        for(int i = 0; i < ACTIONS; i++)
+            total += config.mix[i];
+        int pick = uniform_int_distribution<int>(0, total - 1)(random);
+        int chosen = 0;
+        while(pick >= config.mix[chosen])
+            pick -= config.mix[chosen++];
+        if(current_cell.empty())
+            chosen = select_action;
+
+        uint64_t now = now_ns();
+        if(measuring(now))
+            stats.sent[chosen]++;
+
+        json request;
+        switch(chosen) {
+            case edit_action: {
+                string contents = "L" + to_string(index) + "-" + to_string(sequence++);
+                pending_edits[contents] = now;
+                request["requestType"] = "editCell";
+                request["cellName"] = current_cell;
+                request["contents"] = contents;
+                break;
+            }
+            case select_action:
+                current_cell = random_cell();
+                request["requestType"] = "selectCell";
+                request["cellName"] = current_cell;
+                break;
+            case undo_action:
+                request["requestType"] = "undo";
+                break;
+            case revert_action:
+                request["requestType"] = "revertCell";
+                request["cellName"] = current_cell;
+                break;
+        }
+        send(request.dump() + "\n");
+
+        //Edits that are never broadcast, such as ones undone before they were sent, are given up on
+        if(pending_edits.size() > 1000) {
+            stats.unmatched_edits += pending_edits.size();
+            pending_edits.clear();
+        }
+    }
+
+    /* Queues data to be written. Data queued while a write is in progress is sent in the next write */
+    void send(const string& data)
+    {
+        write_buffer += data;
+        if(!write_in_flight)
+            write_next();
+    }
+
+    void write_next()
+    {
+        if(write_buffer.empty())
+            return;
+        write_in_flight = true;
+        writing.swap(write_buffer);
+        write_buffer.clear();
+        boost::asio::async_write(socket, boost::asio::buffer(writing),
+        [self = shared_from_this()] (boost::system::error_code error, size_t bytes) {
+            self->write_in_flight = false;
+            if(!error)
+                self->write_next();
+        });
+    }
+};
+
+/* Reads options of the form --name=value into config */
+bool parse_arguments(int argc, char** argv) {
+    for(int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        size_t equals = arg.find('=');
+        if(arg.compare(0, 2, "--") != 0 || equals == string::npos) {
+            cerr << "options must be of the form --name=value: " << arg << endl;
+            return false;
+        }
+        string name = arg.substr(2, equals - 2);
+        string value = arg.substr(equals + 1);
+
+        try {
+            if(name == "host")
+                config.host = value;
+            else if(name == "port")
+                config.port = stoul(value);
+            else if(name == "clients")
+                config.clients = stoi(value);
+            else if(name == "sheets")
+                config.sheets = stoi(value);
+            else if(name == "columns")
+                config.columns = stoi(value);
+            else if(name == "rows")
+                config.rows = stoi(value);
+            else if(name == "interval-ms")
+                config.interval_ms = stoi(value);
+            else if(name == "ramp-ms")
+                config.ramp_ms = stoi(value);
+            else if(name == "duration-s")
+                config.duration_s = stoi(value);
+            else if(name == "threads")
+                config.threads = stoi(value);
+            else if(name == "sheet-prefix")
+                config.sheet_prefix = value;
+            //The mix is a list of action:weight pairs, such as edit:60,select:30,undo:5,revert:5
+            else if(name == "mix") {
+                for(int a = 0; a < ACTIONS; a++)
+                    config.mix[a] = 0;
+                stringstream pairs(value);
+                string pair;
+                while(getline(pairs, pair, ',')) {
+                    size_t colon = pair.find(':');
+                    int a = 0;
+                    while(a < ACTIONS && pair.compare(0, colon, action_names[a]) != 0)
+                        a++;
+                    if(colon == string::npos || a == ACTIONS)
+                        throw invalid_argument(pair);
+                    config.mix[a] = stoi(pair.substr(colon + 1));
+                }
+            }
+            else {
+                cerr << "unknown option " << name << endl;
+                return false;
+            }
+        }
+        catch(...) {
+            cerr << "bad value for option " << name << ": " << value << endl;
+            return false;
+        }
+    }
+
+    int total = 0;
+    for(int a = 0; a < ACTIONS; a++)
+        total += config.mix[a];
+    if(total <= 0 || config.clients <= 0 || config.sheets <= 0 || config.interval_ms <= 0 || config.threads <= 0) {
+        cerr << "clients, sheets, interval-ms, threads and the mix must be positive" << endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if(!parse_arguments(argc, argv))
+        return 1;
+
+    boost::asio::io_context io_context;
+    boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::make_address(config.host), config.port);
+
+    for(int i = 0; i < ACTIONS; i++)
+        stats.sent[i] = 0;
+
+    //Measuring starts once every client has had time to connect and sync
+    uint64_t start = now_ns();
+    measure_start = start + (uint64_t) (config.ramp_ms + config.interval_ms) * 1000000;
+    measure_end = measure_start + (uint64_t) config.duration_s * 1000000000;
+
+    for(int i = 0; i < config.clients; i++)
+        make_shared<load_client>(io_context, i)->start(endpoint);
+
+    boost::asio::steady_timer stop_timer(io_context);
+    stop_timer.expires_after(chrono::nanoseconds(measure_end - start));
+    stop_timer.async_wait([&] (boost::system::error_code error) {
+        io_context.stop();
+    });
+
+    vector<thread> threads;
+    for(int i = 1; i < config.threads; i++)
+        threads.emplace_back([&] () { io_context.run(); });
+    io_context.run();
+    for(int i = 0; i < threads.size(); i++)
+        threads[i].join();
+
+    json report;
+    report["config"]["clients"] = config.clients;
+    report["config"]["sheets"] = config.sheets;
+    report["config"]["cells"] = config.columns * config.rows;
+    report["config"]["interval_ms"] = config.interval_ms;
+    report["config"]["duration_s"] = config.duration_s;
+    report["config"]["threads"] = config.threads;
+    uint64_t total_sent = 0;
+    for(int i = 0; i < ACTIONS; i++) {
+        report["config"]["mix"][action_names[i]] = config.mix[i];
+        report["sent"][action_names[i]] = stats.sent[i].load();
+        total_sent += stats.sent[i].load();
+    }
+    report["connected"] = stats.connected.load();
+    report["failed"] = stats.failed.load();
+    report["requests_per_s"] = (double) total_sent / config.duration_s;
+    report["messages_received_per_s"] = (double) stats.received.load() / config.duration_s;
+    report["request_errors"] = stats.request_errors.load();
+    report["server_errors"] = stats.server_errors.load();
+    report["unmatched_edits"] = stats.unmatched_edits.load();
+    report["edit_latency"] = stats.edit_latency.summary();
+
+    cout << report.dump(2) << endl;
+
+    //Skip destroying the clients, whose handlers may still be queued
+    _exit(0);
+}
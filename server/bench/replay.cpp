@@ -0,0 +1,436 @@
+/* Replays a capture recorded by a server started with --capture-file=path. Every captured session
+    is opened over loopback and sent its handshake lines and requests at the captured times, scaled
+    by --speed (2 is twice as fast, 0 is as fast as possible). Once everything has been sent and the
+    server has had --settle-ms to finish, the final state of every captured spreadsheet is read back
+    and compared to the state the original server saved when the capture stopped.
+
+    Spreadsheets are replayed under new names starting with --sheet-prefix (replay- by default), so
+    the server under test should not already have them. A spreadsheet that had cells when the capture
+    started is filled with those cells first. Filling adds an edit to the history of each cell, so a
+    revert of a cell that had not been edited since it was loaded can succeed in the replay where it
+    failed in the capture. For an exact replay use --sheet-prefix= (empty), which keeps the captured
+    names, against a server started from the same saved spreadsheets. Sessions are replayed on their
+    own connections, so edits of the same cell by different sessions that were only microseconds apart
+    may reach the server in the other order, more often the higher the speed.
+
+    Build from the server directory:
+        g++ -std=c++17 -O2 -I. bench/replay.cpp capture.cpp protocol.cpp request.cpp trace.cpp -o replay -lboost_system -lpthread -lz
+
+    Run against a server on port 1100:
+        ./replay --capture=traffic.cap --speed=4
+
+    Prints a JSON report of the replay and any cells that differ. Exits with 0 if every spreadsheet
+    matches, 2 if any differ, and 1 on errors.
+*/
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <functional>
+#include <boost/asio.hpp>
+#include <nlohmann/json.hpp>
+
+#include "capture.h"
+#include "protocol.h"
+#include "trace.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+struct replay_config {
+    string capture;
+    string host = "127.0.0.1";
+    uint16_t port = 1100;
+    double speed = 1.0;
+    string sheet_prefix = "replay-";
+    int settle_ms = 1000;
+};
+replay_config config;
+
+typedef map<string, string> sheet_cells;
+
+/* A captured session being replayed. Everything the server sends back is read and thrown away,
+    so the server never sees the session as a slow client */
+class replay_session : public enable_shared_from_this<replay_session>
+{
+    boost::asio::ip::tcp::socket socket;
+    string read_buffer;
+    string write_buffer;
+    string writing;
+    bool connected = false;
+    bool write_in_flight = false;
+    bool closing = false;
+
+public:
+    wire_protocol protocol = wire_protocol::json;
+
+    replay_session(boost::asio::io_context& io_context) : socket(io_context) {}
+
+    void connect(boost::asio::ip::tcp::endpoint endpoint)
+    {
+        socket.async_connect(endpoint, [self = shared_from_this()] (boost::system::error_code error) {
+            if(error) {
+                cerr << "unable to connect a session: " << error.message() << endl;
+                return;
+            }
+            self->socket.set_option(boost::asio::ip::tcp::no_delay(true));
+            self->connected = true;
+            self->read();
+            self->write_next();
+        });
+    }
+
+    /* Sends a handshake line, or a request in the session's wire protocol */
+    void send_line(const string& line)
+    {
+        write_buffer += line;
+        write_buffer += '\n';
+        write_next();
+    }
+
+    void send_request(const string& data)
+    {
+        if(protocol == wire_protocol::binary) {
+            put_varint(write_buffer, data.size());
+            write_buffer += data;
+        }
+        else {
+            write_buffer += data;
+            write_buffer += '\n';
+        }
+        write_next();
+    }
+
+    /* Closes the session once everything queued has been written */
+    void close()
+    {
+        closing = true;
+        write_next();
+    }
+
+private:
+    void read()
+    {
+        boost::asio::async_read(socket, boost::asio::dynamic_buffer(read_buffer), boost::asio::transfer_at_least(1),
+        [self = shared_from_this()] (boost::system::error_code error, size_t bytes) {
+            self->read_buffer.clear();
+            if(!error)
+                self->read();
+        });
+    }
+
+    void write_next()
+    {
+        if(!connected || write_in_flight)
+            return;
+        if(write_buffer.empty()) {
+            if(closing) {
+                boost::system::error_code ignored;
+                socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+            }
+            return;
+        }
+
+        write_in_flight = true;
+        writing.swap(write_buffer);
+        write_buffer.clear();
+        boost::asio::async_write(socket, boost::asio::buffer(writing),
+        [self = shared_from_this()] (boost::system::error_code error, size_t bytes) {
+            self->write_in_flight = false;
+            if(!error)
+                self->write_next();
+        });
+    }
+};
+
+/* Reads a line from a blocking socket */
+bool read_line(boost::asio::ip::tcp::socket& socket, string& buffer, string& line) {
+    boost::system::error_code error;
+    size_t newline = boost::asio::read_until(socket, boost::asio::dynamic_buffer(buffer), '\n', error);
+    if(error)
+        return false;
+    line = buffer.substr(0, newline - 1);
+    buffer.erase(0, newline);
+    return true;
+}
+
+/* Connects to a spreadsheet as a plain JSON client and reads its cells, which are sent as cellUpdated
+    messages before the client's id. Leaves the socket open for further requests */
+bool open_sheet(boost::asio::ip::tcp::socket& socket, string& buffer, const string& sheet, sheet_cells& cells) {
+    boost::system::error_code error;
+    socket.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::make_address(config.host), config.port), error);
+    if(error)
+        return false;
+    boost::asio::write(socket, boost::asio::buffer(string("replay\n")), error);
+
+    string line;
+    do {
+        if(!read_line(socket, buffer, line))
+            return false;
+    } while(!line.empty());
+
+    boost::asio::write(socket, boost::asio::buffer(sheet + "\n"), error);
+    while(read_line(socket, buffer, line)) {
+        if(!line.empty() && line.find_first_not_of("0123456789") == string::npos)
+            return true;
+        json message = json::parse(line, nullptr, false);
+        if(!message.is_discarded() && message.value("messageType", "") == "cellUpdated")
+            cells[message.value("cellName", "")] = message.value("contents", "");
+    }
+    return false;
+}
+
+/* Empty cells are the same as cells that were never set */
+void drop_empty(sheet_cells& cells) {
+    for(sheet_cells::iterator it = cells.begin(); it != cells.end();) {
+        if(it->second.empty())
+            it = cells.erase(it);
+        else
+            it++;
+    }
+}
+
+/* Fills a new spreadsheet with the cells it had when the capture started, by selecting and
+    editing each one, and waits until the server has answered every edit */
+bool seed_sheet(const string& sheet, const sheet_cells& cells) {
+    boost::asio::io_context io_context;
+    boost::asio::ip::tcp::socket socket(io_context);
+    string buffer;
+    sheet_cells existing;
+    if(!open_sheet(socket, buffer, sheet, existing))
+        return false;
+
+    string requests;
+    for(sheet_cells::const_iterator it = cells.begin(); it != cells.end(); it++) {
+        requests += json({{"requestType", "selectCell"}, {"cellName", it->first}}).dump() + "\n";
+        requests += json({{"requestType", "editCell"}, {"cellName", it->first}, {"contents", it->second}}).dump() + "\n";
+    }
+    boost::system::error_code error;
+    boost::asio::write(socket, boost::asio::buffer(requests), error);
+
+    //Every edit is answered with a cellUpdated or a requestError. Selections may come in any order
+    size_t answered = 0;
+    string line;
+    while(answered < cells.size() && read_line(socket, buffer, line)) {
+        if(line.find("\"cellUpdated\"") != string::npos || line.find("\"requestError\"") != string::npos)
+            answered++;
+    }
+    return answered == cells.size();
+}
+
+/* Reads options of the form --name=value into config */
+bool parse_arguments(int argc, char** argv) {
+    for(int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        size_t equals = arg.find('=');
+        if(arg.compare(0, 2, "--") != 0 || equals == string::npos) {
+            cerr << "options must be of the form --name=value: " << arg << endl;
+            return false;
+        }
+        string name = arg.substr(2, equals - 2);
+        string value = arg.substr(equals + 1);
+
+        try {
+            if(name == "capture")
+                config.capture = value;
+            else if(name == "host")
+                config.host = value;
+            else if(name == "port")
+                config.port = stoul(value);
+            else if(name == "speed")
+                config.speed = stod(value);
+            else if(name == "sheet-prefix")
+                config.sheet_prefix = value;
+            else if(name == "settle-ms")
+                config.settle_ms = stoi(value);
+            else {
+                cerr << "unknown option " << name << endl;
+                return false;
+            }
+        }
+        catch(...) {
+            cerr << "bad value for option " << name << ": " << value << endl;
+            return false;
+        }
+    }
+    if(config.capture.empty() || config.speed < 0) {
+        cerr << "--capture=path is required and --speed must not be negative" << endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if(!parse_arguments(argc, argv))
+        return 1;
+
+    capture_reader reader(config.capture);
+    if(!reader.good()) {
+        cerr << "unable to read capture " << config.capture << endl;
+        return 1;
+    }
+
+    //The first state of each spreadsheet is from the start of the capture and the last from the end
+    vector<capture_record> records;
+    unordered_map<string, sheet_cells> initial_state;
+    unordered_map<string, sheet_cells> final_state;
+    capture_record record;
+    while(reader.next(record)) {
+        if(record.event == capture_event::sheet_state) {
+            string name;
+            vector<pair<string, string>> cells;
+            if(!decode_sheet_state(record.data, name, cells)) {
+                cerr << "bad spreadsheet state in capture" << endl;
+                return 1;
+            }
+            sheet_cells state(cells.begin(), cells.end());
+            drop_empty(state);
+            //States recorded after the first record are from the end, including spreadsheets created during the capture
+            if(records.empty())
+                initial_state[name] = state;
+            final_state[name] = state;
+        }
+        else
+            records.push_back(record);
+    }
+
+    //Spreadsheets that were used but did not exist at the start of the capture begin empty. A spreadsheet that others were forked from is used too
+    unordered_map<string, bool> used_sheets;
+    for(int i = 0; i < records.size(); i++) {
+        if(records[i].event == capture_event::spreadsheet)
+            used_sheets[records[i].data] = true;
+        else if(records[i].event == capture_event::username) {
+            handshake_options options;
+            parse_handshake_line(records[i].data, options);
+            if(!options.fork.empty())
+                used_sheets[options.fork] = true;
+        }
+    }
+
+    if(!config.sheet_prefix.empty()) {
+        for(unordered_map<string, bool>::iterator it = used_sheets.begin(); it != used_sheets.end(); it++) {
+            if(!initial_state[it->first].empty() && !seed_sheet(config.sheet_prefix + it->first, initial_state[it->first])) {
+                cerr << "unable to fill spreadsheet " << config.sheet_prefix + it->first << endl;
+                return 1;
+            }
+        }
+    }
+
+    boost::asio::io_context io_context;
+    boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::make_address(config.host), config.port);
+    unordered_map<int, shared_ptr<replay_session>> sessions;
+    boost::asio::steady_timer timer(io_context);
+    size_t next = 0;
+    size_t requests = 0;
+    uint64_t start = now_ns();
+
+    //Sends every record that is due, then waits for the next one
+    function<void()> send_due = [&] () {
+        uint64_t elapsed_us = (now_ns() - start) / 1000;
+        while(next < records.size() && (config.speed == 0 || records[next].time_us / config.speed <= elapsed_us)) {
+            const capture_record& r = records[next++];
+            switch(r.event) {
+                case capture_event::connected:
+                    sessions[r.session] = make_shared<replay_session>(io_context);
+                    sessions[r.session]->connect(endpoint);
+                    break;
+                case capture_event::username: {
+                    if(sessions.find(r.session) == sessions.end())
+                        break;
+                    handshake_options options;
+                    parse_handshake_line(r.data, options);
+                    sessions[r.session]->protocol = options.protocol;
+                    //A fork is made from the replayed copy of its source
+                    string line = r.data;
+                    if(!options.fork.empty())
+                        line.replace(line.find("fork=" + options.fork), 5 + options.fork.size(), "fork=" + config.sheet_prefix + options.fork);
+                    sessions[r.session]->send_line(line);
+                    break;
+                }
+                case capture_event::spreadsheet:
+                    if(sessions.find(r.session) != sessions.end())
+                        sessions[r.session]->send_line(config.sheet_prefix + r.data);
+                    break;
+                case capture_event::request:
+                    if(sessions.find(r.session) != sessions.end()) {
+                        sessions[r.session]->send_request(r.data);
+                        requests++;
+                    }
+                    break;
+                case capture_event::disconnected:
+                    if(sessions.find(r.session) != sessions.end()) {
+                        sessions[r.session]->close();
+                        sessions.erase(r.session);
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        if(next < records.size()) {
+            timer.expires_after(chrono::microseconds((uint64_t) (records[next].time_us / config.speed) - elapsed_us));
+            timer.async_wait([&] (boost::system::error_code error) { send_due(); });
+            return;
+        }
+
+        //Give the server time to finish, then close the sessions that were still open at the end
+        timer.expires_after(chrono::milliseconds(config.settle_ms));
+        timer.async_wait([&] (boost::system::error_code error) {
+            for(unordered_map<int, shared_ptr<replay_session>>::iterator it = sessions.begin(); it != sessions.end(); it++)
+                it->second->close();
+            sessions.clear();
+        });
+    };
+    send_due();
+    io_context.run();
+    double replay_s = (now_ns() - start) / 1e9;
+
+    json report;
+    report["records"] = records.size();
+    report["requests"] = requests;
+    report["speed"] = config.speed;
+    report["replay_s"] = replay_s;
+    report["sheets"] = json::object();
+
+    bool all_match = true;
+    for(unordered_map<string, sheet_cells>::iterator it = final_state.begin(); it != final_state.end(); it++) {
+        if(used_sheets.find(it->first) == used_sheets.end())
+            continue;
+
+        boost::asio::io_context check_context;
+        boost::asio::ip::tcp::socket socket(check_context);
+        string buffer;
+        sheet_cells replayed;
+        json result;
+        if(!open_sheet(socket, buffer, config.sheet_prefix + it->first, replayed)) {
+            cerr << "unable to read spreadsheet " << config.sheet_prefix + it->first << endl;
+            return 1;
+        }
+        drop_empty(replayed);
+
+        //Cells whose contents differ, including cells only one side has
+        json differences = json::array();
+        sheet_cells all = it->second;
+        all.insert(replayed.begin(), replayed.end());
+        for(sheet_cells::iterator cell = all.begin(); cell != all.end(); cell++) {
+            string expected = it->second.count(cell->first) ? it->second[cell->first] : "";
+            string actual = replayed.count(cell->first) ? replayed[cell->first] : "";
+            if(expected != actual && differences.size() < 20)
+                differences.push_back({{"cellName", cell->first}, {"expected", expected}, {"replayed", actual}});
+        }
+
+        result["cells"] = it->second.size();
+        result["match"] = differences.empty();
+        if(!differences.empty())
+            result["differences"] = differences;
+        all_match = all_match && differences.empty();
+        report["sheets"][it->first] = result;
+    }
+    report["match"] = all_match;
+
+    cout << report.dump(2) << endl;
+    return all_match ? 0 : 2;
+}
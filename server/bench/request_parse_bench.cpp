@@ -0,0 +1,119 @@
+/* Microbenchmark comparing the old request path (streambuf -> stringstream -> string ->
+    json::parse -> operator[] comparisons) with the in-place parser in request.cpp.
+
+    Build from the server directory:
+        g++ -std=c++17 -O2 -I. bench/request_parse_bench.cpp request.cpp -o request_parse_bench
+
+    Prints one line per case with the median time per request of each path.
+*/
+#include <iostream>
+#include <chrono>
+#include <sstream>
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <nlohmann/json.hpp>
+
+#include "request.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+const int REPETITIONS = 7;
+
+/* Keeps the compiler from optimizing away the results of a parse */
+size_t sink = 0;
+
+/* The request handling that start_reading did before requests were parsed in place */
+void old_path(const string& line) {
+    boost::asio::streambuf streambuf;
+    ostream(&streambuf) << line;
+
+    stringstream ss;
+    ss << istream(&streambuf).rdbuf();
+    string temp = ss.str();
+    json client_message = json::parse(ss.str());
+
+    if(client_message["requestType"] == "editCell") {
+        string cell_name = client_message["cellName"];
+        string desired_contents = client_message["contents"];
+        sink += cell_name.size() + desired_contents.size();
+    }
+    else if(client_message["requestType"] == "selectCell") {
+        string cell_name = client_message["cellName"];
+        sink += cell_name.size();
+    }
+    else if(client_message["requestType"] == "editCells") {
+        json cells = client_message["cells"];
+        for(int i = 0; i < cells.size(); i++) {
+            string cell_name = cells[i]["cellName"];
+            string desired_contents = cells[i]["contents"];
+            sink += cell_name.size() + desired_contents.size();
+        }
+    }
+}
+
+/* The current path. The line is copied into a reused receive buffer, as a socket read would,
+    then parsed in place */
+void new_path(const string& line, string& buffer, request& req) {
+    buffer.assign(line);
+    if(!parse_request(&buffer[0], &buffer[0] + buffer.size(), req))
+        return;
+
+    switch(req.type) {
+        case request_type::edit_cell:
+            sink += req.cell_name.size() + req.contents.size();
+            break;
+        case request_type::select_cell:
+            sink += req.cell_name.size();
+            break;
+        case request_type::edit_cells:
+            for(int i = 0; i < req.cells.size(); i++)
+                sink += req.cells[i].cell_name.size() + req.cells[i].contents.size();
+            break;
+        default:
+            break;
+    }
+}
+
+/* Returns the median nanoseconds per call of f over REPETITIONS runs of the given iterations */
+template <typename F>
+double median_ns(int iterations, F f) {
+    vector<double> results;
+    for(int r = 0; r < REPETITIONS; r++) {
+        auto start = chrono::steady_clock::now();
+        for(int i = 0; i < iterations; i++)
+            f();
+        auto elapsed = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+        results.push_back(elapsed / iterations);
+    }
+    sort(results.begin(), results.end());
+    return results[results.size() / 2];
+}
+
+void run_case(const string& name, const string& line, int iterations) {
+    string buffer;
+    request req;
+
+    double old_ns = median_ns(iterations, [&] { old_path(line); });
+    double new_ns = median_ns(iterations, [&] { new_path(line, buffer, req); });
+
+    cout << name << ": old " << old_ns << " ns, in place " << new_ns << " ns, speedup "
+         << old_ns / new_ns << "x" << endl;
+}
+
+int main() {
+    json edits;
+    edits["requestType"] = "editCells";
+    edits["cells"] = json::array();
+    for(int i = 1; i <= 100; i++)
+        edits["cells"].push_back({{"cellName", "B" + to_string(i)}, {"contents", "=A" + to_string(i) + " * 2"}});
+
+    run_case("selectCell", R"req({"requestType":"selectCell","cellName":"A1"})req", 200000);
+    run_case("editCell", R"req({"requestType":"editCell","cellName":"B12","contents":"=A1 + A2 * (C3 - 4)"})req", 200000);
+    run_case("editCell escaped", R"req({"requestType":"editCell","cellName":"C7","contents":"line one\nline \"two\"\t\u00e9\u4e2d"})req", 200000);
+    run_case("editCell 4KB", json({{"requestType", "editCell"}, {"cellName", "D1"}, {"contents", string(4096, 'x')}}).dump(), 20000);
+    run_case("editCells x100", edits.dump(), 5000);
+
+    cerr << sink << endl;
+    return 0;
+}
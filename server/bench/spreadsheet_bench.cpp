@@ -0,0 +1,247 @@
+/* Microbenchmarks for the spreadsheet engine, with no sockets involved. Covers set_cell with
+    formulas of several sizes, circular_depend on deep and wide dependency graphs, get_tokens,
+    valid_formula, all_cells, revert_cell and undo with long histories, saving and loading
+    sheets with write_to_file and the file constructor, and forking a sheet compared to copying
+    it through set_cell.
+
+    Every data set is generated from a fixed pattern, so runs are comparable between commits.
+    Each case is run REPETITIONS times after a warm up run and reports the median time per
+    operation along with the fastest and slowest run, so noisy results are easy to spot.
+
+    Build from the server directory:
+        g++ -std=c++17 -O2 -I. bench/spreadsheet_bench.cpp spreadsheet.cpp protocol.cpp request.cpp metrics.cpp trace.cpp -o spreadsheet_bench -lboost_system -lpthread -lz
+
+    Run with an optional filter, which only runs cases whose name contains it:
+        ./spreadsheet_bench [filter]
+*/
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <cstdio>
+
+#include "spreadsheet.h"
+
+using namespace std;
+
+const int REPETITIONS = 7;
+
+// Sheet sizes, in cells, that the scaling cases are run at
+const int SCALES[] = { 100, 1000, 10000 };
+
+/* Keeps the compiler from optimizing away results */
+size_t sink = 0;
+
+string filter;
+
+/* Name of the i-th cell of a sheet that fills columns A to Z a row at a time */
+string cell_at(int i) {
+    return string(1, (char) ('A' + i % 26)) + to_string(i / 26 + 1);
+}
+
+/* A formula adding up the given number of cell references */
+string sum_formula(int terms) {
+    string formula = "=";
+    for(int i = 0; i < terms; i++) {
+        if(i != 0)
+            formula += " + ";
+        formula += cell_at(i);
+    }
+    return formula;
+}
+
+/* A sheet with the given number of cells, each holding a number */
+unique_ptr<spreadsheet> filled_sheet(int cells) {
+    unique_ptr<spreadsheet> sheet(new spreadsheet("bench"));
+    for(int i = 0; i < cells; i++)
+        sheet->set_cell(cell_at(i), to_string(i));
+    return sheet;
+}
+
+/* Runs setup, untimed, then op the given number of times, REPETITIONS times over plus a warm up.
+    Prints the median, fastest and slowest time per op */
+void run_case(const string& name, int iterations, function<void()> setup, function<void(int)> op) {
+    if(!filter.empty() && name.find(filter) == string::npos)
+        return;
+
+    vector<double> results;
+    for(int r = 0; r <= REPETITIONS; r++) {
+        setup();
+        auto start = chrono::steady_clock::now();
+        for(int i = 0; i < iterations; i++)
+            op(i);
+        auto elapsed = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+        if(r != 0)
+            results.push_back(elapsed / iterations);
+    }
+    sort(results.begin(), results.end());
+
+    cout << left << setw(40) << name << right << fixed << setprecision(0)
+         << setw(12) << results[results.size() / 2] << " ns/op"
+         << "   (min " << results.front() << ", max " << results.back() << ")" << endl;
+}
+
+/* Reaches the private parts of spreadsheet through its friend declaration */
+struct spreadsheet_bench {
+    static bool circular_depend(spreadsheet& sheet, const string& cell_name, const string& contents) {
+        return sheet.circular_depend(cell_name, contents);
+    }
+
+    static vector<string> get_tokens(string formula) {
+        return spreadsheet::get_tokens(&formula);
+    }
+
+    static bool valid_formula(const string& cell_name, const string& contents) {
+        return spreadsheet::valid_formula(cell_name, contents);
+    }
+};
+
+void bench_set_cell() {
+    for(int scale : SCALES) {
+        // Edits only add to the histories of existing cells, so the sheet is reused between runs
+        unique_ptr<spreadsheet> sheet = filled_sheet(scale);
+        string suffix = " n=" + to_string(scale);
+        auto setup = [] {};
+
+        run_case("set_cell value" + suffix, 200, setup, [&] (int i) {
+            sink += sheet->set_cell(cell_at(i % scale), to_string(i));
+        });
+        run_case("set_cell formula 3 terms" + suffix, 50, setup, [&] (int i) {
+            sink += sheet->set_cell("ZZ" + to_string(i + 1), sum_formula(3));
+        });
+        run_case("set_cell formula 30 terms" + suffix, 10, setup, [&] (int i) {
+            sink += sheet->set_cell("ZZ" + to_string(i + 1), sum_formula(30));
+        });
+    }
+}
+
+void bench_circular_depend() {
+    for(int depth : { 10, 100, 500 }) {
+        // A1 = A2 + 1, A2 = A3 + 1, ... so a check starting at A1 walks the whole chain
+        unique_ptr<spreadsheet> sheet(new spreadsheet("bench"));
+        for(int i = 1; i <= depth; i++)
+            sheet->set_cell("A" + to_string(i), "=A" + to_string(i + 1) + " + 1");
+
+        run_case("circular_depend chain depth=" + to_string(depth), max(2, 500 / depth), [] {}, [&] (int i) {
+            sink += spreadsheet_bench::circular_depend(*sheet, "B1", "=A1");
+        });
+    }
+
+    for(int width : { 10, 100, 500 }) {
+        // B1 refers to every one of A1 to A<width>, which each refer to the same cell
+        unique_ptr<spreadsheet> sheet(new spreadsheet("bench"));
+        for(int i = 1; i <= width; i++)
+            sheet->set_cell("A" + to_string(i), "=C1 + " + to_string(i));
+        string wide = "=";
+        for(int i = 1; i <= width; i++)
+            wide += (i == 1 ? "A" : " + A") + to_string(i);
+
+        run_case("circular_depend fan-out width=" + to_string(width), max(2, 500 / width), [] {}, [&] (int i) {
+            sink += spreadsheet_bench::circular_depend(*sheet, "B1", wide);
+        });
+    }
+}
+
+void bench_formulas() {
+    for(int terms : { 1, 10, 100 }) {
+        string formula = sum_formula(terms) + " * (3.5 - 2)";
+        string suffix = " terms=" + to_string(terms);
+
+        run_case("get_tokens" + suffix, 2000 / terms, [] {}, [&] (int i) {
+            sink += spreadsheet_bench::get_tokens(formula).size();
+        });
+        run_case("valid_formula" + suffix, 200 / terms, [] {}, [&] (int i) {
+            sink += spreadsheet_bench::valid_formula("ZZ1", formula);
+        });
+    }
+}
+
+void bench_all_cells() {
+    for(int scale : SCALES) {
+        unique_ptr<spreadsheet> sheet = filled_sheet(scale);
+        run_case("all_cells n=" + to_string(scale), max(10, 100000 / scale), [] {}, [&] (int i) {
+            sink += sheet->all_cells().size();
+        });
+    }
+}
+
+void bench_history() {
+    for(int length : { 100, 1000, 5000 }) {
+        // One cell with a long history of edits, each of which can be reverted or undone
+        const int ops = 100;
+        unique_ptr<spreadsheet> sheet;
+        auto setup = [&] {
+            sheet.reset(new spreadsheet("bench"));
+            for(int i = 0; i < length + ops; i++)
+                sheet->set_cell("A1", to_string(i));
+        };
+        string suffix = " history=" + to_string(length);
+
+        run_case("revert_cell" + suffix, ops, setup, [&] (int i) {
+            string contents;
+            sink += sheet->revert_cell("A1", &contents);
+        });
+        run_case("undo" + suffix, ops, setup, [&] (int i) {
+            sink += sheet->undo().second.size();
+        });
+    }
+}
+
+void bench_files() {
+    string path = "./spreadsheet_bench.sht";
+    for(int scale : SCALES) {
+        unique_ptr<spreadsheet> sheet = filled_sheet(scale);
+        int iterations = max(3, 10000 / scale);
+
+        run_case("write_to_file n=" + to_string(scale), iterations, [] {}, [&] (int i) {
+            sheet->write_to_file(path);
+        });
+        run_case("file constructor n=" + to_string(scale), iterations, [] {}, [&] (int i) {
+            spreadsheet loaded(path, true);
+            sink += loaded.all_cells().size();
+        });
+    }
+    remove(path.c_str());
+}
+
+void bench_fork() {
+    for(int scale : SCALES) {
+        unique_ptr<spreadsheet> sheet = filled_sheet(scale);
+        vector<pair<string, string>> cells = sheet->all_cells();
+        vector<unique_ptr<spreadsheet>> copies;
+        auto setup = [&] { copies.clear(); };
+        string suffix = " n=" + to_string(scale);
+
+        run_case("fork" + suffix, 100, setup, [&] (int i) {
+            copies.emplace_back(sheet->fork("copy"));
+        });
+        // The first edit of a fork copies the tile holding the cell
+        run_case("fork then set_cell" + suffix, 100, setup, [&] (int i) {
+            copies.emplace_back(sheet->fork("copy"));
+            sink += copies.back()->set_cell(cell_at(i % scale), "edited");
+        });
+        run_case("copy through set_cell" + suffix, max(1, 1000 / scale), setup, [&] (int i) {
+            copies.emplace_back(new spreadsheet("copy"));
+            for(int j = 0; j < cells.size(); j++)
+                sink += copies.back()->set_cell(cells[j].first, cells[j].second);
+        });
+    }
+}
+
+int main(int argc, char** argv) {
+    if(argc > 1)
+        filter = argv[1];
+
+    bench_set_cell();
+    bench_circular_depend();
+    bench_formulas();
+    bench_all_cells();
+    bench_history();
+    bench_files();
+    bench_fork();
+
+    cerr << sink << endl;
+    return 0;
+}
@@ -0,0 +1,198 @@
+/* Compares the ways spreadsheets can be saved and loaded: the stream path (write_to_file and the file
+    constructor, with file streams on the calling thread) against disk_io with its blocking and io_uring
+    backends. Saving is timed for a number of spreadsheets at once, as on shutdown or a checkpoint, and
+    with every file synced to disk, since a save that is not synced can still be lost.
+
+    For disk_io, the total time of a case is reported next to the time the calling thread spent queueing
+    the operations, which is the part a request thread would wait for.
+
+    Every data set is generated from a fixed pattern, so runs are comparable between commits. Each case
+    is run REPETITIONS times after a warm up run and reports the median time along with the fastest and
+    slowest run. Files are written to ./storage_bench/ in the current directory, which is removed after.
+
+    Build from the server directory:
+        g++ -std=c++17 -O2 -I. bench/storage_bench.cpp disk_io.cpp spreadsheet.cpp protocol.cpp request.cpp metrics.cpp trace.cpp -o storage_bench -lboost_system -lpthread -lz
+
+    Run with an optional filter, which only runs cases whose name contains it:
+        ./storage_bench [filter]
+*/
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "spreadsheet.h"
+#include "disk_io.h"
+
+using namespace std;
+
+const int REPETITIONS = 7;
+
+// Numbers of spreadsheets saved or loaded together, and the cells in each
+const int SHEET_COUNTS[] = { 1, 16, 64 };
+const int CELLS_PER_SHEET = 1000;
+
+const string DIRECTORY = "./storage_bench/";
+
+/* Keeps the compiler from optimizing away results */
+size_t sink = 0;
+
+string filter;
+
+/* Name of the i-th cell of a sheet that fills columns A to Z a row at a time */
+string cell_at(int i) {
+    return string(1, (char) ('A' + i % 26)) + to_string(i / 26 + 1);
+}
+
+/* Spreadsheets with CELLS_PER_SHEET cells each */
+vector<unique_ptr<spreadsheet>> filled_sheets(int count) {
+    vector<unique_ptr<spreadsheet>> sheets;
+    for(int s = 0; s < count; s++) {
+        sheets.emplace_back(new spreadsheet("sheet" + to_string(s)));
+        for(int i = 0; i < CELLS_PER_SHEET; i++)
+            sheets.back()->set_cell(cell_at(i), to_string(i * 7919));
+    }
+    return sheets;
+}
+
+string path_of(int sheet) {
+    return DIRECTORY + "sheet" + to_string(sheet) + ".sht";
+}
+
+/* Runs setup, untimed, then op, REPETITIONS times over plus a warm up. op returns the nanoseconds the
+    calling thread was busy, or a negative number when that is the whole run. Prints the median total
+    time and, when there is one, the median time of the calling thread */
+void run_case(const string& name, function<void()> setup, function<double()> op) {
+    if(!filter.empty() && name.find(filter) == string::npos)
+        return;
+
+    vector<double> totals;
+    vector<double> callers;
+    for(int r = 0; r <= REPETITIONS; r++) {
+        setup();
+        auto start = chrono::steady_clock::now();
+        double caller = op();
+        auto elapsed = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+        if(r != 0) {
+            totals.push_back(elapsed);
+            callers.push_back(caller / 1000);
+        }
+    }
+    sort(totals.begin(), totals.end());
+    sort(callers.begin(), callers.end());
+
+    cout << left << setw(44) << name << right << fixed << setprecision(0)
+         << setw(10) << totals[totals.size() / 2] << " us"
+         << "   (min " << totals.front() << ", max " << totals.back() << ")";
+    if(callers.back() >= 0)
+        cout << "   caller " << callers[callers.size() / 2] << " us";
+    cout << endl;
+}
+
+double since(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+}
+
+void sync_path(const string& path) {
+    int fd = open(path.c_str(), O_WRONLY);
+    sink += fsync(fd);
+    close(fd);
+}
+
+/* Saves every sheet through disk_io, each encoded on the calling thread as the server does */
+double save_with(disk_io& disk, vector<unique_ptr<spreadsheet>>& sheets) {
+    auto start = chrono::steady_clock::now();
+    for(int s = 0; s < sheets.size(); s++) {
+        shared_ptr<string> contents = make_shared<string>();
+        sheets[s]->encode_file(*contents);
+        disk.write_file(path_of(s), contents, true, [] (int error) { sink += error; });
+    }
+    double caller = since(start);
+    disk.wait();
+    return caller;
+}
+
+/* Loads every sheet through disk_io. Parsing happens on the calling thread once everything is read */
+double load_with(disk_io& disk, int count) {
+    vector<string> contents(count);
+    auto start = chrono::steady_clock::now();
+    for(int s = 0; s < count; s++)
+        disk.read_file(path_of(s), [&contents, s] (int error, string& data) { contents[s].swap(data); });
+    double caller = since(start);
+    disk.wait();
+
+    for(int s = 0; s < count; s++) {
+        spreadsheet loaded("loaded");
+        loaded.decode_file(contents[s]);
+        sink += loaded.all_cells().size();
+    }
+    return caller;
+}
+
+void bench_save_and_load() {
+    disk_io blocking(disk_backend::blocking);
+    disk_io uring(disk_backend::uring);
+    if(uring.backend() != disk_backend::uring)
+        cout << "io_uring is not available, the uring cases use blocking calls" << endl;
+
+    for(int count : SHEET_COUNTS) {
+        vector<unique_ptr<spreadsheet>> sheets = filled_sheets(count);
+        string suffix = " sheets=" + to_string(count);
+        auto setup = [] {};
+
+        run_case("stream save" + suffix, setup, [&] {
+            for(int s = 0; s < count; s++)
+                sheets[s]->write_to_file(path_of(s));
+            return -1.0;
+        });
+        run_case("stream save + fsync" + suffix, setup, [&] {
+            for(int s = 0; s < count; s++) {
+                sheets[s]->write_to_file(path_of(s));
+                sync_path(path_of(s));
+            }
+            return -1.0;
+        });
+        run_case("blocking disk_io save + fsync" + suffix, setup, [&] {
+            return save_with(blocking, sheets);
+        });
+        run_case("uring disk_io save + fsync" + suffix, setup, [&] {
+            return save_with(uring, sheets);
+        });
+
+        run_case("stream load" + suffix, setup, [&] {
+            for(int s = 0; s < count; s++) {
+                spreadsheet loaded(path_of(s), true);
+                sink += loaded.all_cells().size();
+            }
+            return -1.0;
+        });
+        run_case("blocking disk_io load" + suffix, setup, [&] {
+            return load_with(blocking, count);
+        });
+        run_case("uring disk_io load" + suffix, setup, [&] {
+            return load_with(uring, count);
+        });
+    }
+}
+
+int main(int argc, char** argv) {
+    if(argc > 1)
+        filter = argv[1];
+
+    mkdir(DIRECTORY.c_str(), 0755);
+    bench_save_and_load();
+
+    for(int s = 0; s < SHEET_COUNTS[sizeof(SHEET_COUNTS) / sizeof(SHEET_COUNTS[0]) - 1]; s++)
+        remove(path_of(s).c_str());
+    rmdir(DIRECTORY.c_str());
+
+    cerr << sink << endl;
+    return 0;
+}
@@ -0,0 +1,155 @@
+#include "broadcast_log.h"
+
+#include <algorithm>
+#include <cstring>
+
+/**
+  * broadcast_chunk
+  */
+broadcast_chunk::broadcast_chunk(size_t capacity, uint64_t start, atomic<size_t> *held)
+  : data(new char[capacity]), capacity(capacity), start(start), published(0), held(held)
+{
+  held->fetch_add(sizeof(broadcast_chunk) + capacity, memory_order_relaxed);
+}
+
+/**
+  * ~broadcast_chunk
+  */
+broadcast_chunk::~broadcast_chunk()
+{
+  held->fetch_sub(sizeof(broadcast_chunk) + capacity, memory_order_relaxed);
+}
+
+/**
+  * position
+  */
+uint64_t broadcast_cursor::position() const
+{
+  return chunk->start + offset;
+}
+
+/**
+  * broadcast_log
+  */
+broadcast_log::broadcast_log()
+  : held(0), total(0)
+{
+}
+
+/**
+  * append
+  * A message that does not fit in the rest of the tail chunk starts a new chunk, which is made
+  * large enough for it
+  */
+void broadcast_log::append(string_view data)
+{
+  log_mutex.lock();
+  size_t published = tail == nullptr ? 0 : tail->published.load(memory_order_relaxed);
+  if(tail == nullptr || tail->capacity - published < data.size()) {
+    shared_ptr<broadcast_chunk> chunk = make_shared<broadcast_chunk>(max(BROADCAST_CHUNK_SIZE, data.size()), total.load(memory_order_relaxed), &held);
+    if(tail != nullptr)
+      tail->next = chunk;
+    tail = chunk;
+    published = 0;
+  }
+  memcpy(tail->data.get() + published, data.data(), data.size());
+  tail->published.store(published + data.size(), memory_order_release);
+  total.store(tail->start + published + data.size(), memory_order_relaxed);
+  log_mutex.unlock();
+}
+
+/**
+  * wake
+  */
+void broadcast_log::wake()
+{
+  unordered_map<uint64_t, function<void()>> woken;
+  log_mutex.lock();
+  woken.swap(waiting);
+  log_mutex.unlock();
+
+  for(unordered_map<uint64_t, function<void()>>::iterator i = woken.begin(); i != woken.end(); i++)
+    i->second();
+}
+
+/**
+  * end
+  */
+uint64_t broadcast_log::end() const
+{
+  return total.load(memory_order_relaxed);
+}
+
+/**
+  * held_bytes
+  */
+size_t broadcast_log::held_bytes() const
+{
+  return held.load(memory_order_relaxed);
+}
+
+/**
+  * tail_cursor
+  */
+broadcast_cursor broadcast_log::tail_cursor()
+{
+  broadcast_cursor cursor;
+  log_mutex.lock();
+  if(tail == nullptr)
+    tail = make_shared<broadcast_chunk>(BROADCAST_CHUNK_SIZE, total.load(memory_order_relaxed), &held);
+  cursor.chunk = tail;
+  cursor.offset = tail->published.load(memory_order_relaxed);
+  log_mutex.unlock();
+  return cursor;
+}
+
+/**
+  * readable
+  * Moves the cursor on to the next chunk when it has read all of the current one
+  */
+string_view broadcast_log::readable(broadcast_cursor &cursor)
+{
+  size_t published = cursor.chunk->published.load(memory_order_acquire);
+  if(cursor.offset == published) {
+    log_mutex.lock();
+    shared_ptr<broadcast_chunk> next = cursor.chunk->next;
+    log_mutex.unlock();
+    if(next == nullptr)
+      return string_view();
+
+    // The current chunk is full once there is a next one, so nothing more will be published in it
+    if(cursor.offset == cursor.chunk->published.load(memory_order_acquire)) {
+      cursor.chunk = next;
+      cursor.offset = 0;
+      published = next->published.load(memory_order_acquire);
+    }
+    else
+      published = cursor.chunk->published.load(memory_order_acquire);
+  }
+  return string_view(cursor.chunk->data.get() + cursor.offset, published - cursor.offset);
+}
+
+/**
+  * wait
+  */
+bool broadcast_log::wait(broadcast_cursor &cursor, function<void()> wake, uint64_t &ticket)
+{
+  log_mutex.lock();
+  bool caught_up = cursor.offset == cursor.chunk->published.load(memory_order_acquire) && cursor.chunk->next == nullptr;
+  if(caught_up) {
+    ticket = next_ticket++;
+    waiting.emplace(ticket, move(wake));
+  }
+  log_mutex.unlock();
+  return caught_up;
+}
+
+/**
+  * cancel
+  */
+void broadcast_log::cancel(uint64_t ticket)
+{
+  log_mutex.lock();
+  waiting.erase(ticket);
+  log_mutex.unlock();
+}
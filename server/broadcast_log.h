@@ -0,0 +1,83 @@
+#ifndef BROADCAST_LOG_H
+#define BROADCAST_LOG_H
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+
+using namespace std;
+
+/* Encoded messages are appended to chunks of at least BROADCAST_CHUNK_SIZE bytes. A message is never
+  split between chunks */
+const size_t BROADCAST_CHUNK_SIZE = 64 * 1024;
+
+/* A chunk of the log. Bytes before published are never changed again, so readers may use them
+  without a lock. next is set once, when the chunk is full, and is read under the log_mutex */
+struct broadcast_chunk {
+  unique_ptr<char[]> data;
+  size_t capacity;
+  // Position of the first byte of this chunk in the whole log
+  uint64_t start;
+  atomic<size_t> published;
+  shared_ptr<broadcast_chunk> next;
+  // Bytes of every chunk of the log that is still alive, which this chunk counts itself in until it is freed
+  atomic<size_t> *held;
+
+  broadcast_chunk(size_t capacity, uint64_t start, atomic<size_t> *held);
+  ~broadcast_chunk();
+};
+
+/* A reader's place in a log. Holding the chunk keeps it, and every chunk after it, alive */
+struct broadcast_cursor {
+  shared_ptr<broadcast_chunk> chunk;
+  size_t offset = 0;
+
+  uint64_t position() const;
+};
+
+/* An append-only log of messages shared by many readers, each of which reads at its own pace from its
+  own cursor. Appending copies the message once, however many readers there are, and reading takes no
+  lock except when moving on to the next chunk. Chunks that every reader has moved past are freed.
+
+  A reader that has caught up registers a callback with wait, which is called once by the next call to
+  wake unless the reader cancels it first, as it does when it goes away. The writer decides when to wake readers: after every append, or after a batch of appends so that
+  each reader sends the whole batch with one write. Callbacks are called with the log_mutex released, so
+  they may read or wait again right away */
+class broadcast_log {
+  mutex log_mutex;
+  // Declared before tail, so it is still there when the chunks are freed along with the log
+  atomic<size_t> held;
+  // The chunk being appended to, which is only allocated once there is a reader or something to append
+  shared_ptr<broadcast_chunk> tail;
+  // Callbacks registered with wait, by the ticket wait handed out for them
+  unordered_map<uint64_t, function<void()>> waiting;
+  uint64_t next_ticket = 1;
+  atomic<uint64_t> total;
+
+  public:
+    broadcast_log();
+
+    void append(string_view data);
+    // Calls every callback registered with wait
+    void wake();
+    // Bytes appended since the log was created
+    uint64_t end() const;
+    // Bytes of the chunks that are still alive, from the oldest one a reader is at to the tail
+    size_t held_bytes() const;
+    // A cursor at the end of the log, which will read everything appended from now on
+    broadcast_cursor tail_cursor();
+    // The bytes that can be read at the cursor, which are whole messages. Empty when the reader has caught up
+    string_view readable(broadcast_cursor &cursor);
+    /* Calls the callback on the next wake, unless there is something to read already, in which case it
+      returns false. Otherwise ticket is set to what cancel takes to remove the callback */
+    bool wait(broadcast_cursor &cursor, function<void()> wake, uint64_t &ticket);
+    // Removes a callback registered with wait, if it has not been called yet
+    void cancel(uint64_t ticket);
+};
+
+#endif
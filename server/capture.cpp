@@ -0,0 +1,182 @@
+#include "capture.h"
+
+#include <mutex>
+#include <cstring>
+
+#include "protocol.h"
+#include "trace.h"
+
+const char CAPTURE_MAGIC[] = "SSCAPTURE1\n";
+
+// Records are kept in memory until there is this much to write
+const size_t CAPTURE_FLUSH_SIZE = 64 * 1024;
+
+atomic<bool> capturing(false);
+
+/* The capture file and records waiting to be written to it. Accesses must be done in a thread
+  safe manner using the capture_mutex */
+FILE *capture_file = nullptr;
+string capture_buffer;
+uint64_t capture_start_ns = 0;
+mutex capture_mutex;
+
+/**
+  * write_capture
+  */
+void write_capture(capture_event event, int session, string_view data)
+{
+  uint64_t now = now_ns();
+
+  capture_mutex.lock();
+  if(capture_file != nullptr) {
+    capture_buffer += (char) event;
+    put_varint(capture_buffer, session);
+    put_varint(capture_buffer, (now - capture_start_ns) / 1000);
+    put_string(capture_buffer, data);
+
+    if(capture_buffer.size() >= CAPTURE_FLUSH_SIZE) {
+      fwrite(capture_buffer.data(), 1, capture_buffer.size(), capture_file);
+      capture_buffer.clear();
+    }
+  }
+  capture_mutex.unlock();
+}
+
+/**
+  * start_capture
+  */
+bool start_capture(const string &path)
+{
+  capture_mutex.lock();
+  capture_file = fopen(path.c_str(), "wb");
+  if(capture_file != nullptr) {
+    fwrite(CAPTURE_MAGIC, 1, strlen(CAPTURE_MAGIC), capture_file);
+    capture_start_ns = now_ns();
+    capturing.store(true);
+  }
+  capture_mutex.unlock();
+  return capture_file != nullptr;
+}
+
+/**
+  * stop_capture
+  */
+void stop_capture()
+{
+  if(!capturing.exchange(false))
+    return;
+
+  capture_mutex.lock();
+  fwrite(capture_buffer.data(), 1, capture_buffer.size(), capture_file);
+  capture_buffer.clear();
+  fclose(capture_file);
+  capture_file = nullptr;
+  capture_mutex.unlock();
+}
+
+/**
+  * encode_sheet_state
+  * The name, the number of cells, then the name and contents of each cell, all as varints and strings
+  */
+void encode_sheet_state(const string &name, const vector<pair<string, string>> &cells, string &out)
+{
+  put_string(out, name);
+  put_varint(out, cells.size());
+  for(int i = 0; i < cells.size(); i++) {
+    put_string(out, cells[i].first);
+    put_string(out, cells[i].second);
+  }
+}
+
+/**
+  * decode_sheet_state
+  */
+bool decode_sheet_state(string_view data, string &name, vector<pair<string, string>> &cells)
+{
+  const char *pos = data.data();
+  const char *end = data.data() + data.size();
+  string_view text, contents;
+  uint64_t count;
+
+  if(!get_string(pos, end, &text) || !get_varint(pos, end, &count))
+    return false;
+  name = string(text);
+
+  cells.clear();
+  for(uint64_t i = 0; i < count; i++) {
+    if(!get_string(pos, end, &text) || !get_string(pos, end, &contents))
+      return false;
+    cells.push_back(make_pair(string(text), string(contents)));
+  }
+  return pos == end;
+}
+
+/**
+  * capture_reader
+  */
+capture_reader::capture_reader(const string &path)
+{
+  file = fopen(path.c_str(), "rb");
+  if(file == nullptr)
+    return;
+
+  char magic[sizeof(CAPTURE_MAGIC)] = {};
+  if(fread(magic, 1, strlen(CAPTURE_MAGIC), file) != strlen(CAPTURE_MAGIC) || strcmp(magic, CAPTURE_MAGIC) != 0) {
+    fclose(file);
+    file = nullptr;
+  }
+}
+
+/**
+  * ~capture_reader
+  */
+capture_reader::~capture_reader()
+{
+  if(file != nullptr)
+    fclose(file);
+}
+
+/**
+  * good
+  */
+bool capture_reader::good() const
+{
+  return file != nullptr;
+}
+
+/**
+  * read_varint
+  */
+static bool read_varint(FILE *file, uint64_t *value)
+{
+  *value = 0;
+  for(int shift = 0; shift < 64; shift += 7) {
+    int c = fgetc(file);
+    if(c == EOF)
+      return false;
+    *value |= (uint64_t) (c & 0x7f) << shift;
+    if((c & 0x80) == 0)
+      return true;
+  }
+  return false;
+}
+
+/**
+  * next
+  */
+bool capture_reader::next(capture_record &record)
+{
+  if(file == nullptr)
+    return false;
+
+  int event = fgetc(file);
+  uint64_t session, time_us, size;
+  if(event == EOF || !read_varint(file, &session) || !read_varint(file, &time_us) || !read_varint(file, &size))
+    return false;
+
+  record.event = (capture_event) event;
+  record.session = session;
+  record.time_us = time_us;
+  record.data.resize(size);
+  return size == 0 || fread(&record.data[0], 1, size, file) == size;
+}
@@ -0,0 +1,74 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+
+using namespace std;
+
+/* A capture is a record of everything clients sent to the server, which bench/replay.cpp can send
+  to another server later. The file starts with CAPTURE_MAGIC, followed by records of a one byte
+  event, then the session id, the time in microseconds since the capture started, and the size of
+  the data as varints, then the data. Handshake lines are recorded as they were received, without
+  the newline. Requests are recorded as a JSON line without the newline, or as the type and payload
+  of a binary frame, depending on the wire protocol of the session. */
+enum class capture_event : unsigned char {
+  connected = 1,
+  username = 2,
+  spreadsheet = 3,
+  request = 4,
+  disconnected = 5,
+  // The cells of a spreadsheet when the capture started or stopped. Session is 0
+  sheet_state = 6
+};
+
+extern const char CAPTURE_MAGIC[];
+
+extern atomic<bool> capturing;
+
+/* Appends a record to the capture */
+void write_capture(capture_event event, int session, string_view data);
+
+/* Records an event if a capture is running */
+inline void capture(capture_event event, int session, string_view data = string_view())
+{
+  if(capturing.load(memory_order_relaxed))
+    write_capture(event, session, data);
+}
+
+bool start_capture(const string &path);
+
+// Writes the rest of the capture to the file and closes it
+void stop_capture();
+
+void encode_sheet_state(const string &name, const vector<pair<string, string>> &cells, string &out);
+bool decode_sheet_state(string_view data, string &name, vector<pair<string, string>> &cells);
+
+/* A record read back from a capture */
+struct capture_record {
+  capture_event event;
+  int session;
+  uint64_t time_us;
+  string data;
+};
+
+/* Reads the records of a capture file in order */
+class capture_reader {
+  FILE *file;
+
+  public:
+    capture_reader(const string &path);
+    ~capture_reader();
+
+    // False if the file could not be opened or is not a capture
+    bool good() const;
+    // Reads the next record. Returns false at the end of the file or on a cut off record
+    bool next(capture_record &record);
+};
+
+#endif
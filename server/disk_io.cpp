@@ -0,0 +1,583 @@
+#include "disk_io.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+// Entries in the submission queue. Operations past this many wait in the queue for an entry to free up
+const unsigned DISK_RING_ENTRIES = 256;
+
+// user_data of the eventfd read that wakes the disk thread when an operation is queued
+const uint64_t WAKE_USER_DATA = 0;
+
+enum class disk_op_kind {
+  write_file,
+  read_file
+};
+
+/* Where an operation is up to */
+enum class disk_op_stage {
+  transfer,
+  sync_file,
+  // The file has been renamed into place and its directory is being synced
+  sync_directory
+};
+
+/* A queued operation */
+struct disk_io::operation {
+  disk_op_kind kind;
+  string path;
+  int fd = -1;
+  bool sync = false;
+  disk_op_stage stage = disk_op_stage::transfer;
+  shared_ptr<const string> data;
+  size_t offset = 0;
+  string contents;
+  function<void(int)> done;
+  function<void(int, string &)> read_done;
+};
+
+/* The rings shared with the kernel, mapped into this process. Only the disk thread uses them */
+struct disk_io::uring {
+  int fd = -1;
+  void *sq_ring = MAP_FAILED;
+  void *cq_ring = MAP_FAILED;
+  size_t sq_ring_size = 0;
+  size_t cq_ring_size = 0;
+  io_uring_sqe *sqes = (io_uring_sqe *) MAP_FAILED;
+  size_t sqes_size = 0;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  io_uring_cqe *cqes;
+
+  // Entries filled in but not yet handed to the kernel, and entries the kernel has not completed
+  unsigned to_submit = 0;
+  unsigned in_flight = 0;
+  // Operations with an entry in flight, not counting the wake read
+  unsigned ops_in_flight = 0;
+
+  int wake_fd = -1;
+  uint64_t wake_value = 0;
+
+  ~uring();
+  bool open();
+  io_uring_sqe *next_sqe();
+  void push_sqe();
+  void enter();
+  void arm_wake();
+};
+
+/**
+  * ~uring
+  */
+disk_io::uring::~uring()
+{
+  if(sqes != MAP_FAILED)
+    munmap(sqes, sqes_size);
+  if(cq_ring != MAP_FAILED && cq_ring != sq_ring)
+    munmap(cq_ring, cq_ring_size);
+  if(sq_ring != MAP_FAILED)
+    munmap(sq_ring, sq_ring_size);
+  if(fd >= 0)
+    close(fd);
+  if(wake_fd >= 0)
+    close(wake_fd);
+}
+
+/**
+  * open
+  * Sets up the rings. Returns false when the kernel does not allow io_uring
+  */
+bool disk_io::uring::open()
+{
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  fd = syscall(__NR_io_uring_setup, DISK_RING_ENTRIES, &params);
+  if(fd < 0)
+    return false;
+
+  sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if(single_mmap)
+    sq_ring_size = cq_ring_size = max(sq_ring_size, cq_ring_size);
+
+  sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if(sq_ring == MAP_FAILED)
+    return false;
+  cq_ring = single_mmap ? sq_ring : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  if(cq_ring == MAP_FAILED)
+    return false;
+  sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+  sqes = (io_uring_sqe *) mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if(sqes == MAP_FAILED)
+    return false;
+
+  char *sq = (char *) sq_ring;
+  char *cq = (char *) cq_ring;
+  sq_head = (unsigned *) (sq + params.sq_off.head);
+  sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+  sq_array = (unsigned *) (sq + params.sq_off.array);
+  cq_head = (unsigned *) (cq + params.cq_off.head);
+  cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+  cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+
+  wake_fd = eventfd(0, EFD_CLOEXEC);
+  return wake_fd >= 0;
+}
+
+/**
+  * next_sqe
+  * Returns the cleared entry after the tail for the caller to fill in, which the kernel does not see
+  * until push_sqe. There is always a free entry, since no more than DISK_RING_ENTRIES are ever in flight
+  */
+io_uring_sqe *disk_io::uring::next_sqe()
+{
+  io_uring_sqe *sqe = &sqes[*sq_tail & *sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+/**
+  * push_sqe
+  * Hands the entry from next_sqe to the kernel once it is filled in. The release store keeps the
+  * writes to the entry from being seen after the new tail
+  */
+void disk_io::uring::push_sqe()
+{
+  unsigned tail = *sq_tail;
+  unsigned index = tail & *sq_mask;
+  sq_array[index] = index;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+  to_submit++;
+  in_flight++;
+}
+
+/**
+  * enter
+  * Submits every entry filled in so far and waits for at least one completion
+  */
+void disk_io::uring::enter()
+{
+  int submitted;
+  do {
+    submitted = syscall(__NR_io_uring_enter, fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+  } while(submitted < 0 && errno == EINTR);
+  if(submitted > 0)
+    to_submit -= submitted;
+}
+
+/**
+  * arm_wake
+  */
+void disk_io::uring::arm_wake()
+{
+  io_uring_sqe *sqe = next_sqe();
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = wake_fd;
+  sqe->addr = (uint64_t) &wake_value;
+  sqe->len = sizeof(wake_value);
+  sqe->user_data = WAKE_USER_DATA;
+  push_sqe();
+}
+
+/**
+  * disk_io
+  */
+disk_io::disk_io(disk_backend backend)
+  : chosen(disk_backend::blocking)
+{
+  if(backend == disk_backend::uring) {
+    ring.reset(new uring());
+    if(ring->open())
+      chosen = disk_backend::uring;
+    else
+      ring.reset();
+  }
+
+  if(chosen == disk_backend::uring)
+    worker = thread(&disk_io::run_uring, this);
+  else
+    worker = thread(&disk_io::run_blocking, this);
+}
+
+/**
+  * ~disk_io
+  */
+disk_io::~disk_io()
+{
+  queue_mutex.lock();
+  stopping = true;
+  queue_mutex.unlock();
+  queue_changed.notify_all();
+  if(ring) {
+    uint64_t one = 1;
+    ssize_t ignored = write(ring->wake_fd, &one, sizeof(one));
+    (void) ignored;
+  }
+  worker.join();
+}
+
+/**
+  * backend
+  */
+disk_backend disk_io::backend() const
+{
+  return chosen;
+}
+
+/**
+  * write_file
+  */
+void disk_io::write_file(const string &path, shared_ptr<const string> data, bool sync, function<void(int)> done)
+{
+  operation *op = new operation();
+  op->kind = disk_op_kind::write_file;
+  op->path = path;
+  op->data = data;
+  op->sync = sync;
+  op->done = move(done);
+  queue(op);
+}
+
+/**
+  * read_file
+  */
+void disk_io::read_file(const string &path, function<void(int, string &)> done)
+{
+  operation *op = new operation();
+  op->kind = disk_op_kind::read_file;
+  op->path = path;
+  op->read_done = move(done);
+  queue(op);
+}
+
+/**
+  * wait
+  */
+void disk_io::wait()
+{
+  unique_lock<mutex> lock(queue_mutex);
+  queue_changed.wait(lock, [this] { return outstanding == 0; });
+}
+
+/**
+  * queue
+  * The uring disk thread sleeps in io_uring_enter, so it is woken through the eventfd it is reading.
+  * Only the first operation queued since the disk thread last looked at the queue needs to wake it
+  */
+void disk_io::queue(operation *op)
+{
+  queue_mutex.lock();
+  queued.push_back(op);
+  outstanding++;
+  bool wake = !wake_pending;
+  wake_pending = true;
+  queue_mutex.unlock();
+
+  if(ring && wake) {
+    uint64_t one = 1;
+    ssize_t ignored = write(ring->wake_fd, &one, sizeof(one));
+    (void) ignored;
+  }
+  else
+    queue_changed.notify_all();
+}
+
+/**
+  * run_blocking
+  */
+void disk_io::run_blocking()
+{
+  unique_lock<mutex> lock(queue_mutex);
+  while(true) {
+    queue_changed.wait(lock, [this] { return stopping || !queued.empty(); });
+    if(queued.empty())
+      return;
+    operation *op = queued.front();
+    queued.pop_front();
+    lock.unlock();
+    carry_out(op);
+    lock.lock();
+  }
+}
+
+/**
+  * carry_out
+  * Carries out a whole operation with blocking calls
+  */
+void disk_io::carry_out(operation *op)
+{
+  int error = 0;
+  if(op->kind == disk_op_kind::read_file)
+    op->fd = open(op->path.c_str(), O_RDONLY | O_CLOEXEC);
+  else
+    op->fd = open((op->path + TEMP_SUFFIX).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(op->fd < 0) {
+    finish(op, errno);
+    return;
+  }
+
+  if(op->kind == disk_op_kind::write_file) {
+    while(error == 0 && op->offset < op->data->size()) {
+      ssize_t written = write(op->fd, op->data->data() + op->offset, op->data->size() - op->offset);
+      if(written < 0 && errno != EINTR)
+        error = errno;
+      else if(written > 0)
+        op->offset += written;
+    }
+  }
+  else if(op->kind == disk_op_kind::read_file) {
+    struct stat info;
+    if(fstat(op->fd, &info) < 0)
+      error = errno;
+    else
+      op->contents.resize(info.st_size);
+    while(error == 0 && op->offset < op->contents.size()) {
+      ssize_t bytes = read(op->fd, &op->contents[op->offset], op->contents.size() - op->offset);
+      if(bytes < 0 && errno != EINTR)
+        error = errno;
+      else if(bytes == 0)
+        op->contents.resize(op->offset);
+      else if(bytes > 0)
+        op->offset += bytes;
+    }
+  }
+
+  if(error == 0 && op->sync) {
+    op->stage = disk_op_stage::sync_file;
+    if(fsync(op->fd) < 0)
+      error = errno;
+  }
+  if(error == 0 && op->kind == disk_op_kind::write_file) {
+    error = replace(op);
+    if(error == 0 && op->sync && fsync(op->fd) < 0)
+      error = errno;
+  }
+  finish(op, error);
+}
+
+/**
+  * replace
+  * Renames a written file over the one it replaces. With sync, opens the directory in the place of the
+  * file for it to be synced next, so that the rename itself reaches the disk
+  */
+int disk_io::replace(operation *op)
+{
+  close(op->fd);
+  op->fd = -1;
+  if(rename((op->path + TEMP_SUFFIX).c_str(), op->path.c_str()) < 0)
+    return errno;
+
+  op->stage = disk_op_stage::sync_directory;
+  if(!op->sync)
+    return 0;
+  size_t slash = op->path.rfind('/');
+  string directory = slash == string::npos ? "." : op->path.substr(0, slash + 1);
+  op->fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  return op->fd < 0 ? errno : 0;
+}
+
+/**
+  * run_uring
+  * Starts every queued operation there is room for, hands the new entries to the kernel, and carries on
+  * each operation whose entry completed. Stops once asked to and nothing is left to do
+  */
+void disk_io::run_uring()
+{
+  ring->arm_wake();
+  while(true) {
+    queue_mutex.lock();
+    wake_pending = false;
+    while(!queued.empty() && ring->in_flight < DISK_RING_ENTRIES) {
+      operation *op = queued.front();
+      queued.pop_front();
+      queue_mutex.unlock();
+      start(op);
+      queue_mutex.lock();
+    }
+    bool done = stopping && queued.empty() && ring->ops_in_flight == 0;
+    queue_mutex.unlock();
+    if(done)
+      return;
+
+    ring->enter();
+
+    unsigned head = *ring->cq_head;
+    while(head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      io_uring_cqe cqe = ring->cqes[head & *ring->cq_mask];
+      head++;
+      __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+      ring->in_flight--;
+
+      if(cqe.user_data == WAKE_USER_DATA)
+        ring->arm_wake();
+      else {
+        ring->ops_in_flight--;
+        advance((operation *) cqe.user_data, cqe.res);
+      }
+    }
+  }
+}
+
+/**
+  * start
+  * Opening a file is not worth an entry of its own, so the disk thread opens it before submitting the
+  * first read or write, and likewise renames a written file into place itself
+  */
+void disk_io::start(operation *op)
+{
+  if(op->kind == disk_op_kind::read_file)
+    op->fd = open(op->path.c_str(), O_RDONLY | O_CLOEXEC);
+  else
+    op->fd = open((op->path + TEMP_SUFFIX).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(op->fd < 0) {
+    finish(op, errno);
+    return;
+  }
+
+  if(op->kind == disk_op_kind::read_file) {
+    struct stat info;
+    if(fstat(op->fd, &info) < 0) {
+      finish(op, errno);
+      return;
+    }
+    op->contents.resize(info.st_size);
+    if(op->contents.empty()) {
+      finish(op, 0);
+      return;
+    }
+  }
+  else if(op->data->empty()) {
+    written(op);
+    return;
+  }
+  submit(op);
+}
+
+/**
+  * written
+  * Carries on with a write once all of its data is in the file: syncs the file, then renames it into
+  * place and syncs its directory
+  */
+void disk_io::written(operation *op)
+{
+  if(op->sync && op->stage == disk_op_stage::transfer) {
+    op->stage = disk_op_stage::sync_file;
+    submit(op);
+    return;
+  }
+  int error = replace(op);
+  if(error == 0 && op->sync)
+    submit(op);
+  else
+    finish(op, error);
+}
+
+/**
+  * submit
+  * Fills in the entry for the next step of the operation
+  */
+void disk_io::submit(operation *op)
+{
+  io_uring_sqe *sqe = ring->next_sqe();
+  ring->ops_in_flight++;
+  sqe->fd = op->fd;
+  sqe->user_data = (uint64_t) op;
+
+  if(op->stage != disk_op_stage::transfer)
+    sqe->opcode = IORING_OP_FSYNC;
+  else if(op->kind == disk_op_kind::read_file) {
+    sqe->opcode = IORING_OP_READ;
+    sqe->addr = (uint64_t) &op->contents[op->offset];
+    sqe->len = op->contents.size() - op->offset;
+    sqe->off = op->offset;
+  }
+  else {
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->addr = (uint64_t) (op->data->data() + op->offset);
+    sqe->len = op->data->size() - op->offset;
+    sqe->off = op->offset;
+  }
+  ring->push_sqe();
+}
+
+/**
+  * advance
+  * Carries on with an operation once its entry has completed. A short read or write is continued
+  * from where it stopped
+  */
+void disk_io::advance(operation *op, int result)
+{
+  if(result == -EINTR || result == -EAGAIN) {
+    submit(op);
+    return;
+  }
+  if(result < 0) {
+    finish(op, -result);
+    return;
+  }
+  if(op->stage == disk_op_stage::sync_directory) {
+    finish(op, 0);
+    return;
+  }
+  if(op->stage == disk_op_stage::sync_file) {
+    written(op);
+    return;
+  }
+
+  op->offset += result;
+  if(op->kind == disk_op_kind::read_file) {
+    if(result == 0)
+      op->contents.resize(op->offset);
+    if(result == 0 || op->offset == op->contents.size())
+      finish(op, 0);
+    else
+      submit(op);
+  }
+  else if(result == 0)
+    finish(op, EIO);
+  else if(op->offset < op->data->size())
+    submit(op);
+  else
+    written(op);
+}
+
+/**
+  * finish
+  * Calls the callback
+  */
+void disk_io::finish(operation *op, int error)
+{
+  if(op->fd >= 0)
+    close(op->fd);
+  // A write that failed before its rename leaves the file as it was
+  if(error != 0 && op->kind == disk_op_kind::write_file && op->stage != disk_op_stage::sync_directory)
+    unlink((op->path + TEMP_SUFFIX).c_str());
+
+  if(op->kind == disk_op_kind::read_file)
+    op->read_done(error, op->contents);
+  else
+    op->done(error);
+
+  queue_mutex.lock();
+  outstanding--;
+  queue_mutex.unlock();
+  queue_changed.notify_all();
+  delete op;
+}
@@ -0,0 +1,81 @@
+#ifndef DISK_IO_H
+#define DISK_IO_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+using namespace std;
+
+/* Saving and loading spreadsheets off the request threads. Every operation is queued for the disk
+  thread, which carries it out and then calls its callback, on the disk thread, with 0 or the errno it
+  failed with.
+
+  The blocking backend carries out one operation at a time with ordinary system calls. The uring
+  backend hands every operation waiting when the disk thread wakes up to the kernel with a single
+  io_uring_enter, and carries each one on as its completions come in, so many files are written and
+  synced at once. It talks to the kernel directly through <linux/io_uring.h>, and the blocking backend is used instead
+  when io_uring is not available */
+// Appended to the path of a file while it is being written
+const string TEMP_SUFFIX = ".tmp";
+
+enum class disk_backend {
+  blocking,
+  uring
+};
+
+class disk_io {
+  struct operation;
+  struct uring;
+
+  disk_backend chosen;
+  unique_ptr<uring> ring;
+  thread worker;
+
+  /* Operations waiting for the disk thread, and the number queued but not yet done. Accesses must be
+    done in a thread safe manner using the queue_mutex */
+  mutex queue_mutex;
+  condition_variable queue_changed;
+  deque<operation *> queued;
+  size_t outstanding = 0;
+  bool stopping = false;
+  // Set once the uring disk thread has been woken for the operations queued since it last took them
+  bool wake_pending = false;
+
+  void run_blocking();
+  void run_uring();
+  void carry_out(operation *op);
+  void start(operation *op);
+  void advance(operation *op, int result);
+  void finish(operation *op, int error);
+  void submit(operation *op);
+  void queue(operation *op);
+  void written(operation *op);
+  int replace(operation *op);
+
+  public:
+    explicit disk_io(disk_backend backend);
+    // Waits for every queued operation
+    ~disk_io();
+
+    // The backend in use, which is blocking when uring was asked for but is not available
+    disk_backend backend() const;
+
+    /* Replaces the contents of the file, then syncs it to disk when sync is set. The data is written to
+      the path followed by TEMP_SUFFIX and renamed over the file once complete, so a crash part way
+      through leaves either the old contents or the new ones. With sync, the file is synced before the
+      rename and its directory after it */
+    void write_file(const string &path, shared_ptr<const string> data, bool sync, function<void(int)> done);
+    // Reads a whole file. The contents may be moved out of the string
+    void read_file(const string &path, function<void(int, string &)> done);
+    // Blocks until every operation queued so far is done
+    void wait();
+};
+
+#endif
@@ -0,0 +1,371 @@
+#include "logger.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <cstring>
+
+// Records each thread can hold before the logging thread gets to them. Must be a power of two
+const size_t LOG_RING_RECORDS = 8192;
+
+// How long the logging thread sleeps when every ring is empty
+const chrono::milliseconds LOG_IDLE_DELAY(2);
+
+/* Records written by one thread. Only that thread moves head and only the logging thread
+  moves tail, so neither side needs a lock */
+struct log_ring {
+  log_record records[LOG_RING_RECORDS];
+  atomic<size_t> head{0};
+  atomic<size_t> tail{0};
+  atomic<uint64_t> dropped{0};
+};
+
+atomic<log_level> current_log_level(log_level::info);
+
+/* Every ring ever created. Rings are never freed, since a record may still be waiting in the ring
+  of a thread that has ended. Accesses must be done in a thread safe manner using the rings_mutex */
+vector<log_ring*> rings;
+mutex rings_mutex;
+
+thread_local log_ring *thread_ring = nullptr;
+
+thread logging_thread;
+atomic<bool> logging(false);
+
+/**
+  * write_record
+  */
+void write_record(log_level level, log_event event, int client, string_view first, string_view second,
+  int64_t value0, int64_t value1, int64_t value2, int64_t value3)
+{
+  if(thread_ring == nullptr) {
+    thread_ring = new log_ring();
+    rings_mutex.lock();
+    rings.push_back(thread_ring);
+    rings_mutex.unlock();
+  }
+
+  log_ring& ring = *thread_ring;
+  size_t head = ring.head.load(memory_order_relaxed);
+  if(head - ring.tail.load(memory_order_acquire) == LOG_RING_RECORDS) {
+    ring.dropped.fetch_add(1, memory_order_relaxed);
+    return;
+  }
+
+  log_record& record = ring.records[head & (LOG_RING_RECORDS - 1)];
+  record.client = client;
+  record.event = event;
+  record.level = level;
+  record.values[0] = value0;
+  record.values[1] = value1;
+  record.values[2] = value2;
+  record.values[3] = value3;
+
+  string_view texts[2] = { first, second };
+  for(int i = 0; i < 2; i++) {
+    record.text_size[i] = texts[i].size() > UINT16_MAX ? UINT16_MAX : texts[i].size();
+    memcpy(record.text[i], texts[i].data(), min(texts[i].size(), LOG_TEXT_SIZE));
+  }
+
+  ring.head.store(head + 1, memory_order_release);
+}
+
+/**
+  * append_text
+  */
+static void append_text(const log_record& record, int i, string& out)
+{
+  out.append(record.text[i], min((size_t) record.text_size[i], LOG_TEXT_SIZE));
+  if(record.text_size[i] > LOG_TEXT_SIZE)
+    out += "... (" + to_string(record.text_size[i]) + (record.text_size[i] == UINT16_MAX ? "+" : "") + " bytes)";
+}
+
+/**
+  * format_record
+  */
+static void format_record(const log_record& record, unordered_map<int, string>& usernames, string& out)
+{
+  string client = to_string(record.client);
+  string user;
+  if(usernames.find(record.client) != usernames.end())
+    user = "Client " + client + " (" + usernames[record.client] + ") ";
+  else
+    user = "Client " + client + " ";
+
+  switch(record.event) {
+    case log_event::listening:
+      out += "[status] Now listening for clients";
+      break;
+    case log_event::client_accepted:
+      out += "[update] Client has been accepted, id: " + client;
+      break;
+    case log_event::client_disconnected:
+      out += "[update] Client " + client + " has disconnected";
+      usernames.erase(record.client);
+      break;
+    case log_event::username_received:
+      out += "[handshake] username received: ";
+      append_text(record, 0, out);
+      if(record.values[0] != 0)
+        out += " (binary protocol)";
+      if(record.values[1] != 0)
+        out += " (observer)";
+      usernames[record.client] = string(record.text[0], min((size_t) record.text_size[0], LOG_TEXT_SIZE));
+      break;
+    case log_event::spreadsheet_received:
+      out += "[handshake] spreadsheet name received: ";
+      append_text(record, 0, out);
+      break;
+    case log_event::spreadsheet_sent:
+      out += "[handshake] sent " + to_string(record.values[0]) + " cells and " + to_string(record.values[1])
+        + " selections to client " + client + " (" + to_string(record.values[2]) + " bytes in "
+        + to_string(record.values[3]) + " chunks)";
+      break;
+    case log_event::spreadsheet_resumed:
+      out += "[handshake] sent " + to_string(record.values[0]) + " missed changes and " + to_string(record.values[1])
+        + " selections to client " + client + ", resuming after change " + to_string(record.values[3]) + " ("
+        + to_string(record.values[2]) + " bytes)";
+      break;
+    case log_event::spreadsheet_forked:
+      out += record.values[0] != 0 ? "[handshake] Client " + client + " has forked spreadsheet "
+        : "[error] Client " + client + " could not fork spreadsheet ";
+      append_text(record, 0, out);
+      out += " from ";
+      append_text(record, 1, out);
+      if(record.values[0] == 0)
+        out += ", which is not held by this server. It starts empty";
+      break;
+    case log_event::request_received:
+      out += "[update] Client " + client + " has sent: ";
+      append_text(record, 0, out);
+      break;
+    case log_event::binary_request_received:
+      out += "[update] Client " + client + " has sent a binary request of " + to_string(record.values[0]) + " bytes";
+      break;
+    case log_event::bad_message:
+      out += "[error] Client " + client + " has sent a bad message";
+      break;
+    case log_event::bad_frame:
+      out += "[error] Client " + client + " has sent a bad binary frame";
+      break;
+    case log_event::edit_requested:
+    case log_event::cell_edited:
+    case log_event::edit_refused:
+      out += "[update] " + user;
+      out += record.event == log_event::edit_requested ? "has requested to edit a cell. cellName: "
+        : record.event == log_event::cell_edited ? "has edited a cell. cellName: " : "was unable to edit a cell. cellName: ";
+      append_text(record, 0, out);
+      out += " to new contents ";
+      append_text(record, 1, out);
+      break;
+    case log_event::edit_over_limit:
+      out += "[update] " + user + "was refused an edit past a memory limit (" + to_string(record.values[0]) + " of "
+        + to_string(record.values[1]) + " bytes). cellName: ";
+      append_text(record, 0, out);
+      out += ". ";
+      append_text(record, 1, out);
+      break;
+    case log_event::edits_requested:
+      out += "[update] " + user + "has requested to edit " + to_string(record.values[0]) + " cells";
+      break;
+    case log_event::cells_edited:
+      out += "[update] " + user + "has edited " + to_string(record.values[0]) + " of " + to_string(record.values[1]) + " cells";
+      break;
+    case log_event::select_requested:
+      out += "[update] " + user + "has requested to select a cell. cellName: ";
+      append_text(record, 0, out);
+      break;
+    case log_event::cell_selected:
+      out += "[update] " + user + "has selected a cell. cellName: ";
+      append_text(record, 0, out);
+      break;
+    case log_event::select_refused:
+      out += "[update] " + user + "was unable to select the cell. cellName: ";
+      append_text(record, 0, out);
+      break;
+    case log_event::undo_requested:
+      out += "[update] " + user + "has requested to undo";
+      break;
+    case log_event::undo_done:
+    case log_event::revert_done:
+      out += "[update] " + user + (record.event == log_event::undo_done ? "has performed undo" : "has performed revert");
+      out += ". Results: cellName: ";
+      append_text(record, 0, out);
+      out += " to new contents ";
+      append_text(record, 1, out);
+      break;
+    case log_event::undo_refused:
+      out += "[update] " + user + "was unable to undo";
+      break;
+    case log_event::revert_requested:
+      out += "[update] " + user + "has requested to revert a cell. cellName: ";
+      append_text(record, 0, out);
+      break;
+    case log_event::revert_refused:
+      out += "[update] " + user + "was unable to revert a cell. cellName: ";
+      append_text(record, 0, out);
+      break;
+    case log_event::viewport_set:
+      if(record.values[0] == 0)
+        out += "[update] Client " + client + " has subscribed to the whole spreadsheet";
+      else
+        out += "[update] Client " + client + " has set its viewport to " + to_string(record.values[0]) + " columns by "
+          + to_string(record.values[1]) + " rows";
+      out += " and was sent " + to_string(record.values[2]) + " cells";
+      break;
+    case log_event::viewport_refused:
+      out += "[update] Client " + client + " was unable to set its viewport. from: ";
+      append_text(record, 0, out);
+      out += " to: ";
+      append_text(record, 1, out);
+      break;
+    case log_event::request_throttled:
+      out += "[update] " + user + "has sent too many requests and was refused. cellName: ";
+      append_text(record, 0, out);
+      break;
+    case log_event::admission_paused:
+    case log_event::admission_resumed:
+      out += record.event == log_event::admission_paused ? "[error] Server is overloaded, no longer accepting clients ("
+        : "[update] Server is accepting clients again (";
+      out += to_string(record.values[0]) + " clients in the handshake, " + to_string(record.values[1]) + " bytes queued)";
+      break;
+    case log_event::handshake_timeout:
+      out += "[error] Client " + client + " did not finish the handshake within " + to_string(record.values[0]) + " ms and is being disconnected";
+      break;
+    case log_event::slow_client:
+      out += "[error] Client " + client + " has fallen too far behind (" + to_string(record.values[0]) + " messages, "
+        + to_string(record.values[1]) + " bytes queued) and is being disconnected";
+      break;
+    case log_event::handed_off:
+      if(record.values[1] != 0)
+        out += "[handshake] Client " + client + " has been handed to shard " + to_string(record.values[0]);
+      else
+        out += "[error] Client " + client + " could not be handed to shard " + to_string(record.values[0]);
+      break;
+    case log_event::follower_connected:
+      out += "[replication] Follower has connected, sending " + to_string(record.values[0]) + " spreadsheets";
+      break;
+    case log_event::follower_dropped:
+      out += "[replication] Follower has been dropped (" + to_string(record.values[0]) + " records not applied, "
+        + to_string(record.values[1]) + " bytes queued)";
+      break;
+    case log_event::leader_connected:
+      out += "[replication] Now following the leader";
+      break;
+    case log_event::leader_disconnected:
+      out += "[replication] Lost the leader after record " + to_string(record.values[0]) + ", connecting again";
+      break;
+    case log_event::leader_lost:
+      out += "[replication] Leader has gone away after record " + to_string(record.values[0]) + ", taking over";
+      break;
+    case log_event::checkpoint_written:
+      out += "[checkpoint] Saved ";
+      append_text(record, 0, out);
+      out += " (" + to_string(record.values[0]) + " bytes in " + to_string(record.values[1]) + " us)";
+      break;
+    case log_event::checkpoint_failed:
+      out += "[error] Unable to save ";
+      append_text(record, 0, out);
+      out += string(": ") + strerror(record.values[0]);
+      break;
+  }
+  out += '\n';
+}
+
+/**
+  * drain_rings
+  * Formats every record that is waiting in the rings and writes them to stdout in one go.
+  * Returns the number of records written
+  */
+static size_t drain_rings(unordered_map<int, string>& usernames, uint64_t& reported_drops)
+{
+  vector<log_ring*> current;
+  rings_mutex.lock();
+  current = rings;
+  rings_mutex.unlock();
+
+  string out;
+  size_t written = 0;
+  uint64_t drops = 0;
+  for(int i = 0; i < current.size(); i++) {
+    log_ring& ring = *current[i];
+    size_t tail = ring.tail.load(memory_order_relaxed);
+    size_t head = ring.head.load(memory_order_acquire);
+    for(; tail != head; tail++) {
+      format_record(ring.records[tail & (LOG_RING_RECORDS - 1)], usernames, out);
+      written++;
+    }
+    ring.tail.store(tail, memory_order_release);
+    drops += ring.dropped.load(memory_order_relaxed);
+  }
+
+  if(drops != reported_drops) {
+    out += "[error] " + to_string(drops - reported_drops) + " log records were dropped because the logger fell behind\n";
+    reported_drops = drops;
+  }
+
+  if(!out.empty())
+    cout << out << flush;
+  return written;
+}
+
+/**
+  * start_logger
+  */
+void start_logger()
+{
+  if(logging.exchange(true))
+    return;
+
+  logging_thread = thread([] () {
+    unordered_map<int, string> usernames;
+    uint64_t reported_drops = 0;
+    while(logging.load()) {
+      if(drain_rings(usernames, reported_drops) == 0)
+        this_thread::sleep_for(LOG_IDLE_DELAY);
+    }
+    drain_rings(usernames, reported_drops);
+  });
+}
+
+/**
+  * stop_logger
+  */
+void stop_logger()
+{
+  if(!logging.exchange(false))
+    return;
+  logging_thread.join();
+}
+
+/**
+  * parse_log_level
+  */
+bool parse_log_level(string_view name, log_level& level)
+{
+  const char *names[] = { "debug", "info", "warn", "error", "off" };
+  for(int i = 0; i < 5; i++) {
+    if(name == names[i]) {
+      level = (log_level) i;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+  * dropped_log_records
+  */
+uint64_t dropped_log_records()
+{
+  uint64_t drops = 0;
+  rings_mutex.lock();
+  for(int i = 0; i < rings.size(); i++)
+    drops += rings[i]->dropped.load(memory_order_relaxed);
+  rings_mutex.unlock();
+  return drops;
+}
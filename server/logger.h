@@ -0,0 +1,109 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <string_view>
+#include <atomic>
+#include <cstdint>
+
+using namespace std;
+
+/* Severity of a log record. Records below the current level are never written, so a
+  disabled level costs one relaxed atomic load */
+enum class log_level : unsigned char {
+  debug = 0,
+  info = 1,
+  warn = 2,
+  error = 3,
+  off = 4
+};
+
+/* What a record is about. Each event has a fixed line format, which the logging thread fills
+  in with the client id, texts and values of the record */
+enum class log_event : unsigned char {
+  listening,
+  client_accepted,
+  client_disconnected,
+  username_received,
+  spreadsheet_received,
+  spreadsheet_sent,
+  spreadsheet_resumed,
+  spreadsheet_forked,
+  request_received,
+  binary_request_received,
+  bad_message,
+  bad_frame,
+  edit_requested,
+  cell_edited,
+  edit_refused,
+  edit_over_limit,
+  edits_requested,
+  cells_edited,
+  select_requested,
+  cell_selected,
+  select_refused,
+  undo_requested,
+  undo_done,
+  undo_refused,
+  revert_requested,
+  revert_done,
+  revert_refused,
+  viewport_set,
+  viewport_refused,
+  request_throttled,
+  admission_paused,
+  admission_resumed,
+  handshake_timeout,
+  slow_client,
+  handed_off,
+  follower_connected,
+  follower_dropped,
+  leader_connected,
+  leader_disconnected,
+  leader_lost,
+  checkpoint_written,
+  checkpoint_failed
+};
+
+// Bytes of each text kept in a record. Longer texts, such as large cell contents, are cut
+const size_t LOG_TEXT_SIZE = 40;
+
+/* A single log record. Records are fixed size so writing one is a handful of stores into a
+  ring buffer, with no allocation and no formatting on the calling thread */
+struct log_record {
+  int client;
+  log_event event;
+  log_level level;
+  // Size of each text before it was cut to LOG_TEXT_SIZE
+  uint16_t text_size[2];
+  int64_t values[4];
+  char text[2][LOG_TEXT_SIZE];
+};
+
+extern atomic<log_level> current_log_level;
+
+// Copies a record into the ring buffer of the calling thread, or drops it if the ring is full
+void write_record(log_level level, log_event event, int client, string_view first, string_view second,
+  int64_t value0, int64_t value1, int64_t value2, int64_t value3);
+
+/* Logs an event if its level is enabled. Never blocks: when the logging thread has fallen behind,
+  the record is dropped and counted instead */
+inline void write_log(log_level level, log_event event, int client, string_view first = string_view(),
+  string_view second = string_view(), int64_t value0 = 0, int64_t value1 = 0, int64_t value2 = 0, int64_t value3 = 0)
+{
+  if(level >= current_log_level.load(memory_order_relaxed))
+    write_record(level, event, client, first, second, value0, value1, value2, value3);
+}
+
+// Starts the thread that formats records and writes them to stdout
+void start_logger();
+
+// Writes every record still in the rings and stops the logging thread
+void stop_logger();
+
+// Reads a level name (debug, info, warn, error or off)
+bool parse_log_level(string_view name, log_level& level);
+
+// Number of records dropped because a ring was full
+uint64_t dropped_log_records();
+
+#endif
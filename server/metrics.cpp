@@ -0,0 +1,222 @@
+#include "metrics.h"
+
+#include <stdexcept>
+
+thread_local lock_thread_metrics *thread_lock_metrics[MAX_LOCK_METRICS];
+
+// Slots handed out to lock_metrics so far
+static atomic<int> lock_metrics_slots(0);
+
+lock_metrics session_lock_metrics("session_mutex");
+lock_metrics sheet_lock_metrics("ss_mutex");
+lock_metrics cell_history_lock_metrics("cell_history_mutex");
+
+/**
+  * bucket_of
+  * Values below 16 have a bucket each. Above that, the top bit of the value picks a group of 16 buckets
+  * and the next four bits pick the bucket within the group
+  */
+static int bucket_of(uint64_t ns)
+{
+  if(ns < HISTOGRAM_SUB_BUCKETS)
+    return ns;
+  int top_bit = 63 - __builtin_clzll(ns);
+  int sub_bucket = (ns >> (top_bit - 4)) & (HISTOGRAM_SUB_BUCKETS - 1);
+  return (top_bit - 3) * HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+/**
+  * bucket_limit
+  * Largest value that falls into a bucket
+  */
+static uint64_t bucket_limit(int bucket)
+{
+  if(bucket < HISTOGRAM_SUB_BUCKETS)
+    return bucket;
+  int top_bit = bucket / HISTOGRAM_SUB_BUCKETS + 3;
+  uint64_t width = 1ULL << (top_bit - 4);
+  uint64_t lowest = (uint64_t) (HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) << (top_bit - 4);
+  return lowest + width - 1;
+}
+
+/**
+  * latency_histogram
+  */
+latency_histogram::latency_histogram() : total_count(0), total_ns(0), max_ns(0)
+{
+  for(int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    buckets[i].store(0, memory_order_relaxed);
+}
+
+/**
+  * record
+  */
+void latency_histogram::record(uint64_t ns)
+{
+  buckets[bucket_of(ns)].fetch_add(1, memory_order_relaxed);
+  total_count.fetch_add(1, memory_order_relaxed);
+  total_ns.fetch_add(ns, memory_order_relaxed);
+
+  uint64_t current = max_ns.load(memory_order_relaxed);
+  while(ns > current && !max_ns.compare_exchange_weak(current, ns, memory_order_relaxed));
+}
+
+/**
+  * record_owned
+  */
+void latency_histogram::record_owned(uint64_t ns)
+{
+  atomic<uint64_t> &bucket = buckets[bucket_of(ns)];
+  bucket.store(bucket.load(memory_order_relaxed) + 1, memory_order_relaxed);
+  total_count.store(total_count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+  total_ns.store(total_ns.load(memory_order_relaxed) + ns, memory_order_relaxed);
+  if(ns > max_ns.load(memory_order_relaxed))
+    max_ns.store(ns, memory_order_relaxed);
+}
+
+/**
+  * add_to
+  */
+void latency_histogram::add_to(latency_histogram &total) const
+{
+  for(int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    total.buckets[i].fetch_add(buckets[i].load(memory_order_relaxed), memory_order_relaxed);
+  total.total_count.fetch_add(total_count.load(memory_order_relaxed), memory_order_relaxed);
+  total.total_ns.fetch_add(total_ns.load(memory_order_relaxed), memory_order_relaxed);
+  uint64_t ns = max_ns.load(memory_order_relaxed);
+  if(ns > total.max_ns.load(memory_order_relaxed))
+    total.max_ns.store(ns, memory_order_relaxed);
+}
+
+/**
+  * count
+  */
+uint64_t latency_histogram::count() const
+{
+  return total_count.load(memory_order_relaxed);
+}
+
+/**
+  * percentile
+  */
+uint64_t latency_histogram::percentile(double fraction) const
+{
+  uint64_t counts[HISTOGRAM_BUCKETS];
+  uint64_t total = 0;
+  for(int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    counts[i] = buckets[i].load(memory_order_relaxed);
+    total += counts[i];
+  }
+  if(total == 0)
+    return 0;
+
+  uint64_t wanted = (uint64_t) (fraction * total);
+  if(wanted < 1)
+    wanted = 1;
+  uint64_t seen = 0;
+  for(int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += counts[i];
+    if(seen >= wanted)
+      return min(bucket_limit(i), max_ns.load(memory_order_relaxed));
+  }
+  return max_ns.load(memory_order_relaxed);
+}
+
+/**
+  * summary
+  */
+json latency_histogram::summary() const
+{
+  uint64_t total = count();
+  json out;
+  out["count"] = total;
+  out["mean_us"] = total == 0 ? 0.0 : total_ns.load(memory_order_relaxed) / 1000.0 / total;
+  out["p50_us"] = percentile(0.5) / 1000.0;
+  out["p90_us"] = percentile(0.9) / 1000.0;
+  out["p99_us"] = percentile(0.99) / 1000.0;
+  out["p999_us"] = percentile(0.999) / 1000.0;
+  out["max_us"] = max_ns.load(memory_order_relaxed) / 1000.0;
+  return out;
+}
+
+/**
+  * record
+  * Requests of unknown types are ignored, so they are not counted
+  */
+void request_metrics::record(request_type type, bool refused, uint64_t latency_ns)
+{
+  int index = (int) type - (int) request_type::edit_cell;
+  if(index < 0 || index >= METRIC_REQUEST_TYPES)
+    return;
+
+  types[index].received.fetch_add(1, memory_order_relaxed);
+  if(refused)
+    types[index].refused.fetch_add(1, memory_order_relaxed);
+  types[index].latency.record(latency_ns);
+}
+
+/**
+  * summary
+  */
+json request_metrics::summary() const
+{
+  const char *names[METRIC_REQUEST_TYPES] = { "editCell", "editCells", "selectCell", "undo", "revertCell", "setViewport" };
+  json out = json::object();
+  for(int i = 0; i < METRIC_REQUEST_TYPES; i++) {
+    json type;
+    type["received"] = types[i].received.load(memory_order_relaxed);
+    type["refused"] = types[i].refused.load(memory_order_relaxed);
+    type["latency"] = types[i].latency.summary();
+    out[names[i]] = type;
+  }
+  return out;
+}
+
+/**
+  * lock_metrics
+  */
+lock_metrics::lock_metrics(const char *name)
+  : slot(lock_metrics_slots.fetch_add(1)), name(name)
+{
+  if(slot >= MAX_LOCK_METRICS)
+    throw logic_error("More than MAX_LOCK_METRICS lock_metrics");
+}
+
+/**
+  * add_thread
+  */
+lock_thread_metrics *lock_metrics::add_thread()
+{
+  lock_thread_metrics *metrics = new lock_thread_metrics();
+  threads_mutex.lock();
+  threads.emplace_back(metrics);
+  threads_mutex.unlock();
+  return metrics;
+}
+
+/**
+  * summary
+  * Merges the metrics of every thread that has taken the lock, including threads that have since exited
+  */
+json lock_metrics::summary()
+{
+  uint64_t acquired = 0;
+  uint64_t contended = 0;
+  unique_ptr<latency_histogram> wait(new latency_histogram());
+  unique_ptr<latency_histogram> hold(new latency_histogram());
+  threads_mutex.lock();
+  for(int i = 0; i < threads.size(); i++) {
+    acquired += threads[i]->acquired.load(memory_order_relaxed);
+    contended += threads[i]->contended.load(memory_order_relaxed);
+    threads[i]->wait.add_to(*wait);
+    threads[i]->hold.add_to(*hold);
+  }
+  threads_mutex.unlock();
+
+  json out;
+  out["acquired"] = acquired;
+  out["contended"] = contended;
+  out["wait"] = wait->summary();
+  out["hold"] = hold->summary();
+  return out;
+}
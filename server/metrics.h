@@ -0,0 +1,154 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+#include <nlohmann/json.hpp>
+
+#include "request.h"
+#include "trace.h"
+
+using json = nlohmann::json;
+
+using namespace std;
+
+// Buckets of a latency histogram: 16 exact buckets, then 16 buckets for each power of two
+const int HISTOGRAM_SUB_BUCKETS = 16;
+const int HISTOGRAM_BUCKETS = (64 - 3) * HISTOGRAM_SUB_BUCKETS;
+
+/* A histogram of durations in nanoseconds in the style of HdrHistogram. Each power of two is split
+  into 16 buckets, so any value is known to within about 6%. Recording is a relaxed atomic increment
+  and never takes a lock, so any thread may record at any time */
+class latency_histogram {
+  atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+  atomic<uint64_t> total_count;
+  atomic<uint64_t> total_ns;
+  atomic<uint64_t> max_ns;
+
+  public:
+    latency_histogram();
+
+    void record(uint64_t ns);
+    /* Records into a histogram that only the calling thread ever records into, with plain loads and stores
+      rather than atomic increments. Other threads may still read it at any time */
+    void record_owned(uint64_t ns);
+    // Adds every recorded duration to another histogram
+    void add_to(latency_histogram &total) const;
+    uint64_t count() const;
+    // Smallest recorded duration that at least the given fraction of durations are at or below
+    uint64_t percentile(double fraction) const;
+    // Count, mean, p50, p90, p99, p999 and max in microseconds
+    json summary() const;
+};
+
+/* Counts and latencies of one type of request. Latency runs from the moment the request was read
+  from the socket to the moment its messages were queued for every client */
+struct request_type_metrics {
+  atomic<uint64_t> received{0};
+  atomic<uint64_t> refused{0};
+  latency_histogram latency;
+};
+
+// editCell, editCells, selectCell, undo, revertCell and setViewport
+const int METRIC_REQUEST_TYPES = 6;
+
+/* Counts and latencies of every type of request, for the whole server or for one spreadsheet */
+class request_metrics {
+  request_type_metrics types[METRIC_REQUEST_TYPES];
+
+  public:
+    void record(request_type type, bool refused, uint64_t latency_ns);
+    json summary() const;
+};
+
+/* The part of a lock_metrics that one thread records into, so that threads taking the same lock never
+  write to the same cache lines */
+struct lock_thread_metrics {
+  atomic<uint64_t> acquired{0};
+  atomic<uint64_t> contended{0};
+  latency_histogram wait;
+  latency_histogram hold;
+};
+
+// Most lock_metrics there can be, which is how many each thread keeps a lock_thread_metrics for
+const int MAX_LOCK_METRICS = 8;
+
+/* The lock_thread_metrics of the calling thread for each lock_metrics, by slot, allocated the first time
+  the thread takes that lock */
+extern thread_local lock_thread_metrics *thread_lock_metrics[MAX_LOCK_METRICS];
+
+/* How long threads wait for a lock and how long they hold it. Each thread records into its own
+  lock_thread_metrics, which are merged when the metrics are read. Only waits for a contended lock are
+  recorded, as an uncontended one does not wait */
+class lock_metrics {
+  int slot;
+  mutex threads_mutex;
+  vector<unique_ptr<lock_thread_metrics>> threads;
+
+  lock_thread_metrics *add_thread();
+
+  public:
+    // Name of the lock, which is also the name of its wait spans when tracing
+    const char *name;
+
+    lock_metrics(const char *name);
+
+    // The metrics the calling thread records into
+    lock_thread_metrics &local()
+    {
+      lock_thread_metrics *&metrics = thread_lock_metrics[slot];
+      if(metrics == nullptr)
+        metrics = add_thread();
+      return *metrics;
+    }
+
+    json summary();
+};
+
+extern lock_metrics session_lock_metrics;
+extern lock_metrics sheet_lock_metrics;
+extern lock_metrics cell_history_lock_metrics;
+
+/* A mutex that records its wait and hold times. It can be used anywhere a mutex is, with lock
+  and unlock or a lock_guard. An uncontended lock costs two clock reads more than a plain mutex,
+  and writes only to the metrics of the calling thread. When tracing, every wait for a contended
+  lock is also recorded as a span */
+class measured_mutex {
+  mutex m;
+  lock_metrics& stats;
+  // Only written and read by the thread holding the lock
+  uint64_t locked_at = 0;
+
+  public:
+    measured_mutex(lock_metrics& stats) : stats(stats) {}
+
+    void lock()
+    {
+      lock_thread_metrics &local = stats.local();
+      local.acquired.store(local.acquired.load(memory_order_relaxed) + 1, memory_order_relaxed);
+      if(m.try_lock()) {
+        locked_at = now_ns();
+        return;
+      }
+      uint64_t start = now_ns();
+      m.lock();
+      locked_at = now_ns();
+      local.contended.store(local.contended.load(memory_order_relaxed) + 1, memory_order_relaxed);
+      local.wait.record_owned(locked_at - start);
+      if(tracing.load(memory_order_relaxed))
+        record_span(stats.name, start, locked_at);
+    }
+
+    void unlock()
+    {
+      uint64_t held = now_ns() - locked_at;
+      m.unlock();
+      stats.local().hold.record_owned(held);
+    }
+};
+
+#endif
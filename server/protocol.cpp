@@ -0,0 +1,614 @@
+#include "protocol.h"
+#include "trace.h"
+
+#include <cctype>
+#include <algorithm>
+
+#include <nlohmann/json.hpp>
+#include <zlib.h>
+
+using json = nlohmann::json;
+
+// Flags byte of a packed cell name
+const unsigned char CELL_ABSOLUTE_COLUMN = 1;
+const unsigned char CELL_ABSOLUTE_ROW = 2;
+const unsigned char CELL_LOWERCASE = 4;
+const unsigned char CELL_RAW = 8;
+
+// Columns and rows larger than these are sent as raw names
+const uint64_t MAX_PACKED_COLUMN = 26ULL * 26 * 26 * 26 * 26 * 26;
+const uint64_t MAX_PACKED_ROW = 999999999;
+
+// Longest name an unpacked cell can have: two $, six letters and nine digits
+const size_t MAX_UNPACKED_NAME = 17;
+
+/* Most characters a packed name unpacks to for each byte of an edit that holds it. A column varint
+  of n bytes is at most 2n letters and a row varint of n bytes at most 2n + 1 digits, which with the
+  two $ comes to no more than twice the flags byte, the varints and the length byte of the contents */
+const size_t MAX_UNPACKED_PER_BYTE = 2;
+
+/* zlib level of compressed transfers. The fastest level already gets most of the size down on
+  encoded messages, which repeat the same keys and cell names over and over */
+const int COMPRESSION_LEVEL = Z_BEST_SPEED;
+
+
+/**
+  * server_message factories
+  */
+server_message server_message::cell_updated(string cell_name, string contents) {
+  server_message message;
+  message.type = message_type::cell_updated;
+  message.cell_name = move(cell_name);
+  message.contents = move(contents);
+  return message;
+}
+
+server_message server_message::cell_selected(string cell_name, int selector, string selector_name) {
+  server_message message;
+  message.type = message_type::cell_selected;
+  message.cell_name = move(cell_name);
+  message.client_id = selector;
+  message.client_name = move(selector_name);
+  return message;
+}
+
+server_message server_message::disconnected(int user) {
+  server_message message;
+  message.type = message_type::disconnected;
+  message.client_id = user;
+  return message;
+}
+
+server_message server_message::request_error(string cell_name, string error) {
+  server_message message;
+  message.type = message_type::request_error;
+  message.cell_name = move(cell_name);
+  message.contents = move(error);
+  return message;
+}
+
+server_message server_message::server_error(string error) {
+  server_message message;
+  message.type = message_type::server_error;
+  message.contents = move(error);
+  return message;
+}
+
+server_message server_message::id(int client_id) {
+  server_message message;
+  message.type = message_type::client_id;
+  message.client_id = client_id;
+  return message;
+}
+
+server_message server_message::sequence(uint64_t epoch, uint64_t seq) {
+  server_message message;
+  message.type = message_type::sequence;
+  message.epoch = epoch;
+  message.seq = seq;
+  return message;
+}
+
+
+/**
+  * message_batch
+  */
+message_batch::message_batch(server_message message) {
+  messages.push_back(move(message));
+}
+
+void message_batch::add(server_message message) {
+  messages.push_back(move(message));
+  encoded[0].reset();
+  encoded[1].reset();
+  compressed[0].reset();
+  compressed[1].reset();
+}
+
+void message_batch::clear() {
+  messages.clear();
+  encoded[0].reset();
+  encoded[1].reset();
+  compressed[0].reset();
+  compressed[1].reset();
+}
+
+bool message_batch::empty() const {
+  return messages.empty();
+}
+
+size_t message_batch::size() const {
+  return messages.size();
+}
+
+const server_message &message_batch::at(size_t i) const {
+  return messages[i];
+}
+
+shared_ptr<const string> message_batch::encode(wire_protocol protocol) {
+  int index = (int) protocol;
+  if(!encoded[index]) {
+    trace_span span("encode");
+    shared_ptr<string> out = make_shared<string>();
+    for(int i = 0; i < messages.size(); i++)
+      encode_message(messages[i], protocol, *out);
+    encoded[index] = out;
+  }
+  return encoded[index];
+}
+
+shared_ptr<const string> message_batch::encode(wire_protocol protocol, bool compress) {
+  shared_ptr<const string> plain = encode(protocol);
+  if(!compress || plain->size() < COMPRESS_MIN_BYTES)
+    return plain;
+
+  int index = (int) protocol;
+  if(!compressed[index]) {
+    trace_span span("compress");
+    shared_ptr<string> out = make_shared<string>();
+    compress_messages(*plain, protocol, *out);
+    compressed[index] = out;
+  }
+  return compressed[index];
+}
+
+/**
+  * coalesce_key
+  * A batch holding a single cellUpdated or cellSelected message is superseded by a later one
+  * for the same cell or selector. Returns a key naming what the batch is an update of, or an
+  * empty string if later messages never make it obsolete
+  */
+string message_batch::coalesce_key() const {
+  if(messages.size() != 1)
+    return "";
+  if(messages[0].type == message_type::cell_updated)
+    return "u" + messages[0].cell_name;
+  if(messages[0].type == message_type::cell_selected)
+    return "s" + to_string(messages[0].client_id);
+  return "";
+}
+
+
+/**
+  * encode_message
+  * Appends the message to out in the given wire protocol
+  */
+void encode_message(const server_message &message, wire_protocol protocol, string &out) {
+  if(protocol == wire_protocol::json) {
+    // The client id that ends the handshake is sent as a bare line
+    if(message.type == message_type::client_id) {
+      out += to_string(message.client_id);
+      out += '\n';
+      return;
+    }
+
+    json server_message;
+    switch(message.type) {
+      case message_type::cell_updated:
+        server_message["messageType"] = "cellUpdated";
+        server_message["cellName"] = message.cell_name;
+        server_message["contents"] = message.contents;
+        if(message.seq != 0)
+          server_message["seq"] = message.seq;
+        break;
+      case message_type::cell_selected:
+        server_message["messageType"] = "cellSelected";
+        server_message["cellName"] = message.cell_name;
+        // The selector has always been a string on the JSON protocol
+        server_message["selector"] = to_string(message.client_id);
+        server_message["selectorName"] = message.client_name;
+        break;
+      case message_type::disconnected:
+        server_message["messageType"] = "disconnected";
+        server_message["user"] = to_string(message.client_id);
+        break;
+      case message_type::request_error:
+        server_message["messageType"] = "requestError";
+        server_message["cellName"] = message.cell_name;
+        server_message["message"] = message.contents;
+        break;
+      case message_type::server_error:
+        server_message["messageType"] = "serverError";
+        server_message["message"] = message.contents;
+        break;
+      case message_type::sequence:
+        server_message["messageType"] = "sequence";
+        server_message["epoch"] = message.epoch;
+        server_message["seq"] = message.seq;
+        break;
+      default:
+        break;
+    }
+    out += server_message.dump();
+    out += '\n';
+    return;
+  }
+
+  // Binary frames are built after a placeholder for the length, which is filled in once the
+  // payload size is known. Most frames are shorter than 128 bytes and need no move
+  size_t start = out.size();
+  out += '\0';
+  out += (char) message.type;
+
+  switch(message.type) {
+    case message_type::cell_updated:
+      put_cell(out, message.cell_name);
+      put_string(out, message.contents);
+      // The sequence number is the only field that may be left out, at the end of the frame
+      if(message.seq != 0)
+        put_varint(out, message.seq);
+      break;
+    case message_type::cell_selected:
+      put_cell(out, message.cell_name);
+      put_varint(out, message.client_id);
+      put_string(out, message.client_name);
+      break;
+    case message_type::disconnected:
+    case message_type::client_id:
+      put_varint(out, message.client_id);
+      break;
+    case message_type::request_error:
+      put_cell(out, message.cell_name);
+      put_string(out, message.contents);
+      break;
+    case message_type::server_error:
+      put_string(out, message.contents);
+      break;
+    case message_type::sequence:
+      put_varint(out, message.epoch);
+      put_varint(out, message.seq);
+      break;
+    // Compressed frames are only built by compress_messages
+    default:
+      break;
+  }
+
+  size_t length = out.size() - start - 1;
+  string prefix;
+  put_varint(prefix, length);
+  out.replace(start, 1, prefix);
+}
+
+
+/**
+  * compress_messages
+  * The JSON header is a line of its own, so a client reading lines knows how many bytes to take
+  * as they are before it goes back to reading lines
+  */
+void compress_messages(string_view encoded, wire_protocol protocol, string &out) {
+  uLongf stream_size = compressBound(encoded.size());
+  string stream(stream_size, '\0');
+  if(compress2((Bytef *) &stream[0], &stream_size, (const Bytef *) encoded.data(), encoded.size(), COMPRESSION_LEVEL) != Z_OK) {
+    // The messages are sent as they are, which any client can read
+    out.append(encoded.data(), encoded.size());
+    return;
+  }
+  stream.resize(stream_size);
+
+  if(protocol == wire_protocol::json) {
+    json header;
+    header["messageType"] = "compressed";
+    header["length"] = stream.size();
+    header["size"] = encoded.size();
+    out += header.dump();
+    out += '\n';
+    out += stream;
+    return;
+  }
+
+  string payload;
+  payload += (char) message_type::compressed;
+  put_varint(payload, encoded.size());
+  put_varint(out, payload.size() + stream.size());
+  out += payload;
+  out += stream;
+}
+
+
+/**
+  * inflate_messages
+  */
+bool inflate_messages(string_view stream, size_t size, string &out) {
+  size_t start = out.size();
+  out.resize(start + size);
+  uLongf inflated_size = size;
+  if(uncompress((Bytef *) &out[start], &inflated_size, (const Bytef *) stream.data(), stream.size()) != Z_OK
+    || inflated_size != size) {
+    out.resize(start);
+    return false;
+  }
+  return true;
+}
+
+
+/**
+  * parse_handshake_line
+  * Splits a handshake line into its value and the options following a tab character.
+  * Unknown options are ignored so that newer clients can talk to older servers
+  */
+string parse_handshake_line(const string &line, handshake_options &options) {
+  size_t tab = line.find('\t');
+  if(tab == string::npos)
+    return line;
+
+  size_t pos = tab + 1;
+  while(pos < line.size()) {
+    size_t space = line.find(' ', pos);
+    if(space == string::npos)
+      space = line.size();
+    string option = line.substr(pos, space - pos);
+
+    if(option == "protocol=binary")
+      options.protocol = wire_protocol::binary;
+    else if(option == "protocol=json")
+      options.protocol = wire_protocol::json;
+    else if(option == "mode=observer")
+      options.observer = true;
+    else if(option == "compress=zlib")
+      options.compress = true;
+    else if(option.compare(0, 9, "viewport=") == 0)
+      options.viewport = option.substr(9);
+    else if(option.compare(0, 5, "fork=") == 0)
+      options.fork = option.substr(5);
+    else if(option.compare(0, 7, "resume=") == 0) {
+      // A resume point that cannot be read still asks for the sequence message, with a full resync
+      options.resume = true;
+      size_t dot = option.find('.', 7);
+      try {
+        if(dot != string::npos) {
+          options.resume_epoch = stoull(option.substr(7, dot - 7));
+          options.resume_seq = stoull(option.substr(dot + 1));
+        }
+      }
+      catch(...) {
+        options.resume_epoch = 0;
+        options.resume_seq = 0;
+      }
+    }
+
+    pos = space + 1;
+  }
+
+  return line.substr(0, tab);
+}
+
+
+/**
+  * next_binary_frame
+  * Finds the first frame in [begin, end). On success body and body_end are set to the
+  * type byte and payload of the frame
+  */
+frame_status next_binary_frame(char *begin, char *end, char **body, char **body_end) {
+  const char *pos = begin;
+  uint64_t length;
+  if(!get_varint(pos, end, &length))
+    return end - begin >= 10 ? frame_status::invalid : frame_status::incomplete;
+  if(length == 0 || length > MAX_FRAME_SIZE)
+    return frame_status::invalid;
+  if(end - pos < length)
+    return frame_status::incomplete;
+
+  *body = (char *) pos;
+  *body_end = (char *) pos + length;
+  return frame_status::complete;
+}
+
+
+/**
+  * parse_binary_request
+  * Parses the type byte and payload of a binary frame into req
+  */
+bool parse_binary_request(char *begin, char *end, request &req) {
+  req.clear();
+  if(begin == end)
+    return false;
+
+  const char *pos = begin + 1;
+  bool ok = true;
+
+  switch((request_type) (unsigned char) *begin) {
+    case request_type::edit_cell:
+      req.type = request_type::edit_cell;
+      req.names.reserve(MAX_UNPACKED_NAME);
+      ok = get_cell(pos, end, req.names, &req.cell_name) && get_string(pos, end, &req.contents);
+      break;
+
+    case request_type::select_cell:
+    case request_type::revert_cell:
+      req.type = (request_type) *begin;
+      req.names.reserve(MAX_UNPACKED_NAME);
+      ok = get_cell(pos, end, req.names, &req.cell_name);
+      break;
+
+    case request_type::undo:
+      req.type = request_type::undo;
+      break;
+
+    // Two corner cells, or an empty payload for the whole spreadsheet
+    case request_type::set_viewport:
+      req.type = request_type::set_viewport;
+      if(pos == end)
+        break;
+      req.names.reserve(2 * MAX_UNPACKED_NAME);
+      ok = get_cell(pos, end, req.names, &req.cell_name) && get_cell(pos, end, req.names, &req.last_cell);
+      break;
+
+    case request_type::edit_cells: {
+      req.type = request_type::edit_cells;
+      uint64_t count;
+      // Every edit takes at least two bytes, which bounds the count before reserving space
+      if(!get_varint(pos, end, &count) || count > (uint64_t) (end - pos) / 2)
+        return false;
+
+      // Views into names must stay valid, so it is sized for every cell up front, no larger than the
+      // rest of the frame can unpack to
+      req.names.reserve(min(count * MAX_UNPACKED_NAME, MAX_UNPACKED_PER_BYTE * (end - pos)));
+      for(uint64_t i = 0; i < count && ok; i++) {
+        cell_edit edit;
+        ok = get_cell(pos, end, req.names, &edit.cell_name) && get_string(pos, end, &edit.contents);
+        req.cells.push_back(edit);
+      }
+      break;
+    }
+
+    // Requests of unknown types are ignored, as they are for JSON
+    default:
+      return true;
+  }
+
+  return ok && pos == end;
+}
+
+
+/**
+  * put_varint
+  */
+void put_varint(string &out, uint64_t value) {
+  while(value >= 0x80) {
+    out += (char) (value | 0x80);
+    value >>= 7;
+  }
+  out += (char) value;
+}
+
+
+/**
+  * get_varint
+  */
+bool get_varint(const char *&pos, const char *end, uint64_t *value) {
+  *value = 0;
+  for(int shift = 0; shift < 64 && pos < end; shift += 7) {
+    unsigned char byte = *pos++;
+    *value |= (uint64_t) (byte & 0x7F) << shift;
+    if(!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+
+/**
+  * put_string
+  */
+void put_string(string &out, string_view value) {
+  put_varint(out, value.size());
+  out.append(value.data(), value.size());
+}
+
+
+/**
+  * get_string
+  * Sets value to a view of the string in the frame
+  */
+bool get_string(const char *&pos, const char *end, string_view *value) {
+  uint64_t length;
+  if(!get_varint(pos, end, &length) || end - pos < length)
+    return false;
+  *value = string_view(pos, length);
+  pos += length;
+  return true;
+}
+
+
+/**
+  * put_cell
+  * Packs a cell name such as A1, $b$20 or AB$300 into its column and row. Names that would
+  * not come back exactly the same when unpacked, such as mixed case letters or leading
+  * zeros, are sent as a string
+  */
+void put_cell(string &out, string_view name) {
+  unsigned char flags = 0;
+  size_t pos = 0;
+
+  if(pos < name.size() && name[pos] == '$') {
+    flags |= CELL_ABSOLUTE_COLUMN;
+    pos++;
+  }
+
+  size_t letters_start = pos;
+  bool has_upper = false;
+  bool has_lower = false;
+  uint64_t column = 0;
+  while(pos < name.size() && isalpha((unsigned char) name[pos]) && column <= MAX_PACKED_COLUMN) {
+    has_upper |= isupper((unsigned char) name[pos]);
+    has_lower |= islower((unsigned char) name[pos]);
+    column = column * 26 + (toupper((unsigned char) name[pos]) - 'A' + 1);
+    pos++;
+  }
+  size_t num_letters = pos - letters_start;
+
+  if(pos < name.size() && name[pos] == '$') {
+    flags |= CELL_ABSOLUTE_ROW;
+    pos++;
+  }
+
+  size_t digits_start = pos;
+  uint64_t row = 0;
+  while(pos < name.size() && isdigit((unsigned char) name[pos]) && row <= MAX_PACKED_ROW) {
+    row = row * 10 + (name[pos] - '0');
+    pos++;
+  }
+  size_t num_digits = pos - digits_start;
+
+  if(has_lower)
+    flags |= CELL_LOWERCASE;
+
+  bool packable = pos == name.size() && num_letters > 0 && num_digits > 0 && !(has_upper && has_lower) &&
+    column <= MAX_PACKED_COLUMN && row <= MAX_PACKED_ROW && !(num_digits > 1 && name[digits_start] == '0');
+
+  if(!packable) {
+    out += (char) CELL_RAW;
+    put_string(out, name);
+    return;
+  }
+
+  out += (char) flags;
+  put_varint(out, column);
+  put_varint(out, row);
+}
+
+
+/**
+  * get_cell
+  * Reads a cell name. Raw names are returned as a view into the frame, packed names are
+  * unpacked onto the end of names, which must have room for them without growing so that
+  * earlier views into it stay valid
+  */
+bool get_cell(const char *&pos, const char *end, string &names, string_view *name) {
+  if(pos == end)
+    return false;
+  unsigned char flags = *pos++;
+
+  if(flags & CELL_RAW)
+    return get_string(pos, end, name);
+
+  uint64_t column, row;
+  if(!get_varint(pos, end, &column) || !get_varint(pos, end, &row) || column == 0 ||
+    column > MAX_PACKED_COLUMN || row > MAX_PACKED_ROW)
+    return false;
+
+  char letters[8];
+  int num_letters = 0;
+  char base = (flags & CELL_LOWERCASE) ? 'a' : 'A';
+  while(column > 0) {
+    column--;
+    letters[num_letters++] = base + column % 26;
+    column /= 26;
+  }
+  string digits = to_string(row);
+  size_t length = num_letters + digits.size() + ((flags & CELL_ABSOLUTE_COLUMN) ? 1 : 0) + ((flags & CELL_ABSOLUTE_ROW) ? 1 : 0);
+  if(names.size() + length > names.capacity())
+    return false;
+
+  size_t start = names.size();
+  if(flags & CELL_ABSOLUTE_COLUMN)
+    names += '$';
+  while(num_letters > 0)
+    names += letters[--num_letters];
+  if(flags & CELL_ABSOLUTE_ROW)
+    names += '$';
+  names += digits;
+
+  *name = string_view(names.data() + start, names.size() - start);
+  return true;
+}
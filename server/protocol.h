@@ -0,0 +1,164 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include "request.h"
+
+using namespace std;
+
+/* Clients talk to the server with newline delimited JSON unless they ask for the binary
+  protocol during the handshake, by following their username with a tab character and the
+  option protocol=binary. The handshake itself is always plain text. Once the server has read
+  the spreadsheet choice, everything sent in either direction uses the chosen protocol.
+  The option mode=observer, separated from other options by a space, makes the client a
+  read-only observer, which is sent the spreadsheet and every change to it but cannot
+  select or edit cells.
+
+  Every cellUpdated carries the sequence number of the change within its spreadsheet. A
+  client that gives the option resume=<epoch>.<seq> is sent a sequence message right before
+  its id, holding the epoch of the spreadsheet and the sequence number of the last change it
+  has been sent. When it reconnects with those values it is only sent the changes it missed,
+  rather than every cell, if the server still has them. resume=0.0 asks for the sequence
+  message without having any state yet.
+
+  The option viewport=A1:J40 subscribes the client to a range of cells rather than the whole
+  spreadsheet (see viewport.h). It is sent the cells in its viewport during the handshake, and
+  only the changes to them afterwards, so the sequence numbers it sees skip the changes made
+  elsewhere. A setViewport request with from and to cells moves the viewport, and the client
+  is sent the cells that have just come into it. One without them subscribes to the whole
+  spreadsheet again.
+
+  The option compress=zlib asks for large transfers to be compressed: the spreadsheet sent during
+  the handshake, and any batch of messages of at least COMPRESS_MIN_BYTES, such as a paste. Smaller
+  messages are always sent as they are, so interactive edits are not slowed down. A compressed JSON
+  transfer is a compressed message, holding the length of the zlib stream that follows it right
+  after its newline and the size of the stream once inflated. A compressed binary frame holds the
+  inflated size as a varint followed by the zlib stream. Either inflates to messages in the wire
+  protocol of the client, exactly as they would have been sent uncompressed. Observers are only
+  sent the spreadsheet compressed, not the changes that follow.
+
+  The option fork=<name> creates the chosen spreadsheet, if it does not exist yet, as a copy of
+  the named one, such as a template. The copy shares the cells of the original until either one
+  changes them (see spreadsheet::fork), and is sent to the client like any other spreadsheet. When
+  the named spreadsheet is not on the server, or on another shard, the new spreadsheet starts empty.
+
+  A binary frame is a varint length, followed by that many bytes: a one byte type and the
+  payload. Integers are unsigned LEB128 varints and strings are a varint length followed by
+  the bytes. Cell names are packed as a flags byte followed by the column number (A = 1)
+  and row number as varints, or as a string when the name has no exact packed form. */
+enum class wire_protocol {
+  json = 0,
+  binary = 1
+};
+
+/* Options a client may give after its username during the handshake */
+struct handshake_options {
+  wire_protocol protocol = wire_protocol::json;
+  bool observer = false;
+  bool resume = false;
+  uint64_t resume_epoch = 0;
+  uint64_t resume_seq = 0;
+  // Range the client subscribes to, or empty for the whole spreadsheet
+  string viewport;
+  bool compress = false;
+  // Spreadsheet to fork the chosen spreadsheet from when it does not exist yet (see spreadsheet::fork), or empty
+  string fork;
+};
+
+/* The kinds of messages the server sends to clients. The values are the frame types used
+  by the binary wire protocol */
+enum class message_type : unsigned char {
+  cell_updated = 1,
+  cell_selected = 2,
+  disconnected = 3,
+  request_error = 4,
+  server_error = 5,
+  client_id = 6,
+  sequence = 7,
+  compressed = 8
+};
+
+/* A message to a client, independent of the wire protocol it will be encoded in */
+struct server_message {
+  message_type type;
+  string cell_name;
+  // Contents of the cell for cellUpdated, or the message of requestError and serverError
+  string contents;
+  // Selector for cellSelected, user for disconnected, or the id sent at the end of the handshake
+  int client_id = 0;
+  // Selector name for cellSelected
+  string client_name;
+  // Sequence number of a cellUpdated or sequence message, or 0 for a cellUpdated that has none
+  uint64_t seq = 0;
+  // Epoch of a sequence message
+  uint64_t epoch = 0;
+
+  static server_message cell_updated(string cell_name, string contents);
+  static server_message cell_selected(string cell_name, int selector, string selector_name);
+  static server_message disconnected(int user);
+  static server_message request_error(string cell_name, string message);
+  static server_message server_error(string message);
+  static server_message id(int client_id);
+  static server_message sequence(uint64_t epoch, uint64_t seq);
+};
+
+/* A group of messages that are sent together. The group is encoded at most once per wire
+  protocol, no matter how many clients it is sent to, and every client shares the encoded bytes */
+class message_batch {
+  vector<server_message> messages;
+  shared_ptr<const string> encoded[2];
+  shared_ptr<const string> compressed[2];
+
+  public:
+    message_batch() {}
+    message_batch(server_message);
+
+    void add(server_message);
+    // Empties the batch to be filled again, keeping the storage of its list of messages
+    void clear();
+    bool empty() const;
+    size_t size() const;
+    const server_message &at(size_t) const;
+    shared_ptr<const string> encode(wire_protocol);
+    // The encoding for a client that asked for compression, which is compressed when it is large enough
+    shared_ptr<const string> encode(wire_protocol, bool compress);
+    string coalesce_key() const;
+};
+
+void encode_message(const server_message &, wire_protocol, string &);
+
+// Transfers smaller than this are not worth compressing
+const size_t COMPRESS_MIN_BYTES = 1024;
+
+// Appends a compressed transfer of messages already encoded in the wire protocol, or the messages as they are when zlib fails
+void compress_messages(string_view encoded, wire_protocol, string &out);
+// Inflates the zlib stream of a compressed transfer, which must come to exactly size bytes
+bool inflate_messages(string_view stream, size_t size, string &out);
+string parse_handshake_line(const string &, handshake_options &);
+
+/* Result of looking for the next complete frame in a read buffer */
+enum class frame_status {
+  complete,
+  incomplete,
+  invalid
+};
+
+// Largest binary frame a client may send
+const uint64_t MAX_FRAME_SIZE = 16 * 1024 * 1024;
+
+frame_status next_binary_frame(char *begin, char *end, char **body, char **body_end);
+bool parse_binary_request(char *begin, char *end, request &req);
+
+void put_varint(string &, uint64_t);
+bool get_varint(const char *&, const char *, uint64_t *);
+void put_string(string &, string_view);
+bool get_string(const char *&, const char *, string_view *);
+void put_cell(string &, string_view);
+bool get_cell(const char *&, const char *, string &, string_view *);
+
+#endif
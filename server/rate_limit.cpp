@@ -0,0 +1,38 @@
+#include "rate_limit.h"
+
+#include <algorithm>
+
+/**
+  * token_bucket constructor
+  * A bucket starts full. A burst below one would never let a request through, so it is raised to one
+  */
+token_bucket::token_bucket(double rate, double burst) : rate(rate), burst(max(burst, 1.0)), tokens(this->burst), filled_at(0) {}
+
+
+/**
+  * take
+  */
+bool token_bucket::take(uint64_t now)
+{
+  if(rate <= 0)
+    return true;
+
+  if(now > filled_at) {
+    if(filled_at != 0)
+      tokens = min(burst, tokens + (now - filled_at) * rate / 1e9);
+    filled_at = now;
+  }
+  if(tokens < 1)
+    return false;
+  tokens -= 1;
+  return true;
+}
+
+
+/**
+  * limited
+  */
+bool token_bucket::limited() const
+{
+  return rate > 0;
+}
@@ -0,0 +1,25 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <cstdint>
+
+using namespace std;
+
+/* A token bucket. It holds up to burst tokens and gains rate tokens a second, and every request
+  takes one, so a client may send burst requests at once and rate requests a second after that.
+  A bucket with a rate of 0 never runs out. Not thread safe: the owner decides which lock guards it */
+class token_bucket {
+  double rate;
+  double burst;
+  double tokens;
+  uint64_t filled_at;
+
+  public:
+    token_bucket(double rate, double burst);
+
+    // Takes a token at the given time, from now_ns. Returns false, taking nothing, when there is none left
+    bool take(uint64_t now);
+    bool limited() const;
+};
+
+#endif
@@ -0,0 +1,431 @@
+#include "replication.h"
+
+#include <unistd.h>
+
+#include "protocol.h"
+#include "metrics.h"
+#include "logger.h"
+#include "trace.h"
+
+// A follower this many bytes behind cannot keep up and is dropped
+const size_t REPLICATION_MAX_PENDING = 64 * 1024 * 1024;
+
+// How often a follower tries to reach a leader it has not yet connected to, or has lost
+const chrono::milliseconds REPLICATION_RETRY_INTERVAL(100);
+
+// A follower that has lost its leader takes over once this many attempts to connect again have failed
+const int REPLICATION_RECONNECT_ATTEMPTS = 10;
+
+atomic<bool> replicating(false);
+
+/* The leader that changes are streamed from, if this server is one. Accesses must be done in a thread
+  safe manner using the replication_mutex */
+replication_leader *active_leader = nullptr;
+mutex replication_mutex;
+
+/* Follower metrics: the last record applied, and how long after the leader made each change the
+  follower made it */
+atomic<bool> following(false);
+atomic<uint64_t> applied_seq(0);
+latency_histogram replication_lag;
+
+/**
+  * encode_replication_record
+  */
+void encode_replication_record(uint64_t seq, uint64_t time_ns, replication_op op, string_view sheet,
+  string_view first, string_view second, string &out)
+{
+  string body;
+  put_varint(body, seq);
+  put_varint(body, time_ns);
+  body += (char) op;
+  put_string(body, sheet);
+  put_string(body, first);
+  put_string(body, second);
+  put_string(out, body);
+}
+
+/**
+  * decode_replication_record
+  */
+int decode_replication_record(const char *&pos, const char *end, replication_record &record)
+{
+  const char *start = pos;
+  uint64_t size;
+  if(!get_varint(pos, end, &size)) {
+    pos = start;
+    // A varint longer than ten bytes can never be completed
+    return end - start >= 10 ? -1 : 0;
+  }
+  if(end - pos < size) {
+    pos = start;
+    return 0;
+  }
+
+  const char *body_end = pos + size;
+  string_view sheet, first, second;
+  if(!get_varint(pos, body_end, &record.seq) || !get_varint(pos, body_end, &record.time_ns) || pos == body_end)
+    return -1;
+  record.op = (replication_op) *pos++;
+  if(!get_string(pos, body_end, &sheet) || !get_string(pos, body_end, &first) || !get_string(pos, body_end, &second)
+    || pos != body_end)
+    return -1;
+
+  record.sheet = string(sheet);
+  record.first = string(first);
+  record.second = string(second);
+  return 1;
+}
+
+/**
+  * write_replication
+  */
+void write_replication(replication_op op, string_view sheet, string_view first, string_view second)
+{
+  replication_mutex.lock();
+  if(active_leader != nullptr)
+    active_leader->append(op, sheet, first, second);
+  replication_mutex.unlock();
+}
+
+/**
+  * replication_leader
+  * A socket file left behind by an earlier leader is removed first
+  */
+replication_leader::replication_leader(boost::asio::io_context &io_context, const string &path, function<size_t()> snapshot)
+  : acceptor(io_context), snapshot(snapshot)
+{
+  unlink(path.c_str());
+  boost::asio::local::stream_protocol::endpoint endpoint(path);
+  acceptor.open(endpoint.protocol());
+  acceptor.bind(endpoint);
+  acceptor.listen();
+
+  replication_mutex.lock();
+  active_leader = this;
+  replication_mutex.unlock();
+}
+
+/**
+  * ~replication_leader
+  */
+replication_leader::~replication_leader()
+{
+  replication_mutex.lock();
+  replicating.store(false);
+  active_leader = nullptr;
+  replication_mutex.unlock();
+}
+
+/**
+  * async_accept
+  */
+void replication_leader::async_accept()
+{
+  pending_socket = make_shared<boost::asio::local::stream_protocol::socket>(acceptor.get_executor());
+  acceptor.async_accept(*pending_socket, [this] (boost::system::error_code error) {
+    if(!error) {
+      replication_mutex.lock();
+      if(follower != nullptr)
+        drop_follower();
+      follower = pending_socket;
+      pending.clear();
+      unacked.clear();
+      acked_seq = next_seq - 1;
+      snapshotting = true;
+      replicating.store(true);
+      replication_mutex.unlock();
+
+      // The state of every spreadsheet goes first, so every later change applies on top of it
+      size_t sheet_count = snapshot();
+      replication_mutex.lock();
+      snapshotting = false;
+      snapshot_bytes = pending.size() + writing.size();
+      replication_mutex.unlock();
+      write_log(log_level::info, log_event::follower_connected, 0, string_view(), string_view(), sheet_count);
+      // The follower may already have been dropped, or replaced by another one, in which case the reads fail
+      read_acks(pending_socket, make_shared<string>());
+    }
+    async_accept();
+  });
+}
+
+/**
+  * append
+  */
+void replication_leader::append(replication_op op, string_view sheet, string_view first, string_view second)
+{
+  if(follower == nullptr)
+    return;
+
+  uint64_t now = now_ns();
+  encode_replication_record(next_seq, now, op, sheet, first, second, pending);
+  unacked.push_back(make_pair(next_seq, now));
+  next_seq++;
+
+  if(!snapshotting && pending.size() + writing.size() > REPLICATION_MAX_PENDING + snapshot_bytes) {
+    drop_follower();
+    return;
+  }
+
+  if(!write_in_progress) {
+    write_in_progress = true;
+    boost::asio::post(acceptor.get_executor(), [this] { write_pending(); });
+  }
+}
+
+/**
+  * write_pending
+  * Writes everything appended since the last write, and carries on until nothing is left
+  */
+void replication_leader::write_pending()
+{
+  replication_mutex.lock();
+  if(follower == nullptr || pending.empty()) {
+    write_in_progress = false;
+    replication_mutex.unlock();
+    return;
+  }
+  writing.swap(pending);
+  pending.clear();
+  shared_ptr<boost::asio::local::stream_protocol::socket> socket = follower;
+  replication_mutex.unlock();
+
+  boost::asio::async_write(*socket, boost::asio::buffer(writing),
+  [this, socket] (boost::system::error_code error, size_t bytes_transferred) {
+    replication_mutex.lock();
+    writing.clear();
+    bool current = socket == follower;
+    if(error && current)
+      drop_follower();
+    // A follower that connected while this write was going on has records of its own waiting
+    bool more = follower != nullptr && !pending.empty();
+    write_in_progress = more;
+    if(!more && !snapshotting)
+      snapshot_bytes = 0;
+    replication_mutex.unlock();
+    if(more)
+      write_pending();
+  });
+}
+
+/**
+  * read_acks
+  * The follower sends the sequence number of the last record it applied. Only the last complete one read counts
+  */
+void replication_leader::read_acks(shared_ptr<boost::asio::local::stream_protocol::socket> socket, shared_ptr<string> buffer)
+{
+  boost::asio::async_read(*socket, boost::asio::dynamic_buffer(*buffer), boost::asio::transfer_at_least(1),
+  [this, socket, buffer] (boost::system::error_code error, size_t bytes_transferred) {
+    replication_mutex.lock();
+    if(socket != follower) {
+      replication_mutex.unlock();
+      return;
+    }
+    if(error) {
+      drop_follower();
+      replication_mutex.unlock();
+      return;
+    }
+
+    const char *pos = buffer->data();
+    const char *end = buffer->data() + buffer->size();
+    uint64_t seq;
+    const char *last = pos;
+    while(get_varint(pos, end, &seq)) {
+      acked_seq = max(acked_seq, seq);
+      last = pos;
+    }
+    buffer->erase(0, last - buffer->data());
+    while(!unacked.empty() && unacked.front().first <= acked_seq)
+      unacked.pop_front();
+    replication_mutex.unlock();
+
+    read_acks(socket, buffer);
+  });
+}
+
+/**
+  * drop_follower
+  * Must be called with the replication_mutex locked
+  */
+void replication_leader::drop_follower()
+{
+  write_log(log_level::warn, log_event::follower_dropped, 0, string_view(), string_view(),
+    unacked.size(), pending.size() + writing.size());
+
+  boost::system::error_code ignored;
+  follower->close(ignored);
+  follower = nullptr;
+  replicating.store(false);
+  pending.clear();
+  unacked.clear();
+  followers_dropped++;
+}
+
+/**
+  * summary
+  */
+json replication_leader::summary()
+{
+  json leader;
+  replication_mutex.lock();
+  leader["follower_connected"] = follower != nullptr;
+  leader["sent_seq"] = next_seq - 1;
+  leader["acked_seq"] = acked_seq;
+  leader["lag_records"] = unacked.size();
+  leader["lag_us"] = unacked.empty() ? 0 : (now_ns() - unacked.front().second) / 1000;
+  leader["queued_bytes"] = pending.size() + writing.size();
+  leader["followers_dropped"] = followers_dropped;
+  replication_mutex.unlock();
+  return leader;
+}
+
+/**
+  * replication_follower
+  */
+replication_follower::replication_follower(boost::asio::io_context &io_context, const string &path,
+  function<void(const replication_record &)> apply, function<void()> take_over)
+  : io_context(io_context), socket(io_context), retry_timer(io_context), path(path), apply(apply), take_over(take_over)
+{
+}
+
+/**
+  * start
+  */
+void replication_follower::start()
+{
+  following.store(true);
+  connect();
+}
+
+/**
+  * connect
+  */
+void replication_follower::connect()
+{
+  socket.async_connect(boost::asio::local::stream_protocol::endpoint(path), [this] (boost::system::error_code error) {
+    if(error) {
+      boost::system::error_code ignored;
+      socket.close(ignored);
+      if(connected && ++reconnect_attempts >= REPLICATION_RECONNECT_ATTEMPTS) {
+        leader_lost();
+        return;
+      }
+      retry_timer.expires_after(REPLICATION_RETRY_INTERVAL);
+      retry_timer.async_wait([this] (boost::system::error_code error) {
+        if(!error)
+          connect();
+      });
+      return;
+    }
+
+    connected = true;
+    reconnect_attempts = 0;
+    write_log(log_level::info, log_event::leader_connected, 0);
+    read();
+  });
+}
+
+/**
+  * read
+  * Applies every complete record, leaving a partial one in the buffer, then acknowledges the last one
+  */
+void replication_follower::read()
+{
+  boost::asio::async_read(socket, boost::asio::dynamic_buffer(read_buffer), boost::asio::transfer_at_least(1),
+  [this] (boost::system::error_code error, size_t bytes_transferred) {
+    if(error) {
+      disconnected();
+      return;
+    }
+
+    const char *pos = read_buffer.data();
+    const char *end = read_buffer.data() + read_buffer.size();
+    replication_record record;
+    int result;
+    while((result = decode_replication_record(pos, end, record)) > 0) {
+      apply(record);
+      applied_seq.store(record.seq);
+      replication_lag.record(now_ns() - record.time_ns);
+    }
+    read_buffer.erase(0, pos - read_buffer.data());
+
+    if(result < 0) {
+      disconnected();
+      return;
+    }
+    send_ack();
+    read();
+  });
+}
+
+/**
+  * send_ack
+  * Only one acknowledgement is written at a time. One that comes up in the meantime is written
+  * after it, with the latest sequence number
+  */
+void replication_follower::send_ack()
+{
+  if(ack_in_progress) {
+    ack_waiting = true;
+    return;
+  }
+  ack_in_progress = true;
+  ack_waiting = false;
+  ack.clear();
+  put_varint(ack, applied_seq.load());
+
+  boost::asio::async_write(socket, boost::asio::buffer(ack), [this] (boost::system::error_code error, size_t bytes_transferred) {
+    ack_in_progress = false;
+    if(!error && ack_waiting)
+      send_ack();
+  });
+}
+
+/**
+  * disconnected
+  * The leader may have dropped this follower for falling behind rather than gone away, so the follower
+  * connects again. The snapshot sent on connecting replaces every spreadsheet, so the partial record
+  * left in the buffer is thrown away
+  */
+void replication_follower::disconnected()
+{
+  write_log(log_level::warn, log_event::leader_disconnected, 0, string_view(), string_view(), applied_seq.load());
+  boost::system::error_code ignored;
+  socket.close(ignored);
+  read_buffer.clear();
+  ack_waiting = false;
+  connect();
+}
+
+/**
+  * leader_lost
+  */
+void replication_follower::leader_lost()
+{
+  if(!following.exchange(false))
+    return;
+  write_log(log_level::warn, log_event::leader_lost, 0, string_view(), string_view(), applied_seq.load());
+  take_over();
+}
+
+/**
+  * replication_summary
+  */
+json replication_summary()
+{
+  json summary = json::object();
+  replication_mutex.lock();
+  replication_leader *leader = active_leader;
+  replication_mutex.unlock();
+  if(leader != nullptr)
+    summary["leader"] = leader->summary();
+
+  if(following.load() || applied_seq.load() != 0) {
+    summary["follower"]["following"] = following.load();
+    summary["follower"]["applied_seq"] = applied_seq.load();
+    summary["follower"]["lag"] = replication_lag.summary();
+  }
+  return summary;
+}
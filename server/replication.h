@@ -0,0 +1,150 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <string>
+#include <string_view>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+
+#include <boost/asio.hpp>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+using namespace std;
+
+/* A leader streams every change it makes to its spreadsheets to a follower over a Unix socket. When
+  a follower connects it is sent the state of every spreadsheet, then each change as it is made, in
+  the order the leader made them. The follower makes the same changes to its own spreadsheets, so
+  it ends up in the same state, and takes over the client port when the leader goes away.
+
+  Each record is the record size as a varint, followed by the sequence number and the time the
+  leader made the change (now_ns) as varints, the op as a byte, and the spreadsheet name and two
+  strings whose meaning depends on the op. The follower answers with the sequence number of the last
+  record it has applied, as a varint, after each read.
+
+  A follower whose connection breaks tries to connect again before taking over, since the leader
+  drops a follower that falls behind and the follower must catch up from a new snapshot. Only a
+  leader that cannot be reached for REPLICATION_RECONNECT_ATTEMPTS tries is taken to be gone. */
+enum class replication_op : unsigned char {
+  // The spreadsheet is replaced by the state in the first string (spreadsheet::encode_state)
+  sheet_state = 1,
+  create = 2,
+  // Cell name and contents
+  set_cell = 3,
+  // Cell name
+  revert_cell = 4,
+  undo = 5,
+  // The spreadsheet is created as a fork of the spreadsheet named by the first string (spreadsheet::fork)
+  fork = 6
+};
+
+struct replication_record {
+  uint64_t seq;
+  uint64_t time_ns;
+  replication_op op;
+  string sheet;
+  string first;
+  string second;
+};
+
+void encode_replication_record(uint64_t seq, uint64_t time_ns, replication_op op, string_view sheet,
+  string_view first, string_view second, string &out);
+/* Decodes the next record and moves pos past it. Returns 1 when a record was decoded, 0, leaving pos
+  alone, if the record is not all there yet, and -1 if it cannot be read */
+int decode_replication_record(const char *&pos, const char *end, replication_record &record);
+
+// Set while a follower is connected
+extern atomic<bool> replicating;
+
+void write_replication(replication_op op, string_view sheet, string_view first, string_view second);
+
+/* Sends a change to the follower, if there is one. Must be called while the spreadsheet mutex is held,
+  so that changes to each spreadsheet are streamed in the order they were made */
+inline void replicate(replication_op op, string_view sheet, string_view first = string_view(), string_view second = string_view())
+{
+  if(replicating.load(memory_order_relaxed))
+    write_replication(op, sheet, first, second);
+}
+
+/* Accepts followers on a Unix socket, one at a time. A new follower replaces the current one. When a
+  follower connects, snapshot is called to stream the state of every spreadsheet before any further
+  change, and returns the number of spreadsheets it sent. A follower that falls REPLICATION_MAX_PENDING bytes behind is dropped, and must connect
+  again for a new snapshot. The snapshot itself does not count towards the limit, so a follower can always be sent one */
+class replication_leader {
+  boost::asio::local::stream_protocol::acceptor acceptor;
+  shared_ptr<boost::asio::local::stream_protocol::socket> pending_socket;
+  function<size_t()> snapshot;
+
+  /* The connected follower and the records waiting to be written to it. Records are appended to
+    pending while the previous ones, in writing, are written. unacked holds the sequence number and
+    time of each record the follower has not yet applied. Accesses must be done in a thread safe
+    manner using the replication_mutex */
+  shared_ptr<boost::asio::local::stream_protocol::socket> follower;
+  string pending;
+  string writing;
+  bool write_in_progress = false;
+  uint64_t next_seq = 1;
+  uint64_t acked_seq = 0;
+  deque<pair<uint64_t, uint64_t>> unacked;
+  uint64_t followers_dropped = 0;
+  // Whether the snapshot is being streamed, and the bytes of it that are still to be written
+  bool snapshotting = false;
+  size_t snapshot_bytes = 0;
+
+  void write_pending();
+  void read_acks(shared_ptr<boost::asio::local::stream_protocol::socket> socket, shared_ptr<string> buffer);
+  void drop_follower();
+
+  public:
+    replication_leader(boost::asio::io_context &io_context, const string &path, function<size_t()> snapshot);
+    ~replication_leader();
+
+    void async_accept();
+    // Must be called with the replication_mutex locked
+    void append(replication_op op, string_view sheet, string_view first, string_view second);
+    json summary();
+};
+
+/* Connects to a leader, applies every record it sends, and calls take_over once the leader has gone
+  away. Until the first connection succeeds the follower keeps trying, so it can be started before
+  the leader. A connection that breaks after that is made again, for a new snapshot, unless the
+  leader cannot be reached */
+class replication_follower {
+  boost::asio::io_context &io_context;
+  boost::asio::local::stream_protocol::socket socket;
+  boost::asio::steady_timer retry_timer;
+  string path;
+  string read_buffer;
+  function<void(const replication_record &)> apply;
+  function<void()> take_over;
+  bool connected = false;
+  // Failed attempts to connect again since the connection to the leader broke
+  int reconnect_attempts = 0;
+
+  // The acknowledgement being written, and whether a newer one is waiting
+  string ack;
+  bool ack_in_progress = false;
+  bool ack_waiting = false;
+
+  void connect();
+  void read();
+  void send_ack();
+  void disconnected();
+  void leader_lost();
+
+  public:
+    replication_follower(boost::asio::io_context &io_context, const string &path,
+      function<void(const replication_record &)> apply, function<void()> take_over);
+
+    void start();
+};
+
+// Leader and follower replication metrics, including how far the follower is behind the leader
+json replication_summary();
+
+#endif
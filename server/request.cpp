@@ -0,0 +1,364 @@
+#include "request.h"
+
+/* A request is parsed directly out of the receive buffer rather than through a JSON
+  document. Only the fields the server understands are extracted, as views into the buffer.
+  Escaped strings are decoded in place, which is always possible because the decoded form of
+  a string is never longer than its escaped form. Nothing is allocated unless an editCells
+  request has more cells than any request parsed before it */
+
+// Nested objects and arrays in fields the server ignores are skipped up to this depth
+const int MAX_SKIP_DEPTH = 32;
+
+static bool skip_value(char *&pos, char *end, int depth);
+
+
+/**
+  * clear
+  */
+void request::clear() {
+  type = request_type::unknown;
+  cell_name = string_view();
+  contents = string_view();
+  last_cell = string_view();
+  cells.clear();
+  names.clear();
+}
+
+
+/**
+  * to_request_type
+  */
+request_type to_request_type(string_view name) {
+  if(name == "editCell")
+    return request_type::edit_cell;
+  if(name == "selectCell")
+    return request_type::select_cell;
+  if(name == "editCells")
+    return request_type::edit_cells;
+  if(name == "undo")
+    return request_type::undo;
+  if(name == "revertCell")
+    return request_type::revert_cell;
+  if(name == "setViewport")
+    return request_type::set_viewport;
+  return request_type::unknown;
+}
+
+
+/**
+  * skip_whitespace
+  */
+static void skip_whitespace(char *&pos, char *end) {
+  while(pos < end && (*pos == ' ' || *pos == '\t' || *pos == '\n' || *pos == '\r'))
+    pos++;
+}
+
+
+/**
+  * expect
+  * Skips whitespace and consumes the given character if it is next
+  */
+static bool expect(char *&pos, char *end, char c) {
+  skip_whitespace(pos, end);
+  if(pos == end || *pos != c)
+    return false;
+  pos++;
+  return true;
+}
+
+
+/**
+  * hex_value
+  * Reads the four hex digits of a \u escape
+  */
+static bool hex_value(char *pos, char *end, unsigned int *value) {
+  if(end - pos < 4)
+    return false;
+
+  *value = 0;
+  for(int i = 0; i < 4; i++) {
+    char c = pos[i];
+    *value <<= 4;
+    if(c >= '0' && c <= '9')
+      *value |= c - '0';
+    else if(c >= 'a' && c <= 'f')
+      *value |= c - 'a' + 10;
+    else if(c >= 'A' && c <= 'F')
+      *value |= c - 'A' + 10;
+    else
+      return false;
+  }
+  return true;
+}
+
+
+/**
+  * parse_string
+  * pos must be at the opening quote. The string is unescaped in place and out is set to
+  * the decoded characters
+  */
+static bool parse_string(char *&pos, char *end, string_view &out) {
+  skip_whitespace(pos, end);
+  if(pos == end || *pos != '"')
+    return false;
+
+  char *read = pos + 1;
+  char *write = read;
+  char *start = read;
+
+  while(read < end) {
+    char c = *read;
+
+    if(c == '"') {
+      out = string_view(start, write - start);
+      pos = read + 1;
+      return true;
+    }
+
+    // Control characters must be escaped
+    if((unsigned char) c < 0x20)
+      return false;
+
+    if(c != '\\') {
+      *write++ = *read++;
+      continue;
+    }
+
+    if(++read == end)
+      return false;
+
+    switch(*read++) {
+      case '"':  *write++ = '"';  break;
+      case '\\': *write++ = '\\'; break;
+      case '/':  *write++ = '/';  break;
+      case 'b':  *write++ = '\b'; break;
+      case 'f':  *write++ = '\f'; break;
+      case 'n':  *write++ = '\n'; break;
+      case 'r':  *write++ = '\r'; break;
+      case 't':  *write++ = '\t'; break;
+      case 'u': {
+        unsigned int code;
+        if(!hex_value(read, end, &code))
+          return false;
+        read += 4;
+
+        // Characters outside the basic plane are written as a surrogate pair
+        if(code >= 0xD800 && code <= 0xDBFF) {
+          unsigned int low;
+          if(end - read < 6 || read[0] != '\\' || read[1] != 'u' || !hex_value(read + 2, end, &low) ||
+            low < 0xDC00 || low > 0xDFFF)
+            return false;
+          read += 6;
+          code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+        }
+        else if(code >= 0xDC00 && code <= 0xDFFF)
+          return false;
+
+        // Encode as UTF-8
+        if(code < 0x80)
+          *write++ = code;
+        else if(code < 0x800) {
+          *write++ = 0xC0 | (code >> 6);
+          *write++ = 0x80 | (code & 0x3F);
+        }
+        else if(code < 0x10000) {
+          *write++ = 0xE0 | (code >> 12);
+          *write++ = 0x80 | ((code >> 6) & 0x3F);
+          *write++ = 0x80 | (code & 0x3F);
+        }
+        else {
+          *write++ = 0xF0 | (code >> 18);
+          *write++ = 0x80 | ((code >> 12) & 0x3F);
+          *write++ = 0x80 | ((code >> 6) & 0x3F);
+          *write++ = 0x80 | (code & 0x3F);
+        }
+        break;
+      }
+      default:
+        return false;
+    }
+  }
+
+  // No closing quote
+  return false;
+}
+
+
+/**
+  * skip_literal
+  * Skips a number, true, false or null
+  */
+static bool skip_literal(char *&pos, char *end) {
+  char *start = pos;
+  while(pos < end && ((*pos >= '0' && *pos <= '9') || (*pos >= 'a' && *pos <= 'z') ||
+    *pos == '-' || *pos == '+' || *pos == '.' || *pos == 'E'))
+    pos++;
+
+  string_view literal(start, pos - start);
+  if(literal == "true" || literal == "false" || literal == "null")
+    return true;
+
+  // Anything else must look like a number
+  return literal.size() > 0 && (literal[0] == '-' || (literal[0] >= '0' && literal[0] <= '9')) &&
+    literal.find_first_of("abcdfghijklmnopqrstuvwxyz") == string_view::npos;
+}
+
+
+/**
+  * skip_container
+  * Skips an object or array, pos must be at its opening character
+  */
+static bool skip_container(char *&pos, char *end, int depth) {
+  bool is_object = *pos == '{';
+  char close = is_object ? '}' : ']';
+  pos++;
+
+  if(expect(pos, end, close))
+    return true;
+
+  do {
+    if(is_object) {
+      string_view key;
+      if(!parse_string(pos, end, key) || !expect(pos, end, ':'))
+        return false;
+    }
+    if(!skip_value(pos, end, depth + 1))
+      return false;
+  } while(expect(pos, end, ','));
+
+  return expect(pos, end, close);
+}
+
+
+/**
+  * skip_value
+  * Skips the value of a field the server does not use
+  */
+static bool skip_value(char *&pos, char *end, int depth) {
+  skip_whitespace(pos, end);
+  if(pos == end || depth > MAX_SKIP_DEPTH)
+    return false;
+
+  string_view ignored;
+  if(*pos == '"')
+    return parse_string(pos, end, ignored);
+  if(*pos == '{' || *pos == '[')
+    return skip_container(pos, end, depth);
+  return skip_literal(pos, end);
+}
+
+
+/**
+  * parse_edits
+  * Parses the cells array of an editCells request
+  */
+static bool parse_edits(char *&pos, char *end, vector<cell_edit> &cells) {
+  if(!expect(pos, end, '['))
+    return false;
+  if(expect(pos, end, ']'))
+    return true;
+
+  do {
+    cell_edit edit;
+    if(!expect(pos, end, '{'))
+      return false;
+
+    if(!expect(pos, end, '}')) {
+      do {
+        string_view key;
+        if(!parse_string(pos, end, key) || !expect(pos, end, ':'))
+          return false;
+
+        bool ok;
+        if(key == "cellName")
+          ok = parse_string(pos, end, edit.cell_name);
+        else if(key == "contents")
+          ok = parse_string(pos, end, edit.contents);
+        else
+          ok = skip_value(pos, end, 1);
+        if(!ok)
+          return false;
+      } while(expect(pos, end, ','));
+
+      if(!expect(pos, end, '}'))
+        return false;
+    }
+
+    // Both fields are required
+    if(edit.cell_name.data() == nullptr || edit.contents.data() == nullptr)
+      return false;
+    cells.push_back(edit);
+  } while(expect(pos, end, ','));
+
+  return expect(pos, end, ']');
+}
+
+
+/**
+  * parse_request
+  * Parses a single request in the range [begin, end), which is modified in place.
+  * Returns false if the request is not valid JSON or is missing a field its type requires
+  */
+bool parse_request(char *begin, char *end, request &req) {
+  req.clear();
+  char *pos = begin;
+  bool has_cells = false;
+
+  if(!expect(pos, end, '{'))
+    return false;
+
+  if(!expect(pos, end, '}')) {
+    do {
+      string_view key;
+      if(!parse_string(pos, end, key) || !expect(pos, end, ':'))
+        return false;
+
+      bool ok;
+      if(key == "requestType") {
+        string_view type_name;
+        ok = parse_string(pos, end, type_name);
+        req.type = to_request_type(type_name);
+      }
+      else if(key == "cellName")
+        ok = parse_string(pos, end, req.cell_name);
+      else if(key == "contents")
+        ok = parse_string(pos, end, req.contents);
+      else if(key == "from")
+        ok = parse_string(pos, end, req.cell_name);
+      else if(key == "to")
+        ok = parse_string(pos, end, req.last_cell);
+      else if(key == "cells") {
+        req.cells.clear();
+        ok = parse_edits(pos, end, req.cells);
+        has_cells = true;
+      }
+      else
+        ok = skip_value(pos, end, 1);
+      if(!ok)
+        return false;
+    } while(expect(pos, end, ','));
+
+    if(!expect(pos, end, '}'))
+      return false;
+  }
+
+  // Nothing but whitespace may follow the request
+  skip_whitespace(pos, end);
+  if(pos != end)
+    return false;
+
+  switch(req.type) {
+    case request_type::edit_cell:
+      return req.cell_name.data() != nullptr && req.contents.data() != nullptr;
+    case request_type::select_cell:
+    case request_type::revert_cell:
+      return req.cell_name.data() != nullptr;
+    case request_type::edit_cells:
+      return has_cells;
+    // Both corners, or neither for the whole spreadsheet
+    case request_type::set_viewport:
+      return (req.cell_name.data() == nullptr) == (req.last_cell.data() == nullptr);
+    default:
+      return true;
+  }
+}
@@ -0,0 +1,47 @@
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+/* The kinds of requests a client may send once the handshake is complete. The values
+  are the frame types used by the binary wire protocol */
+enum class request_type : unsigned char {
+  unknown = 0,
+  edit_cell = 16,
+  edit_cells = 17,
+  select_cell = 18,
+  undo = 19,
+  revert_cell = 20,
+  set_viewport = 21
+};
+
+/* A single edit of an editCells request */
+struct cell_edit {
+  string_view cell_name;
+  string_view contents;
+};
+
+/* A parsed client request. The views point into the buffer the request was parsed
+  from (or into names, for cell names unpacked from a binary request), so they are only
+  valid until that buffer is modified. A request object can be reused for many parses,
+  which keeps the capacity of cells and names and avoids allocating */
+struct request {
+  request_type type;
+  string_view cell_name;
+  string_view contents;
+  // Opposite corner of a setViewport range, whose first corner is cell_name
+  string_view last_cell;
+  vector<cell_edit> cells;
+  string names;
+
+  void clear();
+};
+
+bool parse_request(char *begin, char *end, request &req);
+request_type to_request_type(string_view);
+
+#endif
@@ -0,0 +1,126 @@
+#include "shard.h"
+
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+  * hash_name
+  * 64 bit FNV-1a, followed by a final mix so that similar names land far apart on the ring
+  */
+uint64_t hash_name(string_view name)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for(int i = 0; i < name.size(); i++) {
+    hash ^= (unsigned char) name[i];
+    hash *= 1099511628211ULL;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+/**
+  * add
+  */
+void hash_ring::add(int shard)
+{
+  for(int i = 0; i < SHARD_RING_POINTS; i++)
+    points.push_back(make_pair(hash_name("shard-" + to_string(shard) + "#" + to_string(i)), shard));
+  sort(points.begin(), points.end());
+}
+
+/**
+  * owner
+  * The first point at or after the hash of the name, wrapping around to the first point
+  */
+int hash_ring::owner(string_view name) const
+{
+  uint64_t hash = hash_name(name);
+  vector<pair<uint64_t, int>>::const_iterator it = lower_bound(points.begin(), points.end(), make_pair(hash, -1));
+  if(it == points.end())
+    it = points.begin();
+  return it->second;
+}
+
+/**
+  * send_connection
+  */
+bool send_connection(int channel, int fd, const string &data)
+{
+  if(data.size() > MAX_HANDOFF_SIZE)
+    return false;
+
+  struct iovec iov;
+  iov.iov_base = (void *) data.data();
+  iov.iov_len = data.size();
+
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+
+  struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(header), &fd, sizeof(int));
+
+  ssize_t sent;
+  do {
+    sent = sendmsg(channel, &message, MSG_NOSIGNAL);
+  } while(sent < 0 && errno == EINTR);
+  return sent == (ssize_t) data.size();
+}
+
+/**
+  * receive_connection
+  */
+int receive_connection(int channel, int *fd, string &data)
+{
+  data.resize(MAX_HANDOFF_SIZE);
+  struct iovec iov;
+  iov.iov_base = &data[0];
+  iov.iov_len = data.size();
+
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+
+  ssize_t received;
+  do {
+    received = recvmsg(channel, &message, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+  } while(received < 0 && errno == EINTR);
+
+  if(received < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+  if(received == 0)
+    return -1;
+  data.resize(received);
+
+  *fd = -1;
+  for(struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header)) {
+    if(header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+      memcpy(fd, CMSG_DATA(header), sizeof(int));
+  }
+
+  // A message without a connection, or one cut short, is dropped
+  if(*fd < 0 || (message.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0) {
+    if(*fd >= 0)
+      close(*fd);
+    return 0;
+  }
+  return 1;
+}
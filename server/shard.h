@@ -0,0 +1,45 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+#include <cstdint>
+
+using namespace std;
+
+/* With --shards=N the server runs as a front end process and N shard processes. Each shard owns the
+  spreadsheets that hash to it. The front end accepts clients, sends them the names of every
+  spreadsheet, reads their spreadsheet choice, and then passes the connection to the shard owning
+  that spreadsheet over a Unix socket. The shard finishes the handshake as if it had read the
+  choice itself, and the front end is not involved in the connection from then on. */
+
+// Points each shard has on the ring. More points spread spreadsheets more evenly
+const int SHARD_RING_POINTS = 64;
+
+/* A consistent hash ring. Adding a shard only moves the spreadsheets that now hash to it */
+class hash_ring {
+  // Points in order of their hash, each with the shard it belongs to
+  vector<pair<uint64_t, int>> points;
+
+  public:
+    void add(int shard);
+    // The shard that owns a spreadsheet name. There must be at least one shard
+    int owner(string_view name) const;
+};
+
+uint64_t hash_name(string_view name);
+
+/* Sends a connected socket and the data that goes with it as a single message over a Unix
+  SOCK_SEQPACKET socket. Returns false if the message could not be sent */
+bool send_connection(int channel, int fd, const string &data);
+
+/* Receives a connection sent by send_connection without blocking. Returns 1 when a connection was
+  received, 0 if there is none waiting, and -1 if the channel is closed or broken */
+int receive_connection(int channel, int *fd, string &data);
+
+// Largest message send_connection sends: the handshake lines and anything the client sent after them
+const size_t MAX_HANDOFF_SIZE = 128 * 1024;
+
+#endif
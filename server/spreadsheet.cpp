@@ -1,432 +1,849 @@
-#include"spreadsheet.h"
-
-using json = nlohmann::json;
-
-
-/**
-  * spreadsheet empty constructor
-  */
-spreadsheet::spreadsheet(string name) : name(name) {}
-
-
-/**
-  * spreadsheet file constructor
-  */
-spreadsheet::spreadsheet(string path, bool differentiator) {
-  ifstream txtFile(path); 
-  
-  string line;
-  getline(txtFile, line);
-  json new_name = json::parse(line);
-  name = new_name["name"];
-
-  cell_history_mutex.lock();
-  cell_history = unordered_map<string, vector<string> >();
-
-  while(getline(txtFile, line)) {
-    json cell = json::parse(line);
-    string cellName = cell["cellName"];
-    //cell_history[cellName] = new vector<string>;
-    cell_history[cellName].push_back(cell["contents"]);
-  }
-
-  cell_history_mutex.unlock();
-  txtFile.close();
-}
-
-
-/**
-  * set_cell
-  */
-bool spreadsheet::set_cell(string cell_name, string contents, int user_id) {
-  bool correct_user = false;
-  selected_cells_mutex.lock();
-  for(int i = 0; i < selected_cells[cell_name].size(); i++)
-    if(selected_cells[cell_name].at(i).second == user_id) {
-      correct_user = true;
-      break;
-    }
-  selected_cells_mutex.unlock();
-
-  // If bad cell name or contents, refuse to edit
-  if(contents.length() > 0 && contents.at(0) == '=' && !valid_formula(cell_name, contents))
-    return false;
-  if (!valid_cell_name(cell_name) || circular_depend(cell_name, contents) || !correct_user) {
-    return false;
-  }
-
-  cell_history_mutex.lock();
-  vector<string> *history = get_history(cell_name);
-  
-  // Otherwise add the last value it was to general history
-  general_history_mutex.lock();
-  general_history.push_back(make_pair(cell_name, history->back()));
-  general_history_mutex.unlock();
-
-  // Update cell 
-  cell_history[cell_name].push_back(contents);
-  cell_history_mutex.unlock();
-
-  return true;
-}
-
-
-/**
-  * get_cell
-  */
-string spreadsheet::get_cell(string cell_name) {
-
-  // Return empty string on bad cell name
-  if (!valid_cell_name(cell_name))
-    return "";
-
-  cell_history_mutex.lock();
-  // Return most recent history, which is current contents
-  string ret_val = get_history(cell_name)->back();
-  cell_history_mutex.unlock();
-  return ret_val;
-}
-
-
-/**
-  * revert_cell
-  */
-bool spreadsheet::revert_cell(string cell_name, string * contents) {
-  cell_history_mutex.lock();
-
-  vector<string> * history = get_history(cell_name);
-
-  // If bad cell name, no revert history, or circular dependency arises, refuse to edit
-  if(!valid_cell_name(cell_name) || history->size() <= 1 || 
-    circular_depend(cell_name, history->at(history->size() - 2))) {
-    cell_history_mutex.unlock();
-    return false;
-  }
-
-  // Revert to previous state, put on general history, set contents to new value
-  //Previous content is the old content after the revert is complete
-  string previousContent = history->back();
-  history->pop_back();
-
-  //history.push_back(history.at(history.size() - 2));
-  general_history_mutex.lock();
-  //Push previous contents onto general history so it can be undone
-  general_history.push_back(make_pair(cell_name, previousContent));
-  general_history_mutex.unlock();
-
-  *contents = history->back();
-
-  cell_history_mutex.unlock();
-  return true;
-}
-
-
-/**
-  * all_cells
-  */
-vector<pair<string, string>> spreadsheet::all_cells() {
-  
-  vector<pair<string, string> > cell_list;
-
-  // Loop through all entries in the cell_history map, make pairs of cell_name to most recent value
-  cell_history_mutex.lock();
-  unordered_map<string, vector<string> >::iterator it = cell_history.begin();
-  for (; it != cell_history.end(); it++) {
-    cell_list.push_back(make_pair(it->first, it->second.back()));
-  }
-  cell_history_mutex.unlock();
-  
-  return cell_list;
-}
-
-/* 
- * selected cell is an unordered map mapping a cell name (string) to a vector of pairs
- * each pair has a client name (string) and id (int)
- *
- */
-bool spreadsheet::select_cell(string cell_name, string client_name, int id, string old_cell_name) {
-  if(!valid_cell_name(cell_name))
-    return false;
-  
-  selected_cells_mutex.lock();
-
-  if(old_cell_name != " ") {
-    //Remove the old cell from the selected list
-    for(int i = 0; i < selected_cells[old_cell_name].size(); i++)
-      if(selected_cells[old_cell_name].at(i).second == id)
-        selected_cells[old_cell_name].erase(selected_cells[old_cell_name].begin() + i);
-  }
-
-  //Select new cell
-  selected_cells[cell_name].push_back(make_pair(client_name, id));
-  
-  selected_cells_mutex.unlock();
-
-  return true;
-}
-
-
-void spreadsheet::deselect_cell(string cell_name, int client_id) {
-  selected_cells_mutex.lock();
-  if(cell_name != " ") {
-    for(int i = 0; i < selected_cells[cell_name].size(); i++)
-      if(selected_cells[cell_name].at(i).second == client_id)
-        selected_cells[cell_name].erase(selected_cells[cell_name].begin() + i);
-  }     
-  selected_cells_mutex.unlock();
-}
-
-unordered_map<string, vector<pair<string, int> > > spreadsheet::all_selects() {
-  return selected_cells;
-}
-
-/**
-  * undo
-  */
-pair<string, string> spreadsheet::undo() {
-
-  pair<string, string> edit("", "");
-
-  if(general_history.size() >= 1) {
-    general_history_mutex.lock();
-    edit = general_history.back();
-    general_history.pop_back();
-    general_history_mutex.unlock();
-  }
-  
-  return edit;
-}
-
-
-/**
-  * write_to_file
-  */
-void spreadsheet::write_to_file(string path) {
-
-  ofstream txtFile;
-  
-  txtFile.open(path, ofstream::trunc); 
-
-  cell_history_mutex.lock();
-  unordered_map<string, vector<string> >::iterator cell_iter = cell_history.begin();
-  
-  json new_name;
-  new_name["name"] = name;
-
-  txtFile << new_name.dump() << "\n";
-
-  for (; cell_iter != cell_history.end(); cell_iter++) {
-    json cell;
-    cell["cellName"] = cell_iter->first;
-    cell["contents"] = cell_iter->second.back(); 
-
-    txtFile << cell.dump() << "\n";
-  }
-
-  cell_history_mutex.unlock();
-  txtFile.close();
-}
-
-
- 
-
-/**
-  * valid_cell_name
-  */
-bool spreadsheet::valid_cell_name(string name) {
-  regex expr("\\$?[a-zA-Z]+\\$?\\d+");
-  //regex expr("[a-zA-Z_](?: [a-zA-Z_]|\\d)*");
-  return regex_match(name, expr);
-}
-
-
-/**
-  * circular_depend
-  * implements a BFS
-  */
-bool spreadsheet::circular_depend(string cell_name, string contents) {
-  unordered_map<string, bool> visited;
-  queue<string> queue;
-  visited[cell_name] = true;
-  vector<string> dependencies = find_depends(contents);
-  for(int i = 0; i < dependencies.size(); i++)
-    queue.push(dependencies.at(i));
-
-  for (;queue.size() > 0; queue.pop()) {
-    string curr_cell = queue.front();
-    if (visited[curr_cell])
-      return true;
-
-    visited[curr_cell] = true;
-    
-    cell_history_mutex.lock();
-    dependencies = find_depends(get_history(curr_cell)->back());
-    cell_history_mutex.unlock();
-
-    for (int i = 0; i < dependencies.size(); i++)
-      queue.push(dependencies.at(i));
-  }
-
-  return false;
-}
-
-
-/**
-  * find_depends
-  */
-vector<string> spreadsheet::find_depends(string contents) {
-  vector<string> tokens = get_tokens(& contents);
-  vector<string> dependencies;
-  
-  for (int i = 0; i < tokens.size(); i++)
-    if (valid_cell_name(tokens.at(i)))
-      dependencies.push_back(tokens.at(i));
-
-  return dependencies;
-}
-
-
-/**
-  * valid_formula
-  */
-bool spreadsheet::valid_formula(string cell_name, string contents) {
-  vector<string> tokens = get_tokens(&contents);
-
-  int num_par = 0;
-
-  //One token rule -- must be at least one token
-  if(tokens.size() == 0)
-    return false;
-
-  //Starting token rule -- first token must be number, var, or opening parenth
-  //TODO FIX WHEN I HAVE A BRAIN THAT WORKS AND IT'S NOT 1:00
-  bool is_num;
-  try {
-    is_num = true;
-    boost::lexical_cast<int>(tokens[0]);
-  }
-  catch(boost::bad_lexical_cast &) {
-    is_num = false;
-  }
-  if(!(is_num || valid_cell_name(tokens[0]) || tokens[0] == "("))
-    return false;
-  
-  //Ending token rule -- last token must be a number, var, or closing parenth
-  //TODO FIX WHEN I HAVE A BRAIN THAT WORKS AND IT'S NOT 1:00
-  try {
-    is_num = true;
-    boost::lexical_cast<int>(tokens[tokens.size()-1]);
-  }
-  catch(boost::bad_lexical_cast &) {
-    is_num = false;
-  }
-  if(!(is_num || valid_cell_name(tokens[0]) || tokens[tokens.size()-1] == ")"))
-    return false;
-  
-  string prev_token = "";
-
-  for(int i = 0; i < tokens.size(); i++) {
-    string curr_token = tokens[i];
-
-    //Cannot have anything before if it is the first token
-    if(i != 0) {
-      // Parentheses/operator following rule -- Any token that immediately follows an opening
-      //parenthesis or an operator must be either a number, a variable, or an opening parenthesis.
-      if (prev_token =="(" || prev_token == "*" || prev_token == "/" || prev_token == "+" || prev_token == "-") {
-        try {
-          is_num = true;
-          boost::lexical_cast<int>(curr_token);
-        }
-        catch(boost::bad_lexical_cast &) {
-          is_num = false;
-        }
-        if (!(is_num || valid_cell_name(curr_token) || curr_token == "("))
-          return false;
-      }
-      //Extra following rule -- Any token that immediately follows a number, a variable, or a 
-      //closing parenthesis must be either an operator or a closing parenthesis.
-      try {
-          is_num = true;
-          boost::lexical_cast<int>(prev_token);
-      }
-      catch(boost::bad_lexical_cast &) {
-        is_num = false;
-      }
-      if (is_num || valid_cell_name(prev_token) || prev_token == ")")
-        if (!(curr_token == "*" || curr_token == "/" || curr_token == "+" || curr_token == "-" || curr_token == ")"))
-          return false;
-    }
-  
-    //Check if operator 
-    if(curr_token == "(" || curr_token == ")" || curr_token == "*" || curr_token == "/" || curr_token == "+" || curr_token == "-") {
-      //Parentheses logic to assure balance
-      if(curr_token == "(")
-        num_par++;
-      if(curr_token == ")")
-        num_par--;
-      //If unbalanced number of parentheses
-      if(num_par < 0)
-        return false;
-    }
-
-    prev_token = curr_token;    
-  }
-  //Unbalanced num of parentheses after entire formula parsing
-  if(num_par != 0)
-    return false;
-
-  return true;
-}
-
-
-vector<string> spreadsheet::get_tokens(string *formula) {
-  regex expression("(\\()|(\\))|([\\+\\-*\\/])|(\\$?[a-zA-Z]+\\$?\\d+)|((?:\\d+\\.\\d*|\\d*\\.\\d+|\\d+)(?:[eE][\\+-]?\\d+)?)|(\\s+)");
-      
-  regex_token_iterator<string::iterator> formula_iter(formula->begin(), formula->end(), expression);
-  regex_token_iterator<string::iterator> iter_end;
-  vector<string> tokens;
-      
-  while(formula_iter != iter_end) {
-  string curr = *formula_iter++;
-  if(curr != " ")
-    tokens.push_back(curr);      
-  }
-
-  return tokens;
-}
-
-/**
-  * get_history
-  * Any calls to get_history and modification of the return must be done within
-  * a cell_history_mutex locked zone.
-  */
-vector<string> *spreadsheet::get_history(string cell_name) {
-
-  // If the cell is not in the history map, create it with empty state
-  if (cell_history.find(cell_name) == cell_history.end()) {
-    //cell_history[cell_name] = new vector<string>;
-    cell_history[cell_name].push_back("");
-  }
-
-  return &cell_history[cell_name];
-}
-
-/**
-  * Returns the history of this cell as a pointer to the vector.
-  * Creates a history for the cell if it doesn't exist, setting the first data to
-  * first_contents
-  */
-vector<string> *spreadsheet::get_history(string cell_name, string first_contents) {
-
-  // If the cell is not in the history map, create it with empty state
-  if (cell_history.find(cell_name) == cell_history.end()) {
-    cell_history[cell_name] = vector<string>();
-    cell_history[cell_name].push_back(first_contents);
-  }
-
-  return &cell_history[cell_name];
-}
-
-mutex* spreadsheet::spreadsheet_mutex() {
-  return &ss_mutex;
-}
+#include"spreadsheet.h"
+#include "protocol.h"
+
+#include <sstream>
+#include <atomic>
+
+using json = nlohmann::json;
+
+// Bytes of each map entry besides its key and value: the link to the next entry and the cached hash
+const size_t MAP_ENTRY_BYTES = sizeof(void *) + sizeof(size_t);
+
+/**
+  * heap_bytes
+  * Bytes allocated for the characters of a string with this capacity. Short strings are held
+  * inside the string itself
+  */
+static size_t heap_bytes(size_t capacity) {
+  static const size_t inline_capacity = string().capacity();
+  return capacity > inline_capacity ? capacity + 1 : 0;
+}
+
+size_t heap_bytes(const string &s) {
+  return heap_bytes(s.capacity());
+}
+
+/**
+  * cell_bytes
+  * Bytes of an entry of cell_history
+  */
+static size_t cell_bytes(const pair<const string, vector<string> > &cell) {
+  size_t bytes = MAP_ENTRY_BYTES + sizeof(cell) + heap_bytes(cell.first) + cell.second.capacity() * sizeof(string);
+  for(int i = 0; i < cell.second.size(); i++)
+    bytes += heap_bytes(cell.second.at(i));
+  return bytes;
+}
+
+/**
+  * tile_index
+  * The tile of cell_history that holds a cell
+  */
+static size_t tile_index(const string &cell_name) {
+  return hash<string>()(cell_name) % CELL_TILES;
+}
+
+/**
+  * selection_bytes
+  * Bytes of the list of clients that have a cell selected
+  */
+static size_t selection_bytes(const vector<pair<string, int> > &selections) {
+  size_t bytes = selections.capacity() * sizeof(pair<string, int>);
+  for(int i = 0; i < selections.size(); i++)
+    bytes += heap_bytes(selections.at(i).first);
+  return bytes;
+}
+
+
+/**
+  * sheet_memory total
+  */
+size_t sheet_memory::total() const {
+  return cells + general_history + selections;
+}
+
+
+/**
+  * spreadsheet empty constructor
+  */
+spreadsheet::spreadsheet(string name) : name(name) {}
+
+
+/**
+  * spreadsheet file constructor
+  */
+spreadsheet::spreadsheet(string path, bool differentiator) {
+  ifstream txtFile(path); 
+  
+  stringstream contents;
+  contents << txtFile.rdbuf();
+  txtFile.close();
+  decode_file(contents.str());
+}
+
+
+/**
+  * set_cell
+  * The edit is only allowed if the user currently has the cell selected
+  */
+bool spreadsheet::set_cell(const string &cell_name, const string &contents, int user_id) {
+  if(!is_selected_by(cell_name, user_id))
+    return false;
+
+  return set_cell(cell_name, contents);
+}
+
+
+/**
+  * set_cell
+  * Edits the cell without checking which user has it selected. Used for batch edits,
+  * where only the first cell of the batch must be selected by the user
+  */
+bool spreadsheet::set_cell(const string &cell_name, const string &contents) {
+  // If bad cell name or contents, refuse to edit
+  {
+    trace_span span("valid_formula");
+    if(contents.length() > 0 && contents.at(0) == '=' && !valid_formula(cell_name, contents))
+      return false;
+  }
+  {
+    trace_span span("circular_depend");
+    if (!valid_cell_name(cell_name) || circular_depend(cell_name, contents)) {
+      return false;
+    }
+  }
+
+  cell_history_mutex.lock();
+  vector<string> *history = get_history(cell_name);
+  
+  // Otherwise add the last value it was to general history
+  push_general_history(cell_name, history->back());
+
+  // Update cell 
+  size_t slots = history->capacity();
+  history->push_back(contents);
+  size_t added = (history->capacity() - slots) * sizeof(string) + heap_bytes(history->back());
+  cell_history[tile_index(cell_name)]->bytes += added;
+  cell_history_bytes += added;
+  cell_history_mutex.unlock();
+
+  return true;
+}
+
+
+/**
+  * is_selected_by
+  */
+bool spreadsheet::is_selected_by(const string &cell_name, int user_id) {
+  bool correct_user = false;
+  selected_cells_mutex.lock();
+  vector<pair<string, int> > *selections = get_selections(cell_name);
+  for(int i = 0; i < selections->size(); i++)
+    if(selections->at(i).second == user_id) {
+      correct_user = true;
+      break;
+    }
+  selected_cells_mutex.unlock();
+  return correct_user;
+}
+
+
+/**
+  * is_selected_by_other
+  */
+bool spreadsheet::is_selected_by_other(const string &cell_name, int user_id) {
+  bool other_user = false;
+  selected_cells_mutex.lock();
+  unordered_map<string, vector<pair<string, int> > >::const_iterator cell = selected_cells.find(cell_name);
+  if(cell != selected_cells.end())
+    for(int i = 0; i < cell->second.size(); i++)
+      if(cell->second.at(i).second != user_id) {
+        other_user = true;
+        break;
+      }
+  selected_cells_mutex.unlock();
+  return other_user;
+}
+
+
+/**
+  * get_cell
+  */
+string spreadsheet::get_cell(string cell_name) {
+
+  // Return empty string on bad cell name
+  if (!valid_cell_name(cell_name))
+    return "";
+
+  cell_history_mutex.lock();
+  // Return most recent history, which is current contents
+  string ret_val = find_history(cell_name)->back();
+  cell_history_mutex.unlock();
+  return ret_val;
+}
+
+
+/**
+  * revert_cell
+  */
+bool spreadsheet::revert_cell(const string &cell_name, string * contents) {
+  cell_history_mutex.lock();
+
+  const vector<string> * found = find_history(cell_name);
+
+  // If bad cell name or no revert history, refuse to edit
+  if(!valid_cell_name(cell_name) || found->size() <= 1) {
+    cell_history_mutex.unlock();
+    return false;
+  }
+  string reverted_contents = found->at(found->size() - 2);
+  cell_history_mutex.unlock();
+
+  // circular_depend locks the cell history itself. The caller holds the spreadsheet mutex,
+  // so the history cannot change in between
+  if(circular_depend(cell_name, reverted_contents))
+    return false;
+
+  cell_history_mutex.lock();
+  vector<string> * history = get_history(cell_name);
+
+  // Revert to previous state, put on general history, set contents to new value
+  //Previous content is the old content after the revert is complete
+  string previousContent = history->back();
+  cell_history[tile_index(cell_name)]->bytes -= heap_bytes(history->back());
+  cell_history_bytes -= heap_bytes(history->back());
+  history->pop_back();
+
+  //history.push_back(history.at(history.size() - 2));
+  //Push previous contents onto general history so it can be undone
+  push_general_history(cell_name, previousContent);
+
+  *contents = history->back();
+
+  cell_history_mutex.unlock();
+  return true;
+}
+
+
+/**
+  * all_cells
+  */
+vector<pair<string, string>> spreadsheet::all_cells() {
+  
+  vector<pair<string, string> > cell_list;
+
+  // Loop through all entries in the cell_history map, make pairs of cell_name to most recent value
+  cell_history_mutex.lock();
+  for (size_t i = 0; i < CELL_TILES; i++) {
+    if (cell_history[i] == nullptr)
+      continue;
+    unordered_map<string, vector<string> >::iterator it = cell_history[i]->cells.begin();
+    for (; it != cell_history[i]->cells.end(); it++) {
+      cell_list.push_back(make_pair(it->first, it->second.back()));
+    }
+  }
+  cell_history_mutex.unlock();
+  
+  return cell_list;
+}
+
+/**
+  * get_cells
+  */
+void spreadsheet::get_cells(vector<pair<string, string> > &cells) {
+  cell_history_mutex.lock();
+  for (int i = 0; i < cells.size(); i++)
+    cells[i].second = find_history(cells[i].first)->back();
+  cell_history_mutex.unlock();
+}
+
+/* 
+ * selected cell is an unordered map mapping a cell name (string) to a vector of pairs
+ * each pair has a client name (string) and id (int)
+ *
+ */
+bool spreadsheet::select_cell(const string &cell_name, const string &client_name, int id, const string &old_cell_name) {
+  if(!valid_cell_name(cell_name))
+    return false;
+  
+  selected_cells_mutex.lock();
+
+  if(old_cell_name != " ") {
+    //Remove the old cell from the selected list
+    vector<pair<string, int> > *old_selections = get_selections(old_cell_name);
+    selected_cells_bytes -= selection_bytes(*old_selections);
+    for(int i = 0; i < old_selections->size(); i++)
+      if(old_selections->at(i).second == id)
+        old_selections->erase(old_selections->begin() + i);
+    selected_cells_bytes += selection_bytes(*old_selections);
+  }
+
+  //Select new cell
+  vector<pair<string, int> > *selections = get_selections(cell_name);
+  selected_cells_bytes -= selection_bytes(*selections);
+  selections->push_back(make_pair(client_name, id));
+  selected_cells_bytes += selection_bytes(*selections);
+  
+  selected_cells_mutex.unlock();
+
+  return true;
+}
+
+
+void spreadsheet::deselect_cell(const string &cell_name, int client_id) {
+  selected_cells_mutex.lock();
+  if(cell_name != " ") {
+    vector<pair<string, int> > *selections = get_selections(cell_name);
+    selected_cells_bytes -= selection_bytes(*selections);
+    for(int i = 0; i < selections->size(); i++)
+      if(selections->at(i).second == client_id)
+        selections->erase(selections->begin() + i);
+    selected_cells_bytes += selection_bytes(*selections);
+  }     
+  selected_cells_mutex.unlock();
+}
+
+unordered_map<string, vector<pair<string, int> > > spreadsheet::all_selects() {
+  return selected_cells;
+}
+
+/**
+  * undo
+  */
+pair<string, string> spreadsheet::undo() {
+
+  pair<string, string> edit("", "");
+
+  if(general_history.size() >= 1) {
+    general_history_mutex.lock();
+    edit = general_history.back();
+    general_history_bytes -= heap_bytes(general_history.back().first) + heap_bytes(general_history.back().second);
+    general_history.pop_back();
+    general_history_mutex.unlock();
+  }
+  
+  return edit;
+}
+
+
+/**
+  * write_to_file
+  */
+void spreadsheet::write_to_file(string path) {
+
+  ofstream txtFile;
+  
+  txtFile.open(path, ofstream::trunc); 
+
+  string contents;
+  encode_file(contents);
+  txtFile << contents;
+
+  txtFile.close();
+}
+
+
+/**
+  * encode_file
+  * A line holding the name, then a line for each cell holding its name and current contents
+  */
+void spreadsheet::encode_file(string &out) {
+  cell_history_mutex.lock();
+  
+  json new_name;
+  new_name["name"] = name;
+
+  out += new_name.dump() + "\n";
+
+  for (size_t i = 0; i < CELL_TILES; i++) {
+    if (cell_history[i] == nullptr)
+      continue;
+    unordered_map<string, vector<string> >::iterator cell_iter = cell_history[i]->cells.begin();
+    for (; cell_iter != cell_history[i]->cells.end(); cell_iter++) {
+      json cell;
+      cell["cellName"] = cell_iter->first;
+      cell["contents"] = cell_iter->second.back(); 
+
+      out += cell.dump() + "\n";
+    }
+  }
+
+  cell_history_mutex.unlock();
+}
+
+
+/**
+  * decode_file
+  * Reads what encode_file wrote. Throws if a line is not valid JSON
+  */
+void spreadsheet::decode_file(string_view contents) {
+  size_t newline = contents.find('\n');
+  json new_name = json::parse(contents.substr(0, newline));
+  name = new_name["name"];
+
+  unordered_map<string, vector<string> > cells;
+  while(newline != string_view::npos && newline + 1 < contents.size()) {
+    size_t start = newline + 1;
+    newline = contents.find('\n', start);
+    string_view line = contents.substr(start, newline == string_view::npos ? string_view::npos : newline - start);
+    if(line.empty())
+      continue;
+    json cell = json::parse(line);
+    string cellName = cell["cellName"];
+    cells[cellName].push_back(cell["contents"]);
+  }
+  cell_tiles tiles;
+  size_t bytes = fill_tiles(cells, tiles);
+
+  cell_history_mutex.lock();
+  cell_history.swap(tiles);
+  cell_history_bytes = bytes;
+  cell_history_mutex.unlock();
+}
+
+
+ 
+
+/**
+  * encode_state
+  * The number of cells, then the name, history size and history of each cell, then the size of the
+  * general history and each of its entries, all as varints and strings
+  */
+void spreadsheet::encode_state(string &out) {
+  cell_history_mutex.lock();
+  size_t count = 0;
+  for (size_t i = 0; i < CELL_TILES; i++)
+    if (cell_history[i] != nullptr)
+      count += cell_history[i]->cells.size();
+  put_varint(out, count);
+  for (size_t i = 0; i < CELL_TILES; i++) {
+    if (cell_history[i] == nullptr)
+      continue;
+    unordered_map<string, vector<string> >::iterator cell_iter = cell_history[i]->cells.begin();
+    for (; cell_iter != cell_history[i]->cells.end(); cell_iter++) {
+      put_string(out, cell_iter->first);
+      put_varint(out, cell_iter->second.size());
+      for(int j = 0; j < cell_iter->second.size(); j++)
+        put_string(out, cell_iter->second.at(j));
+    }
+  }
+  cell_history_mutex.unlock();
+
+  general_history_mutex.lock();
+  put_varint(out, general_history.size());
+  for(int i = 0; i < general_history.size(); i++) {
+    put_string(out, general_history.at(i).first);
+    put_string(out, general_history.at(i).second);
+  }
+  general_history_mutex.unlock();
+}
+
+
+/**
+  * decode_state
+  * Replaces the histories of this spreadsheet. Returns false, leaving them untouched, on bad data
+  */
+bool spreadsheet::decode_state(string_view data) {
+  const char *pos = data.data();
+  const char *end = data.data() + data.size();
+  string_view first, second;
+  uint64_t count, history_size;
+
+  unordered_map<string, vector<string> > new_cells;
+  if(!get_varint(pos, end, &count))
+    return false;
+  for(uint64_t i = 0; i < count; i++) {
+    if(!get_string(pos, end, &first) || !get_varint(pos, end, &history_size))
+      return false;
+    vector<string> &history = new_cells[string(first)];
+    for(uint64_t j = 0; j < history_size; j++) {
+      if(!get_string(pos, end, &second))
+        return false;
+      history.push_back(string(second));
+    }
+    if(history.empty())
+      return false;
+  }
+
+  vector<pair<string, string> > new_general;
+  if(!get_varint(pos, end, &count))
+    return false;
+  for(uint64_t i = 0; i < count; i++) {
+    if(!get_string(pos, end, &first) || !get_string(pos, end, &second))
+      return false;
+    new_general.push_back(make_pair(string(first), string(second)));
+  }
+  if(pos != end)
+    return false;
+  cell_tiles tiles;
+  size_t cells_bytes = fill_tiles(new_cells, tiles);
+  size_t general_bytes = count_general_history(new_general);
+
+  cell_history_mutex.lock();
+  cell_history.swap(tiles);
+  cell_history_bytes = cells_bytes;
+  cell_history_mutex.unlock();
+  general_history_mutex.lock();
+  general_history.swap(new_general);
+  general_history_bytes = general_bytes;
+  general_history_mutex.unlock();
+  return true;
+}
+
+
+/**
+  * valid_cell_name
+  */
+bool spreadsheet::valid_cell_name(const string &name) {
+  regex expr("\\$?[a-zA-Z]+\\$?\\d+");
+  //regex expr("[a-zA-Z_](?: [a-zA-Z_]|\\d)*");
+  return regex_match(name, expr);
+}
+
+
+/**
+  * circular_depend
+  * implements a BFS
+  */
+bool spreadsheet::circular_depend(const string &cell_name, const string &contents) {
+  unordered_map<string, bool> visited;
+  queue<string> queue;
+  visited[cell_name] = true;
+  vector<string> dependencies = find_depends(contents);
+  for(int i = 0; i < dependencies.size(); i++)
+    queue.push(dependencies.at(i));
+
+  for (;queue.size() > 0; queue.pop()) {
+    string curr_cell = queue.front();
+    if (visited[curr_cell])
+      return true;
+
+    visited[curr_cell] = true;
+    
+    cell_history_mutex.lock();
+    dependencies = find_depends(find_history(curr_cell)->back());
+    cell_history_mutex.unlock();
+
+    for (int i = 0; i < dependencies.size(); i++)
+      queue.push(dependencies.at(i));
+  }
+
+  return false;
+}
+
+
+/**
+  * find_depends
+  */
+vector<string> spreadsheet::find_depends(const string &contents) {
+  vector<string> tokens = get_tokens(& contents);
+  vector<string> dependencies;
+  
+  for (int i = 0; i < tokens.size(); i++)
+    if (valid_cell_name(tokens.at(i)))
+      dependencies.push_back(tokens.at(i));
+
+  return dependencies;
+}
+
+
+/**
+  * valid_formula
+  */
+bool spreadsheet::valid_formula(const string &cell_name, const string &contents) {
+  vector<string> tokens = get_tokens(&contents);
+
+  int num_par = 0;
+
+  //One token rule -- must be at least one token
+  if(tokens.size() == 0)
+    return false;
+
+  //Starting token rule -- first token must be number, var, or opening parenth
+  //TODO FIX WHEN I HAVE A BRAIN THAT WORKS AND IT'S NOT 1:00
+  bool is_num;
+  try {
+    is_num = true;
+    boost::lexical_cast<int>(tokens[0]);
+  }
+  catch(boost::bad_lexical_cast &) {
+    is_num = false;
+  }
+  if(!(is_num || valid_cell_name(tokens[0]) || tokens[0] == "("))
+    return false;
+  
+  //Ending token rule -- last token must be a number, var, or closing parenth
+  //TODO FIX WHEN I HAVE A BRAIN THAT WORKS AND IT'S NOT 1:00
+  try {
+    is_num = true;
+    boost::lexical_cast<int>(tokens[tokens.size()-1]);
+  }
+  catch(boost::bad_lexical_cast &) {
+    is_num = false;
+  }
+  if(!(is_num || valid_cell_name(tokens[0]) || tokens[tokens.size()-1] == ")"))
+    return false;
+  
+  string prev_token = "";
+
+  for(int i = 0; i < tokens.size(); i++) {
+    string curr_token = tokens[i];
+
+    //Cannot have anything before if it is the first token
+    if(i != 0) {
+      // Parentheses/operator following rule -- Any token that immediately follows an opening
+      //parenthesis or an operator must be either a number, a variable, or an opening parenthesis.
+      if (prev_token =="(" || prev_token == "*" || prev_token == "/" || prev_token == "+" || prev_token == "-") {
+        try {
+          is_num = true;
+          boost::lexical_cast<int>(curr_token);
+        }
+        catch(boost::bad_lexical_cast &) {
+          is_num = false;
+        }
+        if (!(is_num || valid_cell_name(curr_token) || curr_token == "("))
+          return false;
+      }
+      //Extra following rule -- Any token that immediately follows a number, a variable, or a 
+      //closing parenthesis must be either an operator or a closing parenthesis.
+      try {
+          is_num = true;
+          boost::lexical_cast<int>(prev_token);
+      }
+      catch(boost::bad_lexical_cast &) {
+        is_num = false;
+      }
+      if (is_num || valid_cell_name(prev_token) || prev_token == ")")
+        if (!(curr_token == "*" || curr_token == "/" || curr_token == "+" || curr_token == "-" || curr_token == ")"))
+          return false;
+    }
+  
+    //Check if operator 
+    if(curr_token == "(" || curr_token == ")" || curr_token == "*" || curr_token == "/" || curr_token == "+" || curr_token == "-") {
+      //Parentheses logic to assure balance
+      if(curr_token == "(")
+        num_par++;
+      if(curr_token == ")")
+        num_par--;
+      //If unbalanced number of parentheses
+      if(num_par < 0)
+        return false;
+    }
+
+    prev_token = curr_token;    
+  }
+  //Unbalanced num of parentheses after entire formula parsing
+  if(num_par != 0)
+    return false;
+
+  return true;
+}
+
+
+vector<string> spreadsheet::get_tokens(const string *formula) {
+  regex expression("(\\()|(\\))|([\\+\\-*\\/])|(\\$?[a-zA-Z]+\\$?\\d+)|((?:\\d+\\.\\d*|\\d*\\.\\d+|\\d+)(?:[eE][\\+-]?\\d+)?)|(\\s+)");
+      
+  regex_token_iterator<string::const_iterator> formula_iter(formula->begin(), formula->end(), expression);
+  regex_token_iterator<string::const_iterator> iter_end;
+  vector<string> tokens;
+      
+  while(formula_iter != iter_end) {
+  string curr = *formula_iter++;
+  if(curr != " ")
+    tokens.push_back(curr);      
+  }
+
+  return tokens;
+}
+
+/**
+  * get_history
+  * Any calls to get_history and modification of the return must be done within
+  * a cell_history_mutex locked zone.
+  */
+vector<string> *spreadsheet::get_history(const string &cell_name) {
+
+  // If the cell is not in the history map, create it with empty state
+  return get_history(cell_name, "");
+}
+
+/**
+  * Returns the history of this cell as a pointer to the vector.
+  * Creates a history for the cell if it doesn't exist, setting the first data to
+  * first_contents
+  */
+vector<string> *spreadsheet::get_history(const string &cell_name, const string &first_contents) {
+
+  // If the cell is not in the history map, create it with empty state
+  cell_tile *tile = writable_tile(cell_name);
+  unordered_map<string, vector<string> >::iterator cell = tile->cells.find(cell_name);
+  if (cell == tile->cells.end()) {
+    cell = tile->cells.emplace(cell_name, vector<string>()).first;
+    cell->second.push_back(first_contents);
+    size_t bytes = cell_bytes(*cell);
+    tile->bytes += bytes;
+    cell_history_bytes += bytes;
+  }
+
+  return &cell->second;
+}
+
+/**
+  * find_history
+  * The history of a cell for reading, which leaves a tile shared with a fork as it is. A cell
+  * that has no history yet reads as the history get_history would create for it, without creating
+  * anything. Must be called with the cell_history_mutex locked
+  */
+const vector<string> *spreadsheet::find_history(const string &cell_name) {
+  static const vector<string> empty_history(1, "");
+  const shared_ptr<cell_tile> &tile = cell_history[tile_index(cell_name)];
+  if (tile != nullptr) {
+    unordered_map<string, vector<string> >::const_iterator cell = tile->cells.find(cell_name);
+    if (cell != tile->cells.end())
+      return &cell->second;
+  }
+  return &empty_history;
+}
+
+/**
+  * writable_tile
+  * The tile holding a cell, allocated if it is empty and copied if it is shared with a fork. The
+  * histories of a copy have no spare capacity, so its bytes are counted again. Must be called with
+  * the cell_history_mutex locked
+  */
+cell_tile *spreadsheet::writable_tile(const string &cell_name) {
+  shared_ptr<cell_tile> &tile = cell_history[tile_index(cell_name)];
+  if (tile == nullptr)
+    tile = make_shared<cell_tile>();
+  else if (tile.use_count() > 1) {
+    shared_ptr<cell_tile> copy = make_shared<cell_tile>(*tile);
+    copy->bytes = 0;
+    for (unordered_map<string, vector<string> >::const_iterator cell = copy->cells.begin(); cell != copy->cells.end(); cell++)
+      copy->bytes += cell_bytes(*cell);
+    cell_history_bytes = cell_history_bytes - tile->bytes + copy->bytes;
+    tile = copy;
+  }
+  else
+    // Pairs with the release of the last other reference, so its reads are done before the tile is changed
+    atomic_thread_fence(memory_order_acquire);
+  return tile.get();
+}
+
+/**
+  * get_selections
+  * The clients that have the cell selected, creating an empty list if there are none. Must be
+  * called with the selected_cells_mutex locked
+  */
+vector<pair<string, int> > *spreadsheet::get_selections(const string &cell_name) {
+  unordered_map<string, vector<pair<string, int> > >::iterator cell = selected_cells.find(cell_name);
+  if (cell == selected_cells.end()) {
+    cell = selected_cells.emplace(cell_name, vector<pair<string, int> >()).first;
+    selected_cells_bytes += MAP_ENTRY_BYTES + sizeof(*cell) + heap_bytes(cell->first);
+  }
+  return &cell->second;
+}
+
+/**
+  * push_general_history
+  * Records the contents a cell had before an edit, so it can be undone
+  */
+void spreadsheet::push_general_history(const string &cell_name, const string &contents) {
+  general_history_mutex.lock();
+  size_t slots = general_history.capacity();
+  general_history.push_back(make_pair(cell_name, contents));
+  general_history_bytes += (general_history.capacity() - slots) * sizeof(pair<string, string>)
+    + heap_bytes(general_history.back().first) + heap_bytes(general_history.back().second);
+  general_history_mutex.unlock();
+}
+
+/**
+  * fill_tiles
+  * Moves every cell into its tile. Returns the bytes held by the cells, less the buckets
+  */
+size_t spreadsheet::fill_tiles(unordered_map<string, vector<string> > &cells, cell_tiles &tiles) {
+  size_t total = 0;
+  while (!cells.empty()) {
+    unordered_map<string, vector<string> >::node_type cell = cells.extract(cells.begin());
+    shared_ptr<cell_tile> &tile = tiles[tile_index(cell.key())];
+    if (tile == nullptr)
+      tile = make_shared<cell_tile>();
+    size_t bytes = cell_bytes(*tile->cells.insert(move(cell)).position);
+    tile->bytes += bytes;
+    total += bytes;
+  }
+  return total;
+}
+
+/**
+  * count_general_history
+  */
+size_t spreadsheet::count_general_history(const vector<pair<string, string> > &history) {
+  size_t bytes = history.capacity() * sizeof(pair<string, string>);
+  for(int i = 0; i < history.size(); i++)
+    bytes += heap_bytes(history.at(i).first) + heap_bytes(history.at(i).second);
+  return bytes;
+}
+
+/**
+  * memory_usage
+  */
+sheet_memory spreadsheet::memory_usage() {
+  sheet_memory memory;
+  cell_history_mutex.lock();
+  memory.cells = cell_history_bytes;
+  for (size_t i = 0; i < CELL_TILES; i++) {
+    const shared_ptr<cell_tile> &tile = cell_history[i];
+    if (tile == nullptr)
+      continue;
+    size_t overhead = sizeof(cell_tile) + tile->cells.bucket_count() * sizeof(void *);
+    memory.cells += overhead;
+    if (tile.use_count() > 1)
+      memory.shared_cells += tile->bytes + overhead;
+  }
+  cell_history_mutex.unlock();
+
+  general_history_mutex.lock();
+  memory.general_history = general_history_bytes;
+  general_history_mutex.unlock();
+
+  selected_cells_mutex.lock();
+  memory.selections = selected_cells_bytes + selected_cells.bucket_count() * sizeof(void *);
+  selected_cells_mutex.unlock();
+  return memory;
+}
+
+/**
+  * edit_bytes
+  * The new contents go on the cell history and the current contents on the general history
+  */
+size_t spreadsheet::edit_bytes(const string &cell_name, const string &contents) {
+  size_t bytes = sizeof(string) + heap_bytes(contents.size())
+    + sizeof(pair<string, string>) + heap_bytes(cell_name.size());
+
+  cell_history_mutex.lock();
+  const shared_ptr<cell_tile> &tile = cell_history[tile_index(cell_name)];
+  unordered_map<string, vector<string> >::const_iterator cell;
+  if (tile == nullptr || (cell = tile->cells.find(cell_name)) == tile->cells.end())
+    bytes += MAP_ENTRY_BYTES + sizeof(pair<const string, vector<string> >) + heap_bytes(cell_name.size()) + sizeof(string);
+  else
+    bytes += heap_bytes(cell->second.back().size());
+  cell_history_mutex.unlock();
+  return bytes;
+}
+
+/**
+  * fork
+  * Takes the same time however many cells there are: only the pointers to the tiles are copied,
+  * and each tile is copied later by whichever spreadsheet changes it first
+  */
+spreadsheet *spreadsheet::fork(string new_name) {
+  spreadsheet *copy = new spreadsheet(new_name);
+  cell_history_mutex.lock();
+  copy->cell_history = cell_history;
+  copy->cell_history_bytes = cell_history_bytes;
+  cell_history_mutex.unlock();
+  return copy;
+}
+
+measured_mutex* spreadsheet::spreadsheet_mutex() {
+  return &ss_mutex;
+}
@@ -1,58 +1,124 @@
-#include<string>
-#include<vector>
-#include<unordered_map>
-#include<utility>
-#include <iostream>
-#include <fstream>
-#include <mutex>
-#include<regex>
-#include <nlohmann/json.hpp>
-#include <queue>
-#include<regex>
-#include <boost/asio.hpp>
-#include <boost/lexical_cast.hpp>
-
-using json = nlohmann::json;
-
-using namespace std;
-
-class spreadsheet {
-  string name;
-
-  mutex cell_history_mutex;
-  unordered_map<string, vector<string> > cell_history;
-
-  mutex general_history_mutex;
-  vector<pair<string, string> > general_history;
-
-  //Map of cell name to a vector of client_name and client id pair strings
-
-  mutex selected_cells_mutex;
-  unordered_map<string, vector<pair<string, int> > > selected_cells;
-  mutex ss_mutex;
-
-  public:
-    spreadsheet(string);
-    spreadsheet(string, bool); 
-
-    bool set_cell(string, string, int);
-    string get_cell(string);
-    bool revert_cell(string, string *);
-    vector<pair<string, string> > all_cells();
-    bool select_cell(string, string, int, string);
-    void deselect_cell(string, int);
-    unordered_map<string, vector<pair<string, int> > > all_selects();
-    pair<string, string> undo();
-    void write_to_file(string);
-    mutex* spreadsheet_mutex();
-    
-
-  private:
-    static bool valid_cell_name(string);
-    bool circular_depend(string, string);
-    vector<string> find_depends(string);
-    static bool valid_formula(string, string);
-    vector<string> *get_history(string);
-    vector<string> *get_history(string, string);
-    static vector<string> get_tokens(string*);
+#include<string>
+#include<vector>
+#include<unordered_map>
+#include<utility>
+#include <array>
+#include <memory>
+#include <iostream>
+#include <fstream>
+#include <mutex>
+#include<regex>
+#include <nlohmann/json.hpp>
+#include <queue>
+#include<regex>
+#include <boost/asio.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "metrics.h"
+
+using json = nlohmann::json;
+
+using namespace std;
+
+/* Bytes a spreadsheet is holding: the storage of every string and every container slot, and the
+  entries and buckets of each map. Slack a vector has reserved but not used is included */
+struct sheet_memory {
+  // Every cell with every contents it has had
+  size_t cells = 0;
+  // The contents that undo can go back to
+  size_t general_history = 0;
+  size_t selections = 0;
+  // The part of cells that is in tiles shared with forks of this spreadsheet, or the spreadsheet it was forked from
+  size_t shared_cells = 0;
+
+  size_t total() const;
+};
+
+// Bytes allocated for the characters of a string, which short strings hold inside themselves
+size_t heap_bytes(const string &);
+
+/* The cells of a spreadsheet are split into CELL_TILES tiles by the hash of their names. A tile is only allocated
+  once it holds a cell. A fork shares every tile with the spreadsheet it was forked from, and a shared tile is
+  copied by whichever of them first changes a cell in it, so forking takes the same time however many cells
+  there are, and only the tiles that are changed are ever copied */
+struct cell_tile {
+  unordered_map<string, vector<string> > cells;
+  // Bytes held by the cells, less the buckets of the map
+  size_t bytes = 0;
+};
+
+const size_t CELL_TILES = 256;
+typedef array<shared_ptr<cell_tile>, CELL_TILES> cell_tiles;
+
+class spreadsheet {
+  // The engine benchmark in bench/ times the private helpers directly
+  friend struct spreadsheet_bench;
+
+  string name;
+
+  measured_mutex cell_history_mutex{cell_history_lock_metrics};
+  cell_tiles cell_history;
+  // Bytes held by every tile of cell_history, less their buckets, which are counted when asked for
+  size_t cell_history_bytes = 0;
+
+  mutex general_history_mutex;
+  vector<pair<string, string> > general_history;
+  size_t general_history_bytes = 0;
+
+  //Map of cell name to a vector of client_name and client id pair strings
+
+  mutex selected_cells_mutex;
+  unordered_map<string, vector<pair<string, int> > > selected_cells;
+  size_t selected_cells_bytes = 0;
+  measured_mutex ss_mutex{sheet_lock_metrics};
+
+  public:
+    spreadsheet(string);
+    spreadsheet(string, bool); 
+
+    bool set_cell(const string &, const string &, int);
+    bool set_cell(const string &, const string &);
+    bool is_selected_by(const string &, int);
+    // Whether a client other than the given one has the cell selected
+    bool is_selected_by_other(const string &, int);
+    string get_cell(string);
+    bool revert_cell(const string &, string *);
+    vector<pair<string, string> > all_cells();
+    // Fills in the current contents of each named cell, under a single lock of the cell history
+    void get_cells(vector<pair<string, string> > &);
+    bool select_cell(const string &, const string &, int, const string &);
+    void deselect_cell(const string &, int);
+    unordered_map<string, vector<pair<string, int> > > all_selects();
+    pair<string, string> undo();
+    void write_to_file(string);
+    // The contents of the .sht file, for saving it some other way than write_to_file
+    void encode_file(string &);
+    void decode_file(string_view);
+    measured_mutex* spreadsheet_mutex();
+    // The full history of every cell and the undo history, for replication. Selections are not included
+    void encode_state(string &);
+    bool decode_state(string_view);
+    sheet_memory memory_usage();
+    /* Bytes that set_cell would add to the cell and undo histories for this edit, not counting a
+      vector that has to grow */
+    size_t edit_bytes(const string &, const string &);
+    /* A new spreadsheet with the given name, sharing every cell and its history with this one. The undo history
+      and selections are not copied */
+    spreadsheet *fork(string);
+
+
+  private:
+    static bool valid_cell_name(const string &);
+    bool circular_depend(const string &, const string &);
+    vector<string> find_depends(const string &);
+    static bool valid_formula(const string &, const string &);
+    vector<string> *get_history(const string &);
+    vector<string> *get_history(const string &, const string &);
+    const vector<string> *find_history(const string &);
+    cell_tile *writable_tile(const string &);
+    static vector<string> get_tokens(const string *);
+    vector<pair<string, int> > *get_selections(const string &);
+    void push_general_history(const string &, const string &);
+    static size_t fill_tiles(unordered_map<string, vector<string> > &, cell_tiles &);
+    static size_t count_general_history(const vector<pair<string, string> > &);
 };
\ No newline at end of file
@@ -1,751 +1,2902 @@
-#include <iostream>
-#include <experimental/optional>
-#include <boost/asio.hpp>
-#include <thread>
-#include <mutex>
-#include <unordered_map>
-#include <algorithm>
-#include <sstream>
-#include <nlohmann/json.hpp>
-#include <signal.h>
-#include <boost/filesystem.hpp>
-
-#include "spreadsheet.h"
-using json = nlohmann::json;
-
-using namespace std;
-
-class session;
-class error_catcher;
-
-/* The server is in charge of listening for connecting clients, connecting them and
-    managing them, and transferring data to and receiving data from the clients.
-    The server hold the spreadsheets and interacts with them using methods declared in
-    the spreadsheet.h file.
-*/
-
-/* Pool of current sessions. Accesses must be done in a thread safe manner
-   using the session_mutex (lock) */
-unordered_map<int, shared_ptr<session>> sessions;
-/* Pool of current sessions by the spreadsheet. This is useful when sending
-    messages to all users of a specific spreadsheet
-    Accesses must be done in a thread safe manner using the session_mutex (lock) */
-
-unordered_map<spreadsheet*, vector<shared_ptr<session>>> sessions_by_ss;
-/* Pool of pending sessions that are currently in the handshake process. They are moved
-    out of this pool when the handshake is complete.
-    Accesses must be done in a thread safe manner using the session_mutex (lock) */
-unordered_map<int, shared_ptr<session>> pending_sessions;
-mutex session_mutex;
-
-/* Global variable for id of the next client. Increments must be done in a thread
-    safe manner using the id_mutex */
-int curr_id = 1;
-mutex id_mutex;
-
-/* Map of the current spreadsheets. Any accesses or modifications to the spreadsheets must
-    be done in a thread safe manner using the sheets_mutex */
-unordered_map<string, spreadsheet*> sheets;
-
-string get_ss_names();
-
-/* A session represents a connection. Contains the socket, username, id, spreadsheet that
-    connection is working on, as well as the buffer for that socket */
-class session : public enable_shared_from_this<session>
-{
-    friend class client_listener;
-    friend class error_catcher;
-    boost::asio::ip::tcp::socket socket;
-    boost::asio::streambuf streambuf;
-    string username;
-    string spreadsheet_name;
-    string current_cell = " ";
-
-public:
-    int id;
-    session(boost::asio::ip::tcp::socket&& socket)
-    : socket(move(socket)), id(curr_id)
-    {
-        id_mutex.lock();
-        curr_id++;
-        id_mutex.unlock();
-    }
-
-    /* Client is in regular operation. Expected messages are editCell and selectCell
-        This will process that message and then listen for another message */
-    void start_reading()
-    {
-        boost::asio::async_read_until(socket, streambuf, '\n',
-
-        // Lambda function for printing client's message
-        [self = shared_from_this()] (boost::system::error_code error, size_t bytes_transferred)
-        {
-
-            // Remove client if error/disconnect
-            if(error) {
-                cout << "[update] Client " << self->id << " has disconnected" << endl;
-
-                json disconnect_message;
-                disconnect_message["messageType"] = "disconnected";
-                disconnect_message["user"] = to_string(self->id);
-
-                unordered_map<int, shared_ptr<session>>::iterator it;
-                session_mutex.lock();
-                sessions.erase(self->id);
-
-                sheets[self->spreadsheet_name]->deselect_cell(self->current_cell, self->id); 
-                //Find the client in sessions_by_ss and remove from vector
-                vector<shared_ptr<session>> *ss_sessions = &sessions_by_ss[sheets[self->spreadsheet_name]];
-                for(int i = 0; i < ss_sessions->size(); i++)
-                    if(ss_sessions->at(i)->id == self->id) {
-                        ss_sessions->erase(ss_sessions->begin() + i);
-                        break;
-                    }
-                //Client disconnect message to send to all other clients
-                string server_message = disconnect_message.dump() + "\n";
-                for(it = sessions.begin(); it != sessions.end(); it++) {
-                    try {
-                        boost::asio::write(it->second->socket, boost::asio::buffer(server_message, server_message.size()));
-                    }
-                    catch (boost::wrapexcept<boost::system::system_error>& ex) {
-                        cout << "[error] attempted to write to a broken pipe" << endl;
-                    }
-                    catch(...) {
-
-                    }
-                }
-                session_mutex.unlock();
-            }
-
-            //Parse message from client. Can be a editCell, selectCell, undo, or revertCell request
-            else {
-                stringstream ss;
-                ss << istream(&self->streambuf).rdbuf();
-                string temp = ss.str();
-                cout << "[update] Client " << self->id << " has sent: " << ss.str();
-
-                try {
-                    json client_message = json::parse(ss.str());
-
-                    //Was an edit cell request
-                    if(client_message["requestType"] == "editCell") {
-                        //call edit cell
-                        string cell_name = client_message["cellName"];
-                        string desired_contents = client_message["contents"];
-                        cout << "[update] Client " << self-> id << " (" << self->username << ") has requested to edit a cell. cellName: "
-                         << cell_name << " to new contents " << desired_contents << endl;
-
-                        spreadsheet *curr_sheet = sheets[self->spreadsheet_name];
-
-                        (*curr_sheet->spreadsheet_mutex()).lock();
-                        //The edit request was allowed. The client must have previously selected that same cell
-                        if(curr_sheet->set_cell(cell_name, desired_contents, self->id)) {
-                            json server_message;
-                            server_message["messageType"] = "cellUpdated";
-                            server_message["cellName"] = cell_name;
-                            server_message["contents"] = desired_contents;
-
-                            cout << "[update] Client " << self-> id << " (" << self->username << ") has edited a cell. cellName: "
-                            << cell_name << " to new contents " << desired_contents << endl;
-                            session_mutex.lock();
-                            vector<shared_ptr<session>> clients = sessions_by_ss.at(sheets[self->spreadsheet_name]);
-
-                            string message = server_message.dump() + "\n";
-                            for(int i = 0; i < clients.size(); i++) {
-                                try {
-                                    boost::asio::write(clients[i]->socket, boost::asio::buffer(message, message.size()));
-                                }
-                                catch (boost::wrapexcept<boost::system::system_error>& ex) {
-                                    cout << "[error] attempted to write to a broken pipe" << endl;
-                                }
-                                catch(...) {
-
-                                }
-                            }
-                            session_mutex.unlock();
-                        }
-                        //The edit request was not allowed for some reason
-                        else {
-                            json server_message;
-                            server_message["messageType"] = "requestError";
-                            server_message["cellName"] = cell_name;
-                            server_message["message"] = "Unable to edit cell as desired";
-                            session_mutex.lock();
-
-                            cout << "[update] Client " << self-> id << " (" << self->username << ") was unable to edit a cell. cellName: "
-                            << cell_name << " to new contents " << desired_contents << endl;
-
-                            string message = server_message.dump() + "\n";
-                            try {
-                                boost::asio::write(self->socket, boost::asio::buffer(message, message.size()));
-                            }
-                            catch (boost::wrapexcept<boost::system::system_error>& ex) {
-                                cout << "[error] attempted to write to a broken pipe" << endl;
-                            }
-                            catch(...) {
-
-                            }
-                            session_mutex.unlock();
-                        }
-                        (*curr_sheet->spreadsheet_mutex()).unlock();
-                    }
-
-                    //Was a select cell request
-                    else if(client_message["requestType"] == "selectCell") {
-                        //call select cell
-                        string cell_name = client_message["cellName"];
-                        cout << "[update] Client " << self-> id << " (" << self->username << ") has requested to select a cell. cellName: " << cell_name << endl;
-
-                        spreadsheet *curr_sheet = sheets[self->spreadsheet_name];
-
-                        (*curr_sheet->spreadsheet_mutex()).lock();
-                        //The select cell request was allowed
-                        if(curr_sheet->select_cell(cell_name, self->username, self->id, self->current_cell)) {
-                            self->current_cell = cell_name;
-                            json server_message;
-                            server_message["messageType"] = "cellSelected";
-                            server_message["cellName"] = cell_name;
-                            server_message["selector"] = self->id;
-                            server_message["selectorName"] = self->username;
-
-                            cout << "[update] Client " << self-> id << " (" << self->username << ") has selected a cell. cellName: " << cell_name << endl;
-                            session_mutex.lock();
-                            vector<shared_ptr<session>> clients = sessions_by_ss.at(sheets[self->spreadsheet_name]);
-
-                            string message = server_message.dump() + "\n";
-                            for(int i = 0; i < clients.size(); i++) {
-                                try {
-                                    boost::asio::write(clients[i]->socket, boost::asio::buffer(message, message.size()));
-                                }
-                                catch (boost::wrapexcept<boost::system::system_error>& ex) {
-                                    cout << "[error] attempted to write to a broken pipe" << endl;
-                                }
-                                catch(...) {
-
-                                }
-                            }
-                            session_mutex.unlock();
-                        }
-                        //The select cell request was not allowed for some reason
-                        else {
-                            json server_message;
-                            server_message["messageType"] = "requestError";
-                            server_message["cellName"] = cell_name;
-                            server_message["message"] = "Unable to select cell as desired";
-                            cout << "[update] Client " << self-> id << " (" << self->username << ") was unable to select the cell. cellName: " << cell_name << endl;
-                            session_mutex.lock();
-
-                            string message = server_message.dump() + "\n";
-                            try {
-                                boost::asio::write(self->socket, boost::asio::buffer(message, message.size()));
-                            }
-                            catch (boost::wrapexcept<boost::system::system_error>& ex) {
-                                cout << "[error] attempted to write to a broken pipe" << endl;
-                            }
-                                catch(...) {
-
-                                }
-                            session_mutex.unlock();
-                        }
-                        (*curr_sheet->spreadsheet_mutex()).unlock();
-                    }
-
-                    //Was an undo request
-                    else if(client_message["requestType"] == "undo") {
-                        //call undo
-                        cout << "[update] Client " << self-> id << " (" << self->username << ") has requested to undo" << endl;
-
-                        spreadsheet *curr_sheet = sheets[self->spreadsheet_name];
-
-                        (*curr_sheet->spreadsheet_mutex()).lock();
-                        pair<string, string> new_pair = curr_sheet->undo();
-
-                        //If the undo was a valid request
-                        if(new_pair.first != "") {
-                            string cell_name = new_pair.first;
-                            string desired_contents = new_pair.second;
-                            json server_message;
-                            server_message["messageType"] = "cellUpdated";
-                            server_message["cellName"] = cell_name;
-                            server_message["contents"] = desired_contents;
-
-                            cout << "[update] Client " << self-> id << " (" << self->username << ") has performed undo. Results: cellName: "
-                            << cell_name << " to new contents " << desired_contents << endl;
-                            session_mutex.lock();
-                            vector<shared_ptr<session>> clients = sessions_by_ss.at(sheets[self->spreadsheet_name]);
-
-                            string message = server_message.dump() + "\n";
-                            for(int i = 0; i < clients.size(); i++) {
-                                try {
-                                    boost::asio::write(clients[i]->socket, boost::asio::buffer(message, message.size()));
-                                }
-                                catch (boost::wrapexcept<boost::system::system_error>& ex) {
-                                    cout << "[error] attempted to write to a broken pipe" << endl;
-                                }
-                                catch(...) {
-
-                                }
-                            }
-                            session_mutex.unlock();
-
-                        }
-
-                        //The undo request was not allowed for some reason
-                        else {
-                            json server_message;
-                            server_message["messageType"] = "requestError";
-                            server_message["cellName"] = "N/A - Undo request";
-                            server_message["message"] = "Unable to undo spreadsheet as desired";
-                            session_mutex.lock();
-
-                            cout << "[update] Client " << self-> id << " (" << self->username << ") was unable to undo" << endl;
-
-                            string message = server_message.dump() + "\n";
-                            try {
-                                boost::asio::write(self->socket, boost::asio::buffer(message, message.size()));
-                            }
-                            catch (boost::wrapexcept<boost::system::system_error>& ex) {
-                                cout << "[error] attempted to write to a broken pipe" << endl;
-                            }
-                                catch(...) {
-
-                                }
-                            session_mutex.unlock();
-                        }
-                        (*curr_sheet->spreadsheet_mutex()).unlock();
-                    }
-
-                    //Was a revert request
-                    else if(client_message["requestType"] == "revertCell") {
-                        //call revert
-                        cout << "[update] Client " << self-> id << " (" << self->username << ") has requested to revert a cell. cellName: " << client_message["cellName"] << endl;
-
-                        spreadsheet *curr_sheet = sheets[self->spreadsheet_name];
-
-                        (*curr_sheet->spreadsheet_mutex()).lock();
-
-                        string cell_name = client_message["cellName"];
-                        string new_contents;
-                        //If the revert was a valid request
-                        if(curr_sheet->revert_cell(cell_name, &new_contents)) {
-
-                            json server_message;
-                            server_message["messageType"] = "cellUpdated";
-                            server_message["cellName"] = cell_name;
-                            server_message["contents"] = new_contents;
-
-                            cout << "[update] Client " << self-> id << " (" << self->username << ") has performed revert. Results: cellName: "
-                            << cell_name << " to new contents " << new_contents << endl;
-                            session_mutex.lock();
-                            vector<shared_ptr<session>> clients = sessions_by_ss.at(sheets[self->spreadsheet_name]);
-
-                            string message = server_message.dump() + "\n";
-                            for(int i = 0; i < clients.size(); i++) {
-                                try {
-                                    boost::asio::write(clients[i]->socket, boost::asio::buffer(message, message.size()));
-                                }
-                                catch (boost::wrapexcept<boost::system::system_error>& ex) {
-                                    cout << "[error] attempted to write to a broken pipe" << endl;
-                                }
-                                catch(...) {
-
-                                }
-                            }
-                            session_mutex.unlock();
-
-                        }
-
-                        //The revert request was not allowed for some reason
-                        else {
-                            json server_message;
-                            server_message["messageType"] = "requestError";
-                            server_message["cellName"] = cell_name;
-                            server_message["message"] = "Unable to revert spreadsheet as desired";
-                            session_mutex.lock();
-
-                            cout << "[update] Client " << self-> id << " (" << self->username << ") was unable to revert a cell. cellName: "
-                            << cell_name << endl;
-
-                            string message = server_message.dump() + "\n";
-                            try {
-                                boost::asio::write(self->socket, boost::asio::buffer(message, message.size()));
-                            }
-                            catch (boost::wrapexcept<boost::system::system_error>& ex) {
-                                cout << "[error] attempted to write to a broken pipe" << endl;
-                            }
-                                catch(...) {
-
-                            }
-                            session_mutex.unlock();
-                        }
-                        (*curr_sheet->spreadsheet_mutex()).unlock();
-                    }
-
-
-                }
-                catch(json::parse_error& ex) {
-                    cout << "[error] Client has sent a bad message: " << ss.str() << endl;
-                }
-                self->start_reading();
-            }
-        });
-    }
-
-    /* Read the username from the client. This is the expected first message after recieving contact.
-        Sends the spreadsheet names with a newline character following each of them and a newline character
-        at the very end of the message. Proceed to receive their spreadsheet choice */
-    void read_username() {
-        boost::asio::async_read_until(socket, streambuf, '\n',
-
-        // Lambda function for printing client's message
-        [self = shared_from_this()] (boost::system::error_code error, size_t bytes_transferred)
-        {
-            // Remove client if error/disconnect
-            if(error) {
-                cout << "[update] Client " << self->id << " has disconnected" << endl;
-                session_mutex.lock();
-                pending_sessions.erase(self->id);
-                session_mutex.unlock();
-            }
-
-            //Read username from client and send all spreasheet names
-            else {
-                stringstream ss;
-                ss << istream(&self->streambuf).rdbuf();
-
-                //store username, removing \n or \r
-                string temp_string = ss.str();
-                regex rem_newlines("\n+|\r+");
-                self->username = regex_replace(temp_string, rem_newlines, "");
-                cout << "[handshake] username received: " << self->username << endl;
-
-                //send spreadsheets
-                string ss_names = get_ss_names();
-                try {
-                    boost::asio::write(self->socket, boost::asio::buffer(ss_names, ss_names.size()));
-                }
-                catch (boost::wrapexcept<boost::system::system_error>& ex) {
-                    cout << "[error] attempted to write to a broken pipe" << endl;
-                }
-                catch(...) {
-
-                }
-
-                // read which spreadsheet
-                self->read_spreadsheet_choice();
-            }
-        });
-    }
-
-    /* Read the spreadsheet choice from the client and send the sheet as a series of cellUpdated messages back,
-        followed by all of the currently selected cells on that spreadsheet, followed by the unique id of this client
-        followed by a newline character. When sending this spreadsheet, no other clients may have edits go through to
-        that spreadsheet */
-    void read_spreadsheet_choice() {
-        boost::asio::async_read_until(socket, streambuf, '\n',
-
-        // Lambda function for printing client's message
-        [self = shared_from_this()] (boost::system::error_code error, size_t bytes_transferred)
-        {
-            // Remove client if error/disconnect
-            if(error) {
-                cout << "[update] Client " << self->id << " has disconnected" << endl;
-                session_mutex.lock();
-                pending_sessions.erase(self->id);
-                session_mutex.unlock();
-            }
-
-            else {
-                stringstream ss;
-                ss << istream(&self->streambuf).rdbuf();
-
-                //Read spreadsheet name in. Remove any newline characters from name
-                string temp_string = ss.str();
-                regex rem_newlines("\n+|\r+");
-                self->spreadsheet_name = regex_replace(temp_string, rem_newlines, "");
-                cout << "[handshake] spreadsheet name received: " << self->spreadsheet_name << endl;
-
-                //Send spreadsheet as cellUpdated messages and currently selected cells as cellSelected messages for clients
-                //followed by newline character
-                /* Sheet already exists on server. Send cell edits to get sheet in proper state,
-                    followed by all selected cells, followed by the clients unique id */
-                if(sheets.find(self->spreadsheet_name) != sheets.end()) {
-                    sheets[self->spreadsheet_name]->spreadsheet_mutex()->lock();
-                    //Retrieve all edits that must be made to create the current spreadsheet
-                    vector<pair<string, string>> edits = sheets[self->spreadsheet_name]->all_cells();
-
-                    //Send all edits to client
-                    for(int i = 0; i < edits.size(); i++){
-                        json message;
-                        message["messageType"] = "cellUpdated";
-                        message["cellName"] = edits.at(i).first;
-                        message["contents"] = edits.at(i).second;
-
-
-                        cout << endl;
-
-
-                        try {
-                            boost::asio::write(self->socket, boost::asio::buffer(message.dump() + "\n"));
-                            cout << message << endl;
-                        }
-                        catch (boost::wrapexcept<boost::system::system_error>& ex) {
-                            cout << "[error] attempted to write to a broken pipe" << endl;
-                        }
-                        catch(...) {
-
-                        }
-
-
-                        cout << endl;
-                    }
-
-                    //Retrive all selects on current spreadsheet
-                    unordered_map<string, vector<pair<string, int> > > selects = sheets[self->spreadsheet_name]->all_selects();
-                    unordered_map<string, vector<pair<string, int> > >::iterator it;
-                    //For each cell that in the map
-                    for(it = selects.begin(); it != selects.end(); it++) {
-                        //Send all selects to client
-                        json message;
-                        message["messageType"] = "cellSelected";
-                        message["cellName"] = it->first;
-                        vector<pair<string, int> > curr_client = it->second;
-
-
-                        cout << endl;
-
-
-                        //For each client selecting that cell
-                        for(int i = 0; i < curr_client.size(); i++) {
-                            message["selector"] = to_string(curr_client.at(i).second);
-                            message["selectorName"] = curr_client.at(i).first;
-
-                            string server_message = message.dump() + "\n";
-                            try {
-                                boost::asio::write(self->socket, boost::asio::buffer(server_message, server_message.size()));
-                                cout << server_message << endl;
-                            }
-                            catch (boost::wrapexcept<boost::system::system_error>& ex) {
-                                cout << "[error] attempted to write to a broken pipe" << endl;
-                            }
-                            catch(...) {
-
-                            }
-                        }
-
-
-                        cout << endl;
-                    }
-
-                    //Send client unique id as last message
-                    string id_string = to_string(self->id) + "\n";
-                    try {
-                        boost::asio::write(self->socket, boost::asio::buffer(id_string, id_string.size()));
-                    }
-                    catch (boost::wrapexcept<boost::system::system_error>& ex) {
-                        cout << "[error] attempted to write to a broken pipe" << endl;
-                    }
-                    catch(...) {
-
-                    }
-
-
-                }
-                /* Sheet does not exist on the server. Create the new sheet and send client's unique
-                    id */
-                else {
-                    //Create new spreadsheet
-                    spreadsheet *new_sheet = new spreadsheet(self->spreadsheet_name);
-                    sheets.insert(pair<string, spreadsheet*> (self->spreadsheet_name, new_sheet));
-                    sheets[self->spreadsheet_name]->spreadsheet_mutex()->lock();
-
-                    string id_string = to_string(self->id) + "\n";
-                    try {
-                        boost::asio::write(self->socket, boost::asio::buffer(id_string, id_string.size()));
-                    }
-                    catch (boost::wrapexcept<boost::system::system_error>& ex) {
-                        cout << "[error] attempted to write to a broken pipe" << endl;
-                    }
-                    catch(...) {
-
-                    }
-                }
-
-                //Add current user to both sessions_by_ss and pool of all sessions
-                session_mutex.lock();
-                //If they are the first user on that spreasheet, must create new vector for the list
-                if(sessions_by_ss.find(sheets[self->spreadsheet_name]) == sessions_by_ss.end())
-                    sessions_by_ss.insert(pair<spreadsheet*, vector<shared_ptr<session>>>(sheets[self->spreadsheet_name], vector<shared_ptr<session>>()));
-
-                //Push user to that vector
-                sessions_by_ss.at(sheets[self->spreadsheet_name]).push_back(self);
-
-                //Remove from pending sessions and add to pool of sessions
-                shared_ptr<session> curr_session = pending_sessions.at(self->id);
-                pending_sessions.erase(self->id);
-                sessions.insert(pair<int, shared_ptr<session>> (self->id, curr_session));
-                session_mutex.unlock();
-                sheets[self->spreadsheet_name]->spreadsheet_mutex()->unlock();
-                self->start_reading();
-            }
-        });
-    }
-};
-
-/*
-* The client listener is the acceptor for new connections.
-* Clients are accepted asynchronously, their message loop is begun,
-* the client is added to the pending_sessions structure, and the listener
-* begins listening again
-*/
-class client_listener
-{
-    boost::asio::io_context& io_context;
-    boost::asio::ip::tcp::acceptor acceptor;
-    experimental::optional<boost::asio::ip::tcp::socket> socket;
-
-public:
-    client_listener(boost::asio::io_context& io_context, uint16_t port)
-    : io_context(io_context),
-    acceptor  (io_context, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port))
-    {
-    }
-
-    void async_accept()
-    {
-        socket.emplace(io_context);
-
-        acceptor.async_accept(*socket,
-
-        // Lambda function for accepting client
-        [&] (boost::system::error_code error)
-        {
-            // New shared pointer to the same socket (instead of copying)
-            shared_ptr<session> curr_session = make_shared<session>(move(*socket));
-
-            // start client message loop
-            curr_session->read_username();
-
-            // Insert this shared pointer into sessions (add the client connection)
-            session_mutex.lock();
-            pending_sessions.insert(pair<int, shared_ptr<session>> (curr_session->id, curr_session));
-            session_mutex.unlock();
-            cout << "[update] Client has been accepted, id: " << curr_session->id << endl;
-
-            // Get ready to accept the next connection
-            async_accept();
-        });
-    }
-};
-
-/*
-* Begins the listener for new clients
-*/
-void begin_listening(int port) {
-    boost::asio::io_context io_context;
-    client_listener srv(io_context, port);
-    srv.async_accept();
-    cout << "[status] Now listening for clients" << endl;
-    io_context.run();
-}
-
-/*
-* When the server is sent a SIGINT signal (ctrl-C) from the keyboard,
-* the error is caught here. All spreadsheets are saved, the server notifies
-* all clients, and the server shuts down.
-*/
-class error_catcher {
-    public:
-    static void exit_handler(sig_atomic_t s) {
-        cout << endl << "[shutdown] server shutting down, saving current spreadsheets" << endl;
-
-        json disconnect_message;
-        disconnect_message["messageType"] = "serverError";
-        disconnect_message["message"] = "Server has been signaled to shut down. Saving spreadsheets and ending all connections.";
-
-        unordered_map<int, shared_ptr<session>>::iterator it;
-        session_mutex.lock();
-
-        string message = disconnect_message.dump() + "\n";
-        for(it = sessions.begin(); it != sessions.end(); it++) {
-            try{
-                boost::asio::write(it->second->socket, boost::asio::buffer(message, message.size()));
-            }
-            catch (boost::wrapexcept<boost::system::system_error>& ex) {
-                 cout << "[error] attempted to write to a broken pipe" << endl;
-            }
-            catch(...) {
-
-            }
-        }
-        session_mutex.unlock();
-
-        unordered_map<string, spreadsheet*>::iterator sheets_it;
-        for(sheets_it = sheets.begin(); sheets_it != sheets.end(); sheets_it++) {
-            string path = "./spreadsheets/" + sheets_it->first + ".sht";
-            cout << "[shutdown] saving file " << sheets_it->first << " to " << path << endl;
-            sheets_it->second->write_to_file(path);
-        }
-        exit(0);
-    }
-};
-
-/*
-* Read all .sht files and create spreadsheets out of them. This is called on server startup
-*/
-void read_sheets() {
-    boost::filesystem::path p("./spreadsheets/");
-    for (auto i = boost::filesystem::directory_iterator(p); i != boost::filesystem::directory_iterator(); i++)
-    {
-        if (!boost::filesystem::is_directory(i->path()))
-        {
-            try {
-                spreadsheet *new_sheet = new spreadsheet("./spreadsheets/" + i->path().filename().string(), true);
-                regex rem_period("\\..*$");
-                sheets.insert(pair<string, spreadsheet*> (regex_replace(i->path().filename().string(), rem_period, ""), new_sheet));
-                cout << "[startup] server reading file " << i->path().filename().string() << endl;
-            }
-            catch(...){
-                cout << "[error] unable to read file " << i->path().filename().string() << ", that .sht may be corrupted or saved incorrectly" << endl;
-            }
-            
-        }
-        else
-            continue;
-    }
-}
-
-int main(int argc, char** argv)
-{
-    //Signal for server exit
-    signal(SIGINT, error_catcher::exit_handler);
-
-    //Ignore broken pipes -- broken client should not break server
-    signal(SIGPIPE, SIG_IGN);
-
-    /* read spreadsheets located in ./saved_sheets/ */
-    read_sheets();
-
-    /* begin listening for clients on other thread */
-    begin_listening(1100);
-
-    //while(1);
-
-    return 0;
-}
-
-/* Helper functions */
-
-/*
-* Returns the names of all spreadsheets currently on the server, each seperated
-* by a newline character, with another newline character at the end of the string
-*/
-string get_ss_names() {
-    stringstream ss;
-    unordered_map<string, spreadsheet*>::iterator it;
-    for(it = sheets.begin(); it != sheets.end(); it++) {
-        ss << it->first << "\n";
-    }
-    ss << "\n";
-    return ss.str();
-}
+#include <iostream>
+#include <experimental/optional>
+#include <boost/asio.hpp>
+#include <thread>
+#include <mutex>
+#include <unordered_map>
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+#include <nlohmann/json.hpp>
+#include <signal.h>
+#include <list>
+#include <atomic>
+#include <chrono>
+#include <boost/filesystem.hpp>
+#include <set>
+#include <deque>
+#include <random>
+#include <climits>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <unistd.h>
+
+#include "spreadsheet.h"
+#include "request.h"
+#include "protocol.h"
+#include "logger.h"
+#include "metrics.h"
+#include "capture.h"
+#include "shard.h"
+#include "replication.h"
+#include "broadcast_log.h"
+#include "viewport.h"
+#include "disk_io.h"
+#include "rate_limit.h"
+using json = nlohmann::json;
+
+using namespace std;
+
+class session;
+class error_catcher;
+
+/* The server is in charge of listening for connecting clients, connecting them and
+    managing them, and transferring data to and receiving data from the clients.
+    The server hold the spreadsheets and interacts with them using methods declared in
+    the spreadsheet.h file.
+*/
+
+/* Pool of current sessions. Accesses must be done in a thread safe manner
+   using the session_mutex (lock). The session_mutex is only taken for rare events,
+   such as a client being accepted, finishing the handshake, or leaving, and shutdown.
+   Everything a client does while working on a spreadsheet goes through its sheet_room */
+unordered_map<int, shared_ptr<session>> sessions;
+/* Pool of pending sessions that are currently in the handshake process. They are moved
+    out of this pool when the handshake is complete.
+    Accesses must be done in a thread safe manner using the session_mutex (lock) */
+unordered_map<int, shared_ptr<session>> pending_sessions;
+measured_mutex session_mutex(session_lock_metrics);
+
+/* Global variable for id of the next client. Increments must be done in a thread
+    safe manner using the id_mutex */
+int curr_id = 1;
+mutex id_mutex;
+
+/* Map of the current spreadsheets. Any accesses or modifications to the spreadsheets must
+    be done in a thread safe manner using the sheets_mutex */
+unordered_map<string, spreadsheet*> sheets;
+
+/* Sharding state (see shard.h). shard_index is -1 in the front end and when not sharding. The front end
+    holds a channel to each shard and the process id of each shard. A shard holds the channel it receives
+    connections on in shard_channel. Session ids of each shard start at a multiple of SHARD_ID_RANGE, so
+    the logs of different processes can be told apart */
+int shard_index = -1;
+hash_ring shard_ring;
+vector<int> shard_channels;
+vector<pid_t> shard_pids;
+int shard_channel = -1;
+const int SHARD_ID_RANGE = 10000000;
+
+/* Names of the spreadsheets on all shards, kept by the front end: every spreadsheet found on startup, and
+    every spreadsheet a client has been handed off to since, which the shard has loaded or created.
+    Accesses must be done in a thread safe manner using the session_mutex */
+set<string> shard_sheet_names;
+
+bool front_end();
+bool start_shards();
+size_t replication_snapshot();
+void apply_replication(const replication_record& record);
+bool fork_sheet(int client, const string& source, const string& name);
+string get_ss_names();
+bool parse_arguments(int argc, char** argv);
+
+/* Large transfers to a single client (such as the initial state of a spreadsheet) are packed
+    into chunks of roughly BULK_CHUNK_SIZE bytes, and up to BULK_MAX_BUFFERS chunks are sent
+    with a single gathered write */
+const size_t BULK_CHUNK_SIZE = 64 * 1024;
+const size_t BULK_MAX_BUFFERS = 16;
+
+void append_bulk(vector<string>& chunks, const server_message& message, wire_protocol protocol);
+
+/* Settings that can be changed from the command line.
+    Limits on how far a client may fall behind: past a soft limit, queued cellUpdated and cellSelected
+    messages that have been superseded are dropped. Past a hard limit, the client is disconnected */
+struct server_config {
+    // Interval at which selections are sent to clients, or 0 to send each one as it happens
+    size_t selection_tick_ms = 30;
+
+    /* Interval at which observers that have caught up are woken to send what has been appended to the observer
+        log since, or 0 to wake them on every change. Each observer sends everything from a tick with one write */
+    size_t observer_tick_ms = 20;
+
+    // Number of recent changes to each spreadsheet kept for clients that reconnect, so they are sent only what they missed
+    size_t resync_tail = 4096;
+
+    // Columns and rows around a client's viewport that it is also sent changes to, so it has them as it scrolls
+    uint32_t viewport_margin = 20;
+
+    size_t soft_queue_bytes = 256 * 1024;
+    size_t soft_queue_messages = 1024;
+    size_t hard_queue_bytes = 16 * 1024 * 1024;
+    size_t hard_queue_messages = 64 * 1024;
+
+    /* Limits on the memory of each spreadsheet, in bytes, or 0 for no limit: the contents of a single cell, the cell
+        and undo histories together, and the whole spreadsheet along with the buffers of its clients. An edit that would
+        go past one of them is refused with a requestError. Reverts and undos are always allowed */
+    size_t max_contents_bytes = 0;
+    size_t max_history_bytes = 0;
+    size_t max_sheet_bytes = 0;
+
+    /* Requests a second, after a burst, that each client and each spreadsheet may be sent (see rate_limit.h), or 0
+        for no limit. A request past either limit is refused with a requestError before it touches the spreadsheet */
+    double session_rate = 0;
+    double session_burst = 20;
+    double sheet_rate = 0;
+    double sheet_burst = 200;
+
+    /* New clients are not accepted while this many are in the handshake, or while clients have this many bytes
+        waiting to be written between them, or 0 for no limit. They wait in the listen backlog until the load drops */
+    size_t max_pending_handshakes = 512;
+    size_t overload_queue_bytes = 0;
+    /* Milliseconds a client has from being accepted to choosing its spreadsheet before it is disconnected, or 0 for
+        no deadline. Without one, idle connections would hold the handshake slots above forever */
+    int handshake_timeout_ms = 10000;
+
+    // Port of the local admin endpoint, which answers every connection with the server metrics, or 0 for none
+    uint16_t admin_port = 0;
+
+    // File that every handshake line and request is captured to, for bench/replay.cpp, or empty to not capture
+    string capture_file;
+
+    // File that spans of every request are written to in Chrome trace event format, or empty to not trace
+    string trace_file;
+
+    /* How spreadsheets are read on startup and saved on shutdown: stream, read with file streams on the calling thread
+        and saved one at a time by blocking calls on the disk thread, or uring, through io_uring on the disk thread, which
+        reads and writes every spreadsheet at once */
+    bool uring_storage = false;
+
+    /* Interval at which spreadsheets changed since the last checkpoint are saved and synced by the disk thread, or 0
+        to only save on shutdown. Checkpoints use io_uring when uring_storage is set, and blocking calls otherwise */
+    size_t checkpoint_ms = 0;
+
+    // How long clients are given on shutdown to be sent what is waiting for them before the spreadsheets are saved
+    size_t shutdown_drain_ms = 2000;
+
+    // Lowest level that is logged. SIGUSR1 switches between this level and debug while running
+    log_level log_threshold = log_level::info;
+
+    /* Number of shard processes the spreadsheets are spread over, or 0 to keep every spreadsheet in this process.
+        Each shard writes its own capture and trace files, named after the configured ones with the shard index
+        appended, and answers on its own admin port, admin_port + 1 + shard index */
+    size_t shards = 0;
+
+    // Unix socket that a follower can connect to for a stream of every change to the spreadsheets, or empty for none
+    string replicate_socket;
+
+    /* Unix socket of a leader to follow, or empty to serve clients right away. A follower keeps its spreadsheets
+        in step with the leader, and starts accepting clients on the port once the leader has gone away */
+    string follow;
+};
+server_config config;
+
+/* The clients working on one spreadsheet. Each spreadsheet has its own room with its own lock, so
+    adding, removing, and sending to the clients of one spreadsheet never waits on another spreadsheet
+    or on the global session_mutex. Clients are kept by id, so joining and leaving are O(1).
+
+    Selections are not sent to clients as they happen. The room holds the latest selection of each
+    client until the next tick (config.selection_tick_ms), then sends them together. Edits are still
+    sent immediately. selection_timer is running whenever selection_tick_scheduled is set.
+
+    A client with a viewport is kept among the viewers rather than the subscribers, and is only sent the
+    cellUpdated messages inside its cover, which the viewport index finds without looking at every viewer.
+    Every other message goes to every client.
+
+    Observers are not subscribers. Everything sent to the room is appended once to the observer log of
+    each wire protocol that has observers, and each observer writes from the log at its own pace, so a
+    broadcast costs the same however many observers there are. The room only looks at its observers once
+    a log holds more than config.hard_queue_bytes, to disconnect the ones that have fallen that far behind.
+    Accesses must be done in a thread safe manner using the room_mutex */
+class sheet_room : public enable_shared_from_this<sheet_room>
+{
+    mutex room_mutex;
+    unordered_map<int, shared_ptr<session>> subscribers;
+    unordered_map<int, shared_ptr<session>> viewers;
+    viewport_index viewports;
+    // Every cell of the spreadsheet by position, built the first time a viewport moves and kept up by sequenced
+    cell_position_index cell_positions;
+    bool positions_built = false;
+    broadcast_log observer_logs[2];
+    atomic<size_t> observers[2] = {{0}, {0}};
+    // The observers of each wire protocol, by id
+    unordered_map<int, shared_ptr<session>> observer_clients[2];
+    boost::asio::steady_timer observer_timer;
+    bool observer_tick_scheduled = false;
+    // The last config.resync_tail changes, oldest first, the bytes they hold, and the sequence number of the last change
+    deque<server_message> recent_changes;
+    size_t recent_changes_bytes = 0;
+    uint64_t last_seq = 0;
+    unordered_map<int, server_message> selections;
+    // Clients in the order of their first selection during this tick. May hold clients that have left
+    vector<int> selection_order;
+    boost::asio::steady_timer selection_timer;
+    bool selection_tick_scheduled = false;
+    // Requests to the spreadsheet from every client, limited to config.sheet_rate, and how many were refused
+    token_bucket request_limit{config.sheet_rate, config.sheet_burst};
+    uint64_t throttled = 0;
+
+public:
+    spreadsheet *sheet;
+    string name;
+    request_metrics requests;
+    /* Bytes the clients of the room are holding in their buffers. Each client adds itself once it has joined and
+        keeps it up to date as its buffers change (see session::count_buffered), so reading it costs nothing */
+    atomic<size_t> client_buffers{0};
+    // Sequence number of the last change saved by a checkpoint, or 0 after a checkpoint failed so it is tried again
+    atomic<uint64_t> checkpointed_seq{0};
+    /* Changes are numbered from 1 within an epoch, which is picked at random when the room is created,
+        so a sequence number from before the server restarted is never taken for a current one */
+    uint64_t epoch;
+
+    sheet_room(spreadsheet *sheet, string name, boost::asio::ip::tcp::socket::executor_type executor)
+    : observer_timer(executor), selection_timer(executor), sheet(sheet), name(name)
+    {
+        random_device random;
+        epoch = random() % 0x7fffffff + 1;
+    }
+
+    void join(shared_ptr<session> client, const cell_rect *cover);
+    void leave(int id);
+    void set_viewport(int id, const cell_rect *cover);
+    void exposed_cells(const cell_rect& cover, const cell_rect *old_cover, vector<pair<string, string>>& cells);
+    size_t size();
+    size_t viewer_count();
+    broadcast_cursor join_observer(shared_ptr<session> client, wire_protocol protocol);
+    void leave_observer(int id, wire_protocol protocol);
+    size_t observer_count();
+    broadcast_log& observer_log(wire_protocol protocol);
+    server_message sequenced(server_message message);
+    bool changes_since(uint64_t client_epoch, uint64_t seq, vector<server_message>& changes);
+    uint64_t current_seq();
+    void broadcast(message_batch& message);
+    void queue_selection(int id, server_message message);
+    size_t buffered_bytes();
+    bool admit(uint64_t now);
+    uint64_t throttled_count();
+
+private:
+    void broadcast_locked(message_batch& message);
+    void send_to_viewers(message_batch& message);
+    void find_viewers(const string& cell_name, vector<int>& ids);
+    void flush_selections();
+    void wake_observers();
+    void drop_lagging_observers();
+};
+
+/* Room of each spreadsheet that has had clients. Rooms are created when the first client finishes
+    the handshake. Accesses must be done in a thread safe manner using the session_mutex */
+unordered_map<spreadsheet*, shared_ptr<sheet_room>> rooms;
+shared_ptr<sheet_room> room_for(const string& name, boost::asio::ip::tcp::socket::executor_type executor);
+
+/* Counts and latencies of the requests on every spreadsheet */
+request_metrics all_requests;
+
+/* Carries out file operations for the spreadsheets off the io thread (see disk_io.h), when storage is uring or
+    checkpoints are on. Checkpoints written or failed so far, how long each took from being queued to being
+    synced, and how many are still going. A checkpoint is only started once the last one is done */
+unique_ptr<disk_io> disk;
+atomic<uint64_t> checkpoints_written(0);
+atomic<uint64_t> checkpoint_failures(0);
+latency_histogram checkpoint_latency;
+atomic<size_t> checkpoints_in_flight(0);
+void checkpoint(boost::asio::steady_timer& timer);
+json metrics_snapshot();
+void capture_sheets();
+
+/* Whether the client listener has stopped accepting because the server is overloaded, and how many times it has.
+    While paused, it checks again every ADMISSION_RETRY */
+atomic<bool> admission_paused(false);
+atomic<uint64_t> admission_pauses(0);
+const chrono::milliseconds ADMISSION_RETRY(50);
+
+/* Set once the server has been signaled to shut down (see error_catcher). From then on requests are refused */
+atomic<bool> shutting_down(false);
+
+/* How long a client past the hard limit gets to receive the message telling it to resync */
+const chrono::seconds SLOW_CLIENT_CLOSE_DELAY(5);
+
+/* Totals across every session of messages waiting to be written, messages dropped because a newer
+    one superseded them, clients disconnected for falling too far behind, and how clients were synced */
+struct outbound_counters {
+    atomic<int64_t> queued_messages{0};
+    atomic<int64_t> queued_bytes{0};
+    atomic<uint64_t> coalesced{0};
+    atomic<uint64_t> slow_disconnects{0};
+    // Clients disconnected for not finishing the handshake within config.handshake_timeout_ms
+    atomic<uint64_t> handshake_timeouts{0};
+    // Handshakes that sent every cell, and reconnects that were only sent the changes they missed
+    atomic<uint64_t> full_syncs{0};
+    atomic<uint64_t> incremental_syncs{0};
+    // cellUpdated messages not sent to a client because the cell was outside its viewport
+    atomic<uint64_t> viewport_skipped{0};
+    // Requests refused for going past a rate limit
+    atomic<uint64_t> throttled{0};
+    // Transfers compressed for clients that asked for it, with their size before and after
+    atomic<uint64_t> compressed_transfers{0};
+    atomic<uint64_t> compressed_plain_bytes{0};
+    atomic<uint64_t> compressed_sent_bytes{0};
+};
+outbound_counters outbound_stats;
+
+/* Whether a cell is inside a cover, where no cover stands for the whole spreadsheet. A cell name that has
+    no position is treated as inside every cover */
+bool in_cover(const experimental::optional<cell_rect>& cover, const string& cell_name) {
+    uint32_t column, row;
+    return !cover || !cell_position(cell_name, &column, &row) || cover->contains(column, row);
+}
+
+/* A session represents a connection. Contains the socket, username, id, spreadsheet that
+    connection is working on, as well as the buffer for that socket */
+class session : public enable_shared_from_this<session>
+{
+    friend class client_listener;
+    friend class error_catcher;
+    friend class sheet_room;
+    boost::asio::ip::tcp::socket socket;
+    string read_buffer;
+    request req;
+    string username;
+    // The first line the client sent, holding the username and options
+    string username_line;
+    string spreadsheet_name;
+    string current_cell = " ";
+    wire_protocol protocol = wire_protocol::json;
+    shared_ptr<sheet_room> room;
+    // Observers write from the room's observer log at this cursor rather than from their outbox
+    bool observer = false;
+    broadcast_cursor cursor;
+    // Ticket of the callback an observer that has caught up is waiting on the log with (see broadcast_log::wait)
+    uint64_t observer_ticket = 0;
+    // Position of the cursor once its last write finished, for the room to tell how far behind the observer is
+    atomic<uint64_t> observed_position{0};
+    // The options the client gave with its username
+    handshake_options options;
+    // The viewport of the client grown by config.viewport_margin, or none when it subscribes to the whole spreadsheet
+    experimental::optional<cell_rect> cover;
+    // When the requests in the read buffer were read from the socket, for request latency
+    uint64_t received_at = 0;
+    /* The cell name and contents of the request being carried out, and the batches of its replies. They are
+        reused from one request to the next, so that they only allocate when a request is larger than any before it */
+    string cell_name;
+    string desired_contents;
+    message_batch updates;
+    message_batch errors;
+
+    /* Messages waiting to be written to this client, oldest first. One asynchronous write is in
+        progress at a time, covering the first in_flight entries. queued_bytes and queued_messages
+        only include entries that count towards the queue limits. coalescable maps the coalesce key
+        of each queued entry that could still be superseded to that entry. Accesses must be done in
+        a thread safe manner using the outbox_mutex */
+    struct outbound_entry {
+        shared_ptr<const string> data;
+        string coalesce_key;
+        bool counted;
+    };
+    mutex outbox_mutex;
+    list<outbound_entry> outbox;
+    unordered_map<string, list<outbound_entry>::iterator> coalescable;
+    size_t in_flight = 0;
+    size_t queued_bytes = 0;
+    size_t queued_messages = 0;
+    // Bytes of every entry in the outbox, whether it counts towards the queue limits or not
+    size_t outbox_bytes = 0;
+    // Whether outbox_bytes and read_capacity are counted in the client_buffers of the room
+    bool counted_in_room = false;
+    bool too_slow = false;
+    boost::asio::steady_timer close_timer;
+    // Expires config.handshake_timeout_ms after the client was accepted
+    boost::asio::steady_timer handshake_timer;
+    /* The spreadsheet choice of a client the front end is to hand off once its outbox is empty (see hand_off), and
+        whether there is one. Guarded by the outbox_mutex */
+    string hand_off_choice;
+    bool hand_off_pending = false;
+    // Capacity of the read buffer once the last read was processed, for the memory of the spreadsheet. Guarded by the outbox_mutex
+    size_t read_capacity = 0;
+    // Requests from this client, limited to config.session_rate. Only used on the thread reading from the socket
+    token_bucket request_limit{config.session_rate, config.session_burst};
+
+public:
+    int id;
+    session(boost::asio::ip::tcp::socket&& socket)
+    : socket(move(socket)), close_timer(this->socket.get_executor()), handshake_timer(this->socket.get_executor()), id(curr_id)
+    {
+        id_mutex.lock();
+        curr_id++;
+        id_mutex.unlock();
+    }
+
+    /* Client is in regular operation. Expected messages are editCell, editCells, selectCell, undo,
+        revertCell and setViewport requests, each terminated by a newline character or sent as a binary frame. A single
+        read may contain any number of complete requests followed by part of the next one. Every complete
+        request is processed, and the partial request is left in the buffer for the next read */
+    void start_reading()
+    {
+        boost::asio::async_read(socket, boost::asio::dynamic_buffer(read_buffer), boost::asio::transfer_at_least(1),
+
+        // Lambda function for processing client's messages
+        [self = shared_from_this()] (boost::system::error_code error, size_t bytes_transferred)
+        {
+
+            // Remove client if error/disconnect
+            if(error) {
+                write_log(log_level::info, log_event::client_disconnected, self->id);
+                capture(capture_event::disconnected, self->id);
+
+                session_mutex.lock();
+                sessions.erase(self->id);
+                session_mutex.unlock();
+
+                //Only the clients on the same spreadsheet are told about the disconnect
+                if(self->observer) {
+                    self->room->observer_log(self->protocol).cancel(self->observer_ticket);
+                    self->room->leave_observer(self->id, self->protocol);
+                }
+                else {
+                    sheets[self->spreadsheet_name]->deselect_cell(self->current_cell, self->id);
+                    self->room->leave(self->id);
+                    self->count_in_room(false);
+                }
+            }
+
+            //Process every complete request in the buffer
+            else {
+                //A binary client that sends a frame which cannot be read is disconnected
+                self->received_at = now_ns();
+                if(!self->process_requests()) {
+                    write_log(log_level::error, log_event::bad_frame, self->id);
+                    boost::system::error_code ignored;
+                    self->socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+                }
+                self->start_reading();
+            }
+        });
+    }
+
+    /* Carries out every complete request in the read buffer. Requests are parsed in place, and the
+        consumed requests are removed from the front of the buffer all at once. Returns false if the
+        client sent a binary frame that cannot be read */
+    bool process_requests()
+    {
+        //Observers cannot change the spreadsheet. Anything they send is dropped
+        if(observer) {
+            read_buffer.clear();
+            return true;
+        }
+
+        char *data = &read_buffer[0];
+        char *data_end = data + read_buffer.size();
+        char *pos = data;
+        bool ok = true;
+
+        if(protocol == wire_protocol::json) {
+            char *newline;
+            while((newline = (char *) memchr(pos, '\n', data_end - pos)) != nullptr) {
+                char *end = newline;
+                if(end > pos && end[-1] == '\r')
+                    end--;
+                handle_request(pos, end);
+                pos = newline + 1;
+            }
+        }
+        else {
+            char *body, *body_end;
+            frame_status status;
+            while((status = next_binary_frame(pos, data_end, &body, &body_end)) == frame_status::complete) {
+                handle_binary_request(body, body_end);
+                pos = body_end;
+            }
+            ok = status != frame_status::invalid;
+        }
+
+        read_buffer.erase(0, pos - data);
+        if(read_buffer.capacity() != read_capacity) {
+            outbox_mutex.lock();
+            count_buffered(read_buffer.capacity() - read_capacity);
+            read_capacity = read_buffer.capacity();
+            outbox_mutex.unlock();
+        }
+        return ok;
+    }
+
+    /* Parse a single JSON request from the client, in the range [begin, end) of the read buffer, and
+        carry it out */
+    void handle_request(char *begin, char *end)
+    {
+        trace_request traced(id, room->name.c_str());
+        trace_span span("request");
+        write_log(log_level::debug, log_event::request_received, id, string_view(begin, end - begin));
+        //Captured before parsing, which unescapes strings in place
+        capture(capture_event::request, id, string_view(begin, end - begin));
+
+        bool parsed;
+        {
+            trace_span parse_span("parse");
+            parsed = parse_request(begin, end, req);
+        }
+        if(!parsed) {
+            write_log(log_level::error, log_event::bad_message, id);
+            return;
+        }
+        dispatch();
+    }
+
+    /* Parse a single binary request from the client, the type and payload of a frame in the range
+        [begin, end) of the read buffer, and carry it out */
+    void handle_binary_request(char *begin, char *end)
+    {
+        trace_request traced(id, room->name.c_str());
+        trace_span span("request");
+        write_log(log_level::debug, log_event::binary_request_received, id, string_view(), string_view(), end - begin);
+        capture(capture_event::request, id, string_view(begin, end - begin));
+
+        bool parsed;
+        {
+            trace_span parse_span("parse");
+            parsed = parse_binary_request(begin, end, req);
+        }
+        if(!parsed) {
+            write_log(log_level::error, log_event::bad_message, id);
+            return;
+        }
+        dispatch();
+    }
+
+    /* Carry out the request that was just parsed into req, no matter which wire protocol it came
+        in. Can be a editCell, editCells, selectCell, undo, revertCell or setViewport request. Once the request has been
+        carried out, it is counted in the metrics of the server and of the spreadsheet */
+    void dispatch()
+    {
+        if(!admit())
+            return;
+
+        bool refused = false;
+        switch(req.type) {
+            //Was an edit cell request
+            case request_type::edit_cell: {
+                //call edit cell
+                cell_name.assign(req.cell_name);
+                desired_contents.assign(req.contents);
+                write_log(log_level::debug, log_event::edit_requested, id, cell_name, desired_contents);
+
+                spreadsheet *curr_sheet = sheets[spreadsheet_name];
+
+                (*curr_sheet->spreadsheet_mutex()).lock();
+                const char *over_limit = over_memory_limit(curr_sheet, room_buffers(), cell_name, desired_contents);
+                if(over_limit != nullptr) {
+                    errors.clear();
+                    errors.add(server_message::request_error(cell_name, over_limit));
+                    refused = true;
+                    send_message(errors);
+                }
+                //The edit request was allowed. The client must have previously selected that same cell
+                else if(curr_sheet->set_cell(cell_name, desired_contents, id)) {
+                    updates.clear();
+                    updates.add(room->sequenced(server_message::cell_updated(cell_name, desired_contents)));
+                    replicate(replication_op::set_cell, spreadsheet_name, cell_name, desired_contents);
+
+                    write_log(log_level::info, log_event::cell_edited, id, cell_name, desired_contents);
+                    room->broadcast(updates);
+                }
+                //The edit request was not allowed for some reason
+                else {
+                    errors.clear();
+                    errors.add(server_message::request_error(cell_name, "Unable to edit cell as desired"));
+
+                    refused = true;
+                    write_log(log_level::info, log_event::edit_refused, id, cell_name, desired_contents);
+                    send_message(errors);
+                }
+                (*curr_sheet->spreadsheet_mutex()).unlock();
+                break;
+            }
+
+            /* Was a batch edit request, such as a paste or fill. The client must have selected the first
+                cell of the batch, and an edit of any other cell that another client has selected is refused. All edits are applied under a single lock of the spreadsheet, the successful
+                ones are sent to every client as one write, and the refused ones are reported back to this
+                client as one write */
+            case request_type::edit_cells: {
+                vector<cell_edit>& cells = req.cells;
+                write_log(log_level::debug, log_event::edits_requested, id, string_view(), string_view(), cells.size());
+
+                spreadsheet *curr_sheet = sheets[spreadsheet_name];
+                updates.clear();
+                errors.clear();
+
+                (*curr_sheet->spreadsheet_mutex()).lock();
+                bool anchor_selected = false;
+                if(cells.size() > 0) {
+                    cell_name.assign(cells[0].cell_name);
+                    anchor_selected = curr_sheet->is_selected_by(cell_name, id);
+                }
+                size_t buffers = room_buffers();
+                for(int i = 0; i < cells.size(); i++) {
+                    cell_name.assign(cells[i].cell_name);
+                    desired_contents.assign(cells[i].contents);
+
+                    //The first cell is checked the way an editCell is, the rest must not be held by anyone else
+                    bool allowed = anchor_selected && (i == 0 || !curr_sheet->is_selected_by_other(cell_name, id));
+                    const char *over_limit = allowed ? over_memory_limit(curr_sheet, buffers, cell_name, desired_contents) : nullptr;
+                    if(over_limit != nullptr)
+                        errors.add(server_message::request_error(cell_name, over_limit));
+                    else if(allowed && curr_sheet->set_cell(cell_name, desired_contents)) {
+                        updates.add(room->sequenced(server_message::cell_updated(cell_name, desired_contents)));
+                        replicate(replication_op::set_cell, spreadsheet_name, cell_name, desired_contents);
+                    }
+                    else {
+                        errors.add(server_message::request_error(cell_name, "Unable to edit cell as desired"));
+                    }
+                }
+
+                write_log(log_level::info, log_event::cells_edited, id, string_view(), string_view(), updates.size(), cells.size());
+                refused = updates.empty();
+                if(!updates.empty())
+                    room->broadcast(updates);
+                if(!errors.empty())
+                    send_message(errors);
+                (*curr_sheet->spreadsheet_mutex()).unlock();
+                break;
+            }
+
+            //Was a select cell request
+            case request_type::select_cell: {
+                //call select cell
+                cell_name.assign(req.cell_name);
+                write_log(log_level::debug, log_event::select_requested, id, cell_name);
+
+                spreadsheet *curr_sheet = sheets[spreadsheet_name];
+
+                (*curr_sheet->spreadsheet_mutex()).lock();
+                //The select cell request was allowed
+                if(curr_sheet->select_cell(cell_name, username, id, current_cell)) {
+                    current_cell = cell_name;
+
+                    write_log(log_level::info, log_event::cell_selected, id, cell_name);
+                    if(config.selection_tick_ms == 0) {
+                        updates.clear();
+                        updates.add(server_message::cell_selected(cell_name, id, username));
+                        room->broadcast(updates);
+                    }
+                    else
+                        room->queue_selection(id, server_message::cell_selected(cell_name, id, username));
+                }
+                //The select cell request was not allowed for some reason
+                else {
+                    errors.clear();
+                    errors.add(server_message::request_error(cell_name, "Unable to select cell as desired"));
+                    refused = true;
+                    write_log(log_level::info, log_event::select_refused, id, cell_name);
+                    send_message(errors);
+                }
+                (*curr_sheet->spreadsheet_mutex()).unlock();
+                break;
+            }
+
+            //Was an undo request
+            case request_type::undo: {
+                //call undo
+                write_log(log_level::debug, log_event::undo_requested, id);
+
+                spreadsheet *curr_sheet = sheets[spreadsheet_name];
+
+                (*curr_sheet->spreadsheet_mutex()).lock();
+                pair<string, string> new_pair = curr_sheet->undo();
+
+                //If the undo was a valid request
+                if(new_pair.first != "") {
+                    updates.clear();
+                    updates.add(room->sequenced(server_message::cell_updated(new_pair.first, new_pair.second)));
+                    replicate(replication_op::undo, spreadsheet_name);
+
+                    write_log(log_level::info, log_event::undo_done, id, new_pair.first, new_pair.second);
+                    room->broadcast(updates);
+                }
+
+                //The undo request was not allowed for some reason
+                else {
+                    errors.clear();
+                    errors.add(server_message::request_error("N/A - Undo request", "Unable to undo spreadsheet as desired"));
+
+                    refused = true;
+                    write_log(log_level::info, log_event::undo_refused, id);
+                    send_message(errors);
+                }
+                (*curr_sheet->spreadsheet_mutex()).unlock();
+                break;
+            }
+
+            //Was a revert request
+            case request_type::revert_cell: {
+                //call revert
+                cell_name.assign(req.cell_name);
+                write_log(log_level::debug, log_event::revert_requested, id, cell_name);
+
+                spreadsheet *curr_sheet = sheets[spreadsheet_name];
+
+                (*curr_sheet->spreadsheet_mutex()).lock();
+
+                string new_contents;
+                //If the revert was a valid request
+                if(curr_sheet->revert_cell(cell_name, &new_contents)) {
+
+                    updates.clear();
+                    updates.add(room->sequenced(server_message::cell_updated(cell_name, new_contents)));
+                    replicate(replication_op::revert_cell, spreadsheet_name, cell_name);
+
+                    write_log(log_level::info, log_event::revert_done, id, cell_name, new_contents);
+                    room->broadcast(updates);
+                }
+
+                //The revert request was not allowed for some reason
+                else {
+                    errors.clear();
+                    errors.add(server_message::request_error(cell_name, "Unable to revert spreadsheet as desired"));
+
+                    refused = true;
+                    write_log(log_level::info, log_event::revert_refused, id, cell_name);
+                    send_message(errors);
+                }
+                (*curr_sheet->spreadsheet_mutex()).unlock();
+                break;
+            }
+
+            /* Was a setViewport request. The client is sent the current contents of every cell that has just
+                come into its cover, under the spreadsheet lock so that no edit made in between is missed */
+            case request_type::set_viewport: {
+                cell_rect viewport;
+                bool whole_sheet = req.cell_name.data() == nullptr;
+                if(!whole_sheet && !parse_cell_rect(req.cell_name, req.last_cell, viewport)) {
+                    errors.clear();
+                    errors.add(server_message::request_error(string(req.cell_name), "Unable to set viewport as desired"));
+                    refused = true;
+                    write_log(log_level::info, log_event::viewport_refused, id, req.cell_name, req.last_cell);
+                    send_message(errors);
+                    break;
+                }
+                experimental::optional<cell_rect> new_cover;
+                if(!whole_sheet)
+                    new_cover = viewport.grown(config.viewport_margin);
+
+                spreadsheet *curr_sheet = sheets[spreadsheet_name];
+
+                (*curr_sheet->spreadsheet_mutex()).lock();
+                //Moving to another rectangle only looks at the cells there. Going back to the whole spreadsheet sends everything
+                vector<pair<string, string>> cells;
+                if(new_cover)
+                    room->exposed_cells(*new_cover, cover ? &*cover : nullptr, cells);
+                else
+                    cells = curr_sheet->all_cells();
+                vector<string> chunks;
+                size_t num_sent = 0;
+                for(int i = 0; i < cells.size(); i++)
+                    if(new_cover || !in_cover(cover, cells[i].first)) {
+                        append_bulk(chunks, server_message::cell_updated(cells[i].first, cells[i].second), protocol);
+                        num_sent++;
+                    }
+                cover = new_cover;
+                room->set_viewport(id, cover ? &*cover : nullptr);
+                write_bulk(chunks);
+                (*curr_sheet->spreadsheet_mutex()).unlock();
+
+                if(whole_sheet)
+                    write_log(log_level::info, log_event::viewport_set, id, string_view(), string_view(), 0, 0, num_sent);
+                else
+                    write_log(log_level::info, log_event::viewport_set, id, string_view(), string_view(),
+                        viewport.last_column - viewport.first_column + 1, viewport.last_row - viewport.first_row + 1, num_sent);
+                break;
+            }
+
+            //Requests of unknown types are ignored
+            default:
+                break;
+        }
+
+        uint64_t latency = now_ns() - received_at;
+        all_requests.record(req.type, refused, latency);
+        room->requests.record(req.type, refused, latency);
+    }
+
+    /* Takes a token for the request that was just parsed into req from this client and from its spreadsheet.
+        A request past either rate limit, or any request once the server is shutting down, is refused without
+        locking the spreadsheet, and counted as refused */
+    bool admit()
+    {
+        uint64_t now = now_ns();
+        bool stopping = shutting_down.load();
+        if(!stopping && request_limit.take(now) && room->admit(now))
+            return true;
+
+        cell_name.assign(req.type == request_type::edit_cells && !req.cells.empty() ? req.cells[0].cell_name : req.cell_name);
+        if(cell_name.empty())
+            cell_name = "N/A";
+        //Changes made after the spreadsheets are saved would be lost, so none are taken while shutting down
+        errors.clear();
+        errors.add(server_message::request_error(cell_name,
+            stopping ? "Server is shutting down" : "Too many requests. Try again shortly"));
+        if(!stopping) {
+            outbound_stats.throttled++;
+            write_log(log_level::debug, log_event::request_throttled, id, cell_name);
+        }
+        send_message(errors);
+
+        uint64_t latency = now_ns() - received_at;
+        all_requests.record(req.type, true, latency);
+        room->requests.record(req.type, true, latency);
+        return false;
+    }
+
+    /* What the clients of this spreadsheet are holding in their buffers, along with the recent changes and observer logs
+        of its room, when config.max_sheet_bytes needs it. It does not change with an edit, so a batch looks it up once */
+    size_t room_buffers()
+    {
+        return config.max_sheet_bytes != 0 ? room->buffered_bytes() : 0;
+    }
+
+    /* Checks an edit against the memory limits of the spreadsheet. Returns the reason to refuse it with, or nullptr
+        when it is within every limit. Must be called with the spreadsheet mutex locked */
+    const char *over_memory_limit(spreadsheet *curr_sheet, size_t buffers, const string& cell_name, const string& contents)
+    {
+        const char *reason = nullptr;
+        size_t needed = 0;
+        size_t limit = 0;
+        if(config.max_contents_bytes != 0 && contents.size() > config.max_contents_bytes) {
+            reason = "Cell contents are too large";
+            needed = contents.size();
+            limit = config.max_contents_bytes;
+        }
+        else if(config.max_history_bytes != 0 || config.max_sheet_bytes != 0) {
+            sheet_memory memory = curr_sheet->memory_usage();
+            size_t added = curr_sheet->edit_bytes(cell_name, contents);
+            if(config.max_history_bytes != 0 && memory.cells + memory.general_history + added > config.max_history_bytes) {
+                reason = "Spreadsheet history is full";
+                needed = memory.cells + memory.general_history + added;
+                limit = config.max_history_bytes;
+            }
+            else if(config.max_sheet_bytes != 0 && memory.total() + buffers + added > config.max_sheet_bytes) {
+                reason = "Spreadsheet is using too much memory";
+                needed = memory.total() + buffers + added;
+                limit = config.max_sheet_bytes;
+            }
+        }
+
+        if(reason != nullptr)
+            write_log(log_level::info, log_event::edit_over_limit, id, cell_name, reason, needed, limit);
+        return reason;
+    }
+
+    /* Adds a change in the bytes this client holds in its outbox or read buffer to the running total of its room,
+        once it is counted there. A message queued for several clients is counted for each of them. Must be called
+        with the outbox_mutex locked */
+    void count_buffered(size_t change)
+    {
+        if(counted_in_room)
+            room->client_buffers += change;
+    }
+
+    /* Starts or stops counting what this client holds in its buffers in the client_buffers of its room, as it
+        joins or leaves it */
+    void count_in_room(bool counted)
+    {
+        outbox_mutex.lock();
+        if(counted != counted_in_room) {
+            size_t bytes = outbox_bytes + read_capacity;
+            if(counted)
+                room->client_buffers += bytes;
+            else
+                room->client_buffers -= bytes;
+            counted_in_room = counted;
+        }
+        outbox_mutex.unlock();
+    }
+
+    /* Whether everything waiting for this client has been written to its socket. Only called on the io thread */
+    bool drained()
+    {
+        if(observer)
+            return cursor.chunk == nullptr || cursor.position() >= room->observer_log(protocol).end();
+        outbox_mutex.lock();
+        bool empty = outbox.empty();
+        outbox_mutex.unlock();
+        return empty;
+    }
+
+    /* Removes the next newline terminated line from the buffer, without the newline or a carriage
+        return before it. Returns false, leaving the buffer untouched, if there is no complete line */
+    bool read_line(string& line)
+    {
+        size_t newline = read_buffer.find('\n');
+        if(newline == string::npos)
+            return false;
+
+        line.assign(read_buffer, 0, newline);
+        read_buffer.erase(0, newline + 1);
+        if(!line.empty() && line.back() == '\r')
+            line.pop_back();
+        return true;
+    }
+
+    /* Queues messages for this client. A large batch is compressed if the client asked for it, once however
+        many clients it is sent to */
+    void send_message(message_batch& message)
+    {
+        shared_ptr<const string> data = message.encode(protocol, options.compress);
+        if(options.compress && data->size() >= COMPRESS_MIN_BYTES)
+            count_compressed(message.encode(protocol)->size(), data->size());
+        enqueue(data, message.coalesce_key(), true);
+    }
+
+    /* Queues a bulk transfer built by append_bulk for this client, with each chunk compressed if the client
+        asked for it. The chunks do not count towards the queue limits, since their size is bounded by the size
+        of the spreadsheet. Returns the number of bytes queued */
+    size_t write_bulk(vector<string>& chunks)
+    {
+        size_t bytes_queued = 0;
+        for(int i = 0; i < chunks.size(); i++) {
+            if(options.compress && chunks[i].size() >= COMPRESS_MIN_BYTES) {
+                string compressed;
+                {
+                    trace_span span("compress");
+                    compress_messages(chunks[i], protocol, compressed);
+                }
+                count_compressed(chunks[i].size(), compressed.size());
+                chunks[i].swap(compressed);
+            }
+            bytes_queued += chunks[i].size();
+            // Writing starts once every chunk is queued, so the first write gathers as many of them as it can
+            enqueue(make_shared<const string>(move(chunks[i])), "", false, i + 1 == chunks.size());
+        }
+        return bytes_queued;
+    }
+
+    static void count_compressed(size_t plain_bytes, size_t sent_bytes)
+    {
+        outbound_stats.compressed_transfers++;
+        outbound_stats.compressed_plain_bytes += plain_bytes;
+        outbound_stats.compressed_sent_bytes += sent_bytes;
+    }
+
+    /* Adds data to the outbound queue and starts writing if no write is in progress, unless start is false
+        because more is about to be queued. Only counted
+        data is held to the queue limits. Past the soft limit, a queued message that is superseded by
+        this one (the same coalesce_key) is dropped. Past the hard limit, the client is disconnected */
+    void enqueue(shared_ptr<const string> data, const string& coalesce_key, bool counted, bool start = true)
+    {
+        outbox_mutex.lock();
+        if(too_slow) {
+            outbox_mutex.unlock();
+            return;
+        }
+
+        if(counted) {
+            if(!coalesce_key.empty() && (queued_bytes > config.soft_queue_bytes || queued_messages > config.soft_queue_messages)) {
+                unordered_map<string, list<outbound_entry>::iterator>::iterator superseded = coalescable.find(coalesce_key);
+                if(superseded != coalescable.end()) {
+                    remove_entry(superseded->second);
+                    outbound_stats.coalesced++;
+                }
+            }
+
+            if(queued_bytes + data->size() > config.hard_queue_bytes || queued_messages + 1 > config.hard_queue_messages) {
+                disconnect_slow();
+                outbox_mutex.unlock();
+                return;
+            }
+        }
+
+        outbox.push_back(outbound_entry{ data, coalesce_key, counted });
+        outbox_bytes += data->size();
+        count_buffered(data->size());
+        if(counted) {
+            queued_bytes += data->size();
+            queued_messages++;
+            outbound_stats.queued_bytes += data->size();
+            outbound_stats.queued_messages++;
+            if(!coalesce_key.empty())
+                coalescable[coalesce_key] = prev(outbox.end());
+        }
+
+        bool start_writing = start && in_flight == 0;
+        outbox_mutex.unlock();
+        if(start_writing)
+            write_outbox();
+    }
+
+    /* Removes a queued entry that is not being written. Must be called with the outbox_mutex locked */
+    void remove_entry(list<outbound_entry>::iterator entry)
+    {
+        outbox_bytes -= entry->data->size();
+        count_buffered(-entry->data->size());
+        if(entry->counted) {
+            queued_bytes -= entry->data->size();
+            queued_messages--;
+            outbound_stats.queued_bytes -= entry->data->size();
+            outbound_stats.queued_messages--;
+        }
+        if(!entry->coalesce_key.empty()) {
+            unordered_map<string, list<outbound_entry>::iterator>::iterator key = coalescable.find(entry->coalesce_key);
+            if(key != coalescable.end() && key->second == entry)
+                coalescable.erase(key);
+        }
+        outbox.erase(entry);
+    }
+
+    /* The client has fallen past the hard limit. Everything that has not started being written is dropped,
+        the client is told to reconnect to resync, and the connection is closed once that is sent (or after
+        SLOW_CLIENT_CLOSE_DELAY if the client is not reading at all). Must be called with the outbox_mutex locked */
+    void disconnect_slow()
+    {
+        write_log(log_level::error, log_event::slow_client, id, string_view(), string_view(), queued_messages, queued_bytes);
+        too_slow = true;
+        outbound_stats.slow_disconnects++;
+
+        list<outbound_entry>::iterator it = outbox.begin();
+        advance(it, in_flight);
+        while(it != outbox.end())
+            remove_entry(it++);
+
+        string resync;
+        encode_message(server_message::server_error("Client has fallen too far behind. Reconnect to resync the spreadsheet."),
+            protocol, resync);
+        outbox_bytes += resync.size();
+        count_buffered(resync.size());
+        outbox.push_back(outbound_entry{ make_shared<const string>(move(resync)), "", false });
+
+        close_timer.expires_after(SLOW_CLIENT_CLOSE_DELAY);
+        close_timer.async_wait([self = shared_from_this()] (boost::system::error_code error) {
+            if(!error) {
+                boost::system::error_code ignored;
+                self->socket.close(ignored);
+            }
+        });
+
+        if(in_flight == 0)
+            boost::asio::post(socket.get_executor(), [self = shared_from_this()] { self->write_outbox(); });
+    }
+
+    /* Writes up to BULK_MAX_BUFFERS queued entries with a single gathered write, and continues
+        with the next entries once that completes */
+    void write_outbox()
+    {
+        vector<boost::asio::const_buffer> buffers;
+
+        outbox_mutex.lock();
+        list<outbound_entry>::iterator it = outbox.begin();
+        for(; it != outbox.end() && buffers.size() < BULK_MAX_BUFFERS; it++) {
+            buffers.push_back(boost::asio::buffer(*it->data));
+
+            // An entry being written can no longer be dropped in favor of a newer one
+            if(!it->coalesce_key.empty()) {
+                unordered_map<string, list<outbound_entry>::iterator>::iterator key = coalescable.find(it->coalesce_key);
+                if(key != coalescable.end() && key->second == it)
+                    coalescable.erase(key);
+                it->coalesce_key.clear();
+            }
+        }
+        in_flight = buffers.size();
+        outbox_mutex.unlock();
+
+        if(buffers.empty())
+            return;
+
+        boost::asio::async_write(socket, buffers,
+        [self = shared_from_this()] (boost::system::error_code error, size_t bytes_transferred)
+        {
+            self->outbox_mutex.lock();
+            while(self->in_flight > 0) {
+                self->remove_entry(self->outbox.begin());
+                self->in_flight--;
+            }
+
+            // The client is gone. Drop the queue, the read side of the session cleans up the rest
+            if(error) {
+                while(!self->outbox.empty())
+                    self->remove_entry(self->outbox.begin());
+                bool hand_off = self->hand_off_pending;
+                self->outbox_mutex.unlock();
+                if(hand_off)
+                    self->hand_off(self->hand_off_choice);
+                return;
+            }
+
+            bool more = !self->outbox.empty();
+            bool close = self->too_slow && !more;
+            bool hand_off = self->hand_off_pending && !more;
+            self->outbox_mutex.unlock();
+
+            if(more)
+                self->write_outbox();
+            //The spreadsheet names have been written, so the client can go to its shard
+            else if(hand_off)
+                self->hand_off(self->hand_off_choice);
+            //An observer that has been sent the spreadsheet carries on from the observer log
+            else if(self->cursor.chunk != nullptr && !close)
+                self->write_observed();
+            // The resync message of a slow client has been sent
+            else if(close) {
+                boost::system::error_code ignored;
+                self->socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+                self->close_timer.cancel();
+            }
+        });
+    }
+
+    /* Writes everything appended to the observer log since the last write as a single write, or waits
+        for the next append when there is nothing new. An observer that falls config.hard_queue_bytes
+        behind the log is told to reconnect and disconnected, which lets the log free what it was holding */
+    void write_observed()
+    {
+        //The room has disconnected the observer (see drop_observer)
+        if(cursor.chunk == nullptr)
+            return;
+        broadcast_log& log = room->observer_log(protocol);
+        if(log.end() - cursor.position() > config.hard_queue_bytes) {
+            write_log(log_level::error, log_event::slow_client, id, string_view(), string_view(), 0, log.end() - cursor.position());
+            outbound_stats.slow_disconnects++;
+            cursor = broadcast_cursor();
+
+            shared_ptr<string> resync = make_shared<string>();
+            encode_message(server_message::server_error("Client has fallen too far behind. Reconnect to resync the spreadsheet."),
+                protocol, *resync);
+            boost::asio::async_write(socket, boost::asio::buffer(*resync),
+            [self = shared_from_this(), resync] (boost::system::error_code error, size_t bytes_transferred) {
+                boost::system::error_code ignored;
+                self->socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+            });
+            return;
+        }
+
+        string_view data = log.readable(cursor);
+        if(data.empty()) {
+            //A waiting observer that disconnects is not kept alive until the next append
+            boost::asio::any_io_executor executor = socket.get_executor();
+            weak_ptr<session> waiter = shared_from_this();
+            if(!log.wait(cursor, [waiter, executor] {
+                boost::asio::post(executor, [waiter] {
+                    shared_ptr<session> self = waiter.lock();
+                    if(self != nullptr)
+                        self->write_observed();
+                });
+            }, observer_ticket))
+                write_observed();
+            return;
+        }
+
+        // The data stays in the log for as long as the cursor holds its chunk
+        boost::asio::async_write(socket, boost::asio::buffer(data.data(), data.size()),
+        [self = shared_from_this(), written = data.size()] (boost::system::error_code error, size_t bytes_transferred)
+        {
+            if(error)
+                return;
+            self->cursor.offset += written;
+            self->observed_position = self->cursor.position();
+            self->write_observed();
+        });
+    }
+
+    /* Disconnects an observer that the room has found config.hard_queue_bytes behind its log. Its write may be
+        waiting on a client that has stopped reading, so it cannot be told to reconnect. Closing the socket cancels
+        the write, and the cursor lets go of the log. Called with the room_mutex locked */
+    void drop_observer(uint64_t behind)
+    {
+        write_log(log_level::error, log_event::slow_client, id, string_view(), string_view(), 0, behind);
+        outbound_stats.slow_disconnects++;
+        boost::asio::post(socket.get_executor(), [self = shared_from_this()] {
+            self->room->observer_log(self->protocol).cancel(self->observer_ticket);
+            self->cursor = broadcast_cursor();
+            boost::system::error_code ignored;
+            self->socket.close(ignored);
+        });
+    }
+
+    /* Disconnects the client if it is still in the handshake after config.handshake_timeout_ms. Closing the socket
+        fails the pending handshake read, which removes the client from pending_sessions */
+    void start_handshake_deadline() {
+        if(config.handshake_timeout_ms <= 0)
+            return;
+        handshake_timer.expires_after(chrono::milliseconds(config.handshake_timeout_ms));
+        handshake_timer.async_wait([waiter = weak_ptr<session>(shared_from_this())] (boost::system::error_code error) {
+            shared_ptr<session> self = waiter.lock();
+            if(error || self == nullptr)
+                return;
+            session_mutex.lock();
+            bool pending = pending_sessions.count(self->id) > 0;
+            session_mutex.unlock();
+            if(!pending)
+                return;
+
+            write_log(log_level::error, log_event::handshake_timeout, self->id, string_view(), string_view(), config.handshake_timeout_ms);
+            outbound_stats.handshake_timeouts++;
+            boost::system::error_code ignored;
+            self->socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+            self->socket.close(ignored);
+        });
+    }
+
+    /* Read the username from the client. This is the expected first message after recieving contact.
+        Sends the spreadsheet names with a newline character following each of them and a newline character
+        at the very end of the message. Proceed to receive their spreadsheet choice */
+    void read_username() {
+        boost::asio::async_read_until(socket, boost::asio::dynamic_buffer(read_buffer), '\n',
+
+        // Lambda function for printing client's message
+        [self = shared_from_this()] (boost::system::error_code error, size_t bytes_transferred)
+        {
+            // Remove client if error/disconnect
+            if(error) {
+                write_log(log_level::info, log_event::client_disconnected, self->id);
+                capture(capture_event::disconnected, self->id);
+                session_mutex.lock();
+                pending_sessions.erase(self->id);
+                session_mutex.unlock();
+            }
+
+            //Read username from client and send all spreasheet names
+            else {
+                //Anything the client sent after the username is left in the buffer for the next read
+                self->read_line(self->username_line);
+                self->accept_username();
+
+                //send spreadsheets
+                self->enqueue(make_shared<const string>(get_ss_names()), "", false);
+
+                // read which spreadsheet
+                self->read_spreadsheet_choice();
+            }
+        });
+    }
+
+    /* Stores the username, removing \n or \r, and any options such as the wire protocol that follow it */
+    void accept_username() {
+        capture(capture_event::username, id, username_line);
+        regex rem_newlines("\n+|\r+");
+
+        options = handshake_options();
+        username = parse_handshake_line(regex_replace(username_line, rem_newlines, ""), options);
+        protocol = options.protocol;
+        observer = options.observer;
+        write_log(log_level::info, log_event::username_received, id, username, string_view(),
+            protocol == wire_protocol::binary, observer);
+    }
+
+    /* The cover of the viewport the client gave with its username. A viewport that cannot be read is
+        ignored like any other unknown option, and observers always see the whole spreadsheet */
+    experimental::optional<cell_rect> viewport_cover() {
+        cell_rect viewport;
+        if(observer || options.viewport.empty() || !parse_cell_range(options.viewport, viewport))
+            return experimental::optional<cell_rect>();
+        return viewport.grown(config.viewport_margin);
+    }
+
+    /* Continues the handshake of a client that a shard has received from the front end. The front end has
+        already sent the spreadsheet names. The buffer starts with the spreadsheet choice the front end read */
+    void resume_handshake(const string& line, string&& buffered) {
+        username_line = line;
+        accept_username();
+        read_buffer = move(buffered);
+        read_spreadsheet_choice();
+    }
+
+    /* Passes the connection to the shard that owns the chosen spreadsheet, along with the username line, the
+        spreadsheet choice, and anything the client has sent after it. This only happens in the front end. The
+        spreadsheet names must have been written first, so the shard's messages follow them. While they are still
+        being written, the handoff is left for the write that empties the outbox to carry out (see write_outbox) */
+    void hand_off(const string& choice) {
+        outbox_mutex.lock();
+        if(!outbox.empty()) {
+            hand_off_choice = choice;
+            hand_off_pending = true;
+            outbox_mutex.unlock();
+            return;
+        }
+        hand_off_pending = false;
+        outbox_mutex.unlock();
+
+        int shard = shard_ring.owner(spreadsheet_name);
+        string data;
+        put_string(data, username_line);
+        data += choice;
+        data += '\n';
+        data += read_buffer;
+        bool sent = send_connection(shard_channels[shard], socket.native_handle(), data);
+        write_log(sent ? log_level::info : log_level::error, log_event::handed_off, id, string_view(), string_view(), shard, sent);
+
+        session_mutex.lock();
+        pending_sessions.erase(id);
+        if(sent)
+            shard_sheet_names.insert(spreadsheet_name);
+        session_mutex.unlock();
+
+        // The shard has its own copy of the socket, which stays open when this one is closed
+        boost::system::error_code ignored;
+        if(!sent)
+            socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+        socket.close(ignored);
+    }
+
+    /* Read the spreadsheet choice from the client and send the sheet as a series of cellUpdated messages back,
+        followed by all of the currently selected cells on that spreadsheet, followed by the unique id of this client
+        followed by a newline character. When sending this spreadsheet, no other clients may have edits go through to
+        that spreadsheet */
+    void read_spreadsheet_choice() {
+        boost::asio::async_read_until(socket, boost::asio::dynamic_buffer(read_buffer), '\n',
+
+        // Lambda function for printing client's message
+        [self = shared_from_this()] (boost::system::error_code error, size_t bytes_transferred)
+        {
+            // Remove client if error/disconnect
+            if(error) {
+                write_log(log_level::info, log_event::client_disconnected, self->id);
+                capture(capture_event::disconnected, self->id);
+                session_mutex.lock();
+                pending_sessions.erase(self->id);
+                session_mutex.unlock();
+            }
+
+            else {
+                //Read spreadsheet name in. Remove any newline characters from name
+                string temp_string;
+                self->read_line(temp_string);
+                capture(capture_event::spreadsheet, self->id, temp_string);
+                regex rem_newlines("\n+|\r+");
+                self->spreadsheet_name = regex_replace(temp_string, rem_newlines, "");
+                write_log(log_level::info, log_event::spreadsheet_received, self->id, self->spreadsheet_name);
+
+                //The front end does not hold spreadsheets, the shard that owns this one finishes the handshake
+                if(front_end()) {
+                    self->hand_off(temp_string);
+                    return;
+                }
+
+                //A spreadsheet that does not exist yet can start as a fork of another one, and is then sent like any other
+                if(!self->options.fork.empty() && sheets.find(self->spreadsheet_name) == sheets.end())
+                    fork_sheet(self->id, self->options.fork, self->spreadsheet_name);
+
+                //Send spreadsheet as cellUpdated messages and currently selected cells as cellSelected messages for clients
+                //followed by newline character
+                /* Sheet already exists on server. Send cell edits to get sheet in proper state,
+                    followed by all selected cells, followed by the clients unique id */
+                if(sheets.find(self->spreadsheet_name) != sheets.end()) {
+                    sheets[self->spreadsheet_name]->spreadsheet_mutex()->lock();
+                    self->room = room_for(self->spreadsheet_name, self->socket.get_executor());
+                    self->cover = self->viewport_cover();
+
+                    /* A client resuming from a change that is still kept is only sent the changes after it.
+                        Otherwise retrieve all edits that must be made to create the current spreadsheet */
+                    vector<server_message> missed;
+                    bool incremental = self->options.resume
+                        && self->room->changes_since(self->options.resume_epoch, self->options.resume_seq, missed);
+                    vector<pair<string, string>> edits;
+                    if(!incremental)
+                        edits = sheets[self->spreadsheet_name]->all_cells();
+
+                    /* A client with a viewport is only sent the cells in it, which lets it show the spreadsheet
+                        sooner. It is sent the rest as it moves its viewport over them */
+                    if(self->cover) {
+                        experimental::optional<cell_rect>& cover = self->cover;
+                        missed.erase(remove_if(missed.begin(), missed.end(),
+                            [&cover] (const server_message& change) { return !in_cover(cover, change.cell_name); }), missed.end());
+                        edits.erase(remove_if(edits.begin(), edits.end(),
+                            [&cover] (const pair<string, string>& cell) { return !in_cover(cover, cell.first); }), edits.end());
+                    }
+
+                    //Encode all edits into large chunks rather than writing them one at a time
+                    vector<string> chunks;
+                    for(int i = 0; i < missed.size(); i++)
+                        append_bulk(chunks, missed[i], self->protocol);
+                    for(int i = 0; i < edits.size(); i++)
+                        append_bulk(chunks, server_message::cell_updated(edits.at(i).first, edits.at(i).second), self->protocol);
+
+                    //Retrive all selects on current spreadsheet
+                    unordered_map<string, vector<pair<string, int> > > selects = sheets[self->spreadsheet_name]->all_selects();
+                    unordered_map<string, vector<pair<string, int> > >::iterator it;
+                    size_t num_selects = 0;
+                    //For each cell that in the map
+                    for(it = selects.begin(); it != selects.end(); it++) {
+                        vector<pair<string, int> > curr_client = it->second;
+
+                        //For each client selecting that cell
+                        for(int i = 0; i < curr_client.size(); i++) {
+                            append_bulk(chunks, server_message::cell_selected(it->first, curr_client.at(i).second, curr_client.at(i).first),
+                                self->protocol);
+                            num_selects++;
+                        }
+                    }
+
+                    //Client unique id is the last message, after the point to resume from next time
+                    if(self->options.resume)
+                        append_bulk(chunks, server_message::sequence(self->room->epoch, self->room->current_seq()), self->protocol);
+                    append_bulk(chunks, server_message::id(self->id), self->protocol);
+
+                    size_t num_chunks = chunks.size();
+                    size_t bytes_queued = self->write_bulk(chunks);
+                    if(incremental) {
+                        outbound_stats.incremental_syncs++;
+                        write_log(log_level::info, log_event::spreadsheet_resumed, self->id, string_view(), string_view(),
+                            missed.size(), num_selects, bytes_queued, self->options.resume_seq);
+                    }
+                    else {
+                        outbound_stats.full_syncs++;
+                        write_log(log_level::info, log_event::spreadsheet_sent, self->id, string_view(), string_view(),
+                            edits.size(), num_selects, bytes_queued, num_chunks);
+                    }
+                }
+                /* Sheet does not exist on the server. Create the new sheet and send client's unique
+                    id */
+                else {
+                    //Create new spreadsheet
+                    spreadsheet *new_sheet = new spreadsheet(self->spreadsheet_name);
+                    sheets.insert(pair<string, spreadsheet*> (self->spreadsheet_name, new_sheet));
+                    sheets[self->spreadsheet_name]->spreadsheet_mutex()->lock();
+                    replicate(replication_op::create, self->spreadsheet_name);
+                    self->room = room_for(self->spreadsheet_name, self->socket.get_executor());
+                    self->cover = self->viewport_cover();
+
+                    shared_ptr<string> id_string = make_shared<string>();
+                    if(self->options.resume)
+                        encode_message(server_message::sequence(self->room->epoch, self->room->current_seq()), self->protocol, *id_string);
+                    encode_message(server_message::id(self->id), self->protocol, *id_string);
+                    self->enqueue(id_string, "", false);
+                    outbound_stats.full_syncs++;
+                }
+
+                //Add current user to the spreadsheet's room and pool of all sessions
+                session_mutex.lock();
+                if(self->observer)
+                    self->cursor = self->room->join_observer(self, self->protocol);
+                else {
+                    self->room->join(self, self->cover ? &*self->cover : nullptr);
+                    self->count_in_room(true);
+                }
+
+                //Remove from pending sessions and add to pool of sessions
+                shared_ptr<session> curr_session = pending_sessions.at(self->id);
+                pending_sessions.erase(self->id);
+                sessions.insert(pair<int, shared_ptr<session>> (self->id, curr_session));
+                session_mutex.unlock();
+                self->handshake_timer.cancel();
+                sheets[self->spreadsheet_name]->spreadsheet_mutex()->unlock();
+
+                //Requests the client sent right behind its spreadsheet choice are already buffered
+                self->received_at = now_ns();
+                if(!self->process_requests()) {
+                    boost::system::error_code ignored;
+                    self->socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+                }
+                self->start_reading();
+            }
+        });
+    }
+};
+
+/*
+* Returns the room of a spreadsheet, creating it if this is the first client on that spreadsheet.
+* Must be called with the spreadsheet mutex locked
+*/
+shared_ptr<sheet_room> room_for(const string& name, boost::asio::ip::tcp::socket::executor_type executor) {
+    spreadsheet *curr_sheet = sheets[name];
+    session_mutex.lock();
+    if(rooms.find(curr_sheet) == rooms.end())
+        rooms.insert(pair<spreadsheet*, shared_ptr<sheet_room>>(curr_sheet, make_shared<sheet_room>(curr_sheet, name, executor)));
+    shared_ptr<sheet_room> room = rooms.at(curr_sheet);
+    session_mutex.unlock();
+    return room;
+}
+
+void sheet_room::join(shared_ptr<session> client, const cell_rect *cover) {
+    room_mutex.lock();
+    if(cover != nullptr) {
+        viewers[client->id] = client;
+        viewports.set(client->id, *cover);
+    }
+    else
+        subscribers[client->id] = client;
+    room_mutex.unlock();
+}
+
+/*
+* Removes a client from the room and tells the remaining clients that it has disconnected.
+* A selection of the client still waiting for the tick is dropped, since it would otherwise
+* arrive after the disconnect
+*/
+void sheet_room::leave(int id) {
+    message_batch disconnect_message(server_message::disconnected(id));
+
+    room_mutex.lock();
+    subscribers.erase(id);
+    viewers.erase(id);
+    viewports.remove(id);
+    selections.erase(id);
+    broadcast_locked(disconnect_message);
+    room_mutex.unlock();
+}
+
+/*
+* Gives a client a new cover, or subscribes it to the whole spreadsheet when there is none. Must be
+* called with the spreadsheet mutex locked, right after the client has been sent the cells that came
+* into its cover, so it misses no edit to them
+*/
+void sheet_room::set_viewport(int id, const cell_rect *cover) {
+    room_mutex.lock();
+    shared_ptr<session> client;
+    if(subscribers.find(id) != subscribers.end()) {
+        client = subscribers.at(id);
+        subscribers.erase(id);
+    }
+    else if(viewers.find(id) != viewers.end()) {
+        client = viewers.at(id);
+        viewers.erase(id);
+    }
+
+    if(client != nullptr && cover != nullptr) {
+        viewers[id] = client;
+        viewports.set(id, *cover);
+    }
+    else if(client != nullptr) {
+        subscribers[id] = client;
+        viewports.remove(id);
+    }
+    room_mutex.unlock();
+}
+
+/*
+* Returns the number of clients working on the spreadsheet
+*/
+size_t sheet_room::size() {
+    room_mutex.lock();
+    size_t clients = subscribers.size() + viewers.size();
+    room_mutex.unlock();
+    return clients;
+}
+
+/*
+* Returns the number of clients with a viewport
+*/
+size_t sheet_room::viewer_count() {
+    room_mutex.lock();
+    size_t clients = viewers.size();
+    room_mutex.unlock();
+    return clients;
+}
+
+/*
+* Returns the bytes that the clients working on the spreadsheet are holding in their buffers, along with the
+* recent changes kept for clients that resume and the observer logs
+*/
+size_t sheet_room::buffered_bytes() {
+    size_t bytes = client_buffers + observer_logs[0].held_bytes() + observer_logs[1].held_bytes();
+    room_mutex.lock();
+    bytes += recent_changes_bytes;
+    room_mutex.unlock();
+    return bytes;
+}
+
+/*
+* Takes a token for a request to the spreadsheet. Returns false, counting the request as throttled,
+* when the spreadsheet has had config.sheet_rate requests a second for too long
+*/
+bool sheet_room::admit(uint64_t now) {
+    if(!request_limit.limited())
+        return true;
+    room_mutex.lock();
+    bool admitted = request_limit.take(now);
+    if(!admitted)
+        throttled++;
+    room_mutex.unlock();
+    return admitted;
+}
+
+/*
+* Returns the number of requests refused for going past config.sheet_rate
+*/
+uint64_t sheet_room::throttled_count() {
+    room_mutex.lock();
+    uint64_t count = throttled;
+    room_mutex.unlock();
+    return count;
+}
+
+/*
+* Sends messages to every client working on the spreadsheet. The messages are encoded
+* once for each wire protocol in use
+*/
+void sheet_room::broadcast(message_batch& message) {
+    trace_span span("broadcast");
+    room_mutex.lock();
+    broadcast_locked(message);
+    room_mutex.unlock();
+}
+
+/*
+* Same as broadcast, but must be called with the room_mutex locked
+*/
+void sheet_room::broadcast_locked(message_batch& message) {
+    unordered_map<int, shared_ptr<session>>::iterator it;
+    for(it = subscribers.begin(); it != subscribers.end(); it++)
+        it->second->send_message(message);
+
+    if(!viewers.empty() && message.at(0).type == message_type::cell_updated)
+        send_to_viewers(message);
+    else
+        for(it = viewers.begin(); it != viewers.end(); it++)
+            it->second->send_message(message);
+
+    bool appended = false;
+    for(int i = 0; i < 2; i++)
+        if(observers[i].load() > 0) {
+            observer_logs[i].append(*message.encode((wire_protocol) i));
+            appended = true;
+        }
+
+    if(appended)
+        drop_lagging_observers();
+
+    if(appended && config.observer_tick_ms == 0)
+        wake_observers();
+    else if(appended && !observer_tick_scheduled) {
+        observer_tick_scheduled = true;
+        observer_timer.expires_after(chrono::milliseconds(config.observer_tick_ms));
+        observer_timer.async_wait([self = shared_from_this()] (boost::system::error_code error) {
+            if(error)
+                return;
+            self->room_mutex.lock();
+            self->observer_tick_scheduled = false;
+            self->room_mutex.unlock();
+            self->wake_observers();
+        });
+    }
+}
+
+/*
+* Sends the changes in a batch to the viewers whose cover holds them. A single change is sent as the
+* batch itself, encoded once however many viewers get it. A larger batch is split into a batch for each
+* viewer, of the changes in its cover. Must be called with the room_mutex locked
+*/
+void sheet_room::send_to_viewers(message_batch& message) {
+    vector<int> ids;
+    if(message.size() == 1) {
+        find_viewers(message.at(0).cell_name, ids);
+        for(int i = 0; i < ids.size(); i++)
+            viewers.at(ids[i])->send_message(message);
+        outbound_stats.viewport_skipped += viewers.size() - ids.size();
+        return;
+    }
+
+    unordered_map<int, message_batch> filtered;
+    size_t sent = 0;
+    for(int i = 0; i < message.size(); i++) {
+        ids.clear();
+        find_viewers(message.at(i).cell_name, ids);
+        for(int j = 0; j < ids.size(); j++)
+            filtered[ids[j]].add(message.at(i));
+        sent += ids.size();
+    }
+
+    unordered_map<int, message_batch>::iterator it;
+    for(it = filtered.begin(); it != filtered.end(); it++)
+        viewers.at(it->first)->send_message(it->second);
+    outbound_stats.viewport_skipped += message.size() * viewers.size() - sent;
+}
+
+/*
+* Collects the viewers whose cover holds a cell. A cell name with no position goes to every viewer.
+* Must be called with the room_mutex locked
+*/
+void sheet_room::find_viewers(const string& cell_name, vector<int>& ids) {
+    uint32_t column, row;
+    if(cell_position(cell_name, &column, &row)) {
+        viewports.find(column, row, ids);
+        return;
+    }
+    unordered_map<int, shared_ptr<session>>::iterator it;
+    for(it = viewers.begin(); it != viewers.end(); it++)
+        ids.push_back(it->first);
+}
+
+/*
+* Wakes every observer that has caught up with the observer logs
+*/
+void sheet_room::wake_observers() {
+    trace_span span("wake_observers");
+    for(int i = 0; i < 2; i++)
+        observer_logs[i].wake();
+}
+
+/*
+* Disconnects the observers that have fallen more than config.hard_queue_bytes behind their log, even while their
+* last write is still waiting on the client, so that a client that has stopped reading does not keep the log from
+* being freed. An observer that far behind keeps at least that much of the log alive, so the observers are only
+* looked at once a log holds more. Must be called with the room_mutex locked
+*/
+void sheet_room::drop_lagging_observers() {
+    for(int i = 0; i < 2; i++) {
+        if(observer_logs[i].held_bytes() <= config.hard_queue_bytes)
+            continue;
+        uint64_t end = observer_logs[i].end();
+        unordered_map<int, shared_ptr<session>>::iterator it = observer_clients[i].begin();
+        while(it != observer_clients[i].end()) {
+            uint64_t behind = end - it->second->observed_position.load();
+            if(behind > config.hard_queue_bytes) {
+                it->second->drop_observer(behind);
+                observers[i]--;
+                it = observer_clients[i].erase(it);
+            }
+            else
+                it++;
+        }
+    }
+}
+
+/*
+* Adds an observer, which reads everything sent to the room from now on from the returned cursor.
+* Called with the spreadsheet mutex locked, right after the observer has been sent the spreadsheet,
+* so the observer misses no edit and sees none twice
+*/
+broadcast_cursor sheet_room::join_observer(shared_ptr<session> client, wire_protocol protocol) {
+    room_mutex.lock();
+    observers[(int) protocol]++;
+    observer_clients[(int) protocol][client->id] = client;
+    broadcast_cursor cursor = observer_logs[(int) protocol].tail_cursor();
+    client->observed_position = cursor.position();
+    room_mutex.unlock();
+    return cursor;
+}
+
+/*
+* Removes an observer, unless the room has already disconnected it. Observers never select cells, so nobody is told
+*/
+void sheet_room::leave_observer(int id, wire_protocol protocol) {
+    room_mutex.lock();
+    if(observer_clients[(int) protocol].erase(id) > 0)
+        observers[(int) protocol]--;
+    room_mutex.unlock();
+}
+
+/*
+* Returns the number of observers of the spreadsheet
+*/
+size_t sheet_room::observer_count() {
+    return observers[0].load() + observers[1].load();
+}
+
+broadcast_log& sheet_room::observer_log(wire_protocol protocol) {
+    return observer_logs[(int) protocol];
+}
+
+/*
+* Collects the cells inside a client's new cover that were not inside its old one, along with their contents.
+* The cells are indexed by position the first time this is called. Must be called with the spreadsheet mutex
+* locked, so no edit is made in between
+*/
+void sheet_room::exposed_cells(const cell_rect& cover, const cell_rect *old_cover, vector<pair<string, string>>& cells) {
+    vector<string> names;
+    room_mutex.lock();
+    if(!positions_built) {
+        vector<pair<string, string>> all = sheet->all_cells();
+        for(int i = 0; i < all.size(); i++)
+            cell_positions.add(all[i].first);
+        positions_built = true;
+    }
+    cell_positions.find(cover, old_cover, names);
+    room_mutex.unlock();
+
+    cells.reserve(names.size());
+    for(int i = 0; i < names.size(); i++)
+        cells.push_back(make_pair(move(names[i]), string()));
+    sheet->get_cells(cells);
+}
+
+/*
+* Returns the bytes a message kept among the recent changes holds
+*/
+size_t message_bytes(const server_message& message) {
+    return sizeof(server_message) + heap_bytes(message.cell_name) + heap_bytes(message.contents) + heap_bytes(message.client_name);
+}
+
+/*
+* Gives a cellUpdated the next sequence number and keeps it among the recent changes. Must be called
+* with the spreadsheet mutex locked, so changes are numbered in the order they were made
+*/
+server_message sheet_room::sequenced(server_message message) {
+    room_mutex.lock();
+    message.seq = ++last_seq;
+    recent_changes.push_back(message);
+    recent_changes_bytes += message_bytes(message);
+    if(positions_built)
+        cell_positions.add(message.cell_name);
+    while(recent_changes.size() > config.resync_tail) {
+        recent_changes_bytes -= message_bytes(recent_changes.front());
+        recent_changes.pop_front();
+    }
+    room_mutex.unlock();
+    return message;
+}
+
+/*
+* Collects every change after the given sequence number. Returns false if the client has to be sent
+* the whole spreadsheet instead: the epoch is not the current one, or some of the changes it missed
+* are no longer kept. Must be called with the spreadsheet mutex locked
+*/
+bool sheet_room::changes_since(uint64_t client_epoch, uint64_t seq, vector<server_message>& changes) {
+    room_mutex.lock();
+    uint64_t first_kept = recent_changes.empty() ? last_seq + 1 : recent_changes.front().seq;
+    bool found = client_epoch == epoch && seq <= last_seq && seq + 1 >= first_kept;
+    if(found)
+        changes.assign(recent_changes.begin() + (seq + 1 - first_kept), recent_changes.end());
+    room_mutex.unlock();
+    return found;
+}
+
+/*
+* Returns the sequence number of the last change
+*/
+uint64_t sheet_room::current_seq() {
+    room_mutex.lock();
+    uint64_t seq = last_seq;
+    room_mutex.unlock();
+    return seq;
+}
+
+/*
+* Holds a selection until the next selection tick, replacing any selection the same client made
+* earlier in the tick. The first selection of a tick starts the timer
+*/
+void sheet_room::queue_selection(int id, server_message message) {
+    room_mutex.lock();
+    if(selections.find(id) == selections.end())
+        selection_order.push_back(id);
+    selections[id] = move(message);
+
+    bool start_timer = !selection_tick_scheduled;
+    selection_tick_scheduled = true;
+    room_mutex.unlock();
+
+    if(start_timer) {
+        selection_timer.expires_after(chrono::milliseconds(config.selection_tick_ms));
+        selection_timer.async_wait([self = shared_from_this()] (boost::system::error_code error) {
+            if(!error)
+                self->flush_selections();
+        });
+    }
+}
+
+/*
+* Sends every selection held since the last tick to the clients as a single batch
+*/
+void sheet_room::flush_selections() {
+    trace_span span("flush_selections");
+    message_batch batch;
+
+    room_mutex.lock();
+    selection_tick_scheduled = false;
+    for(int i = 0; i < selection_order.size(); i++) {
+        unordered_map<int, server_message>::iterator selection = selections.find(selection_order[i]);
+        if(selection != selections.end())
+            batch.add(move(selection->second));
+    }
+    selections.clear();
+    selection_order.clear();
+
+    if(!batch.empty())
+        broadcast_locked(batch);
+    room_mutex.unlock();
+}
+
+/*
+* The client listener is the acceptor for new connections.
+* Clients are accepted asynchronously, their message loop is begun,
+* the client is added to the pending_sessions structure, and the listener
+* begins listening again
+*/
+class client_listener
+{
+    boost::asio::io_context& io_context;
+    boost::asio::ip::tcp::acceptor acceptor;
+    experimental::optional<boost::asio::ip::tcp::socket> socket;
+    // Running while accepting is paused, to check again whether the server has room for new clients
+    boost::asio::steady_timer admission_timer;
+
+public:
+    client_listener(boost::asio::io_context& io_context, uint16_t port)
+    : io_context(io_context),
+    acceptor  (io_context, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port)),
+    admission_timer(io_context)
+    {
+    }
+
+    void async_accept()
+    {
+        //While overloaded, new clients wait in the listen backlog rather than adding to the load with a handshake
+        size_t pending, queued_bytes;
+        if(overloaded(pending, queued_bytes)) {
+            if(!admission_paused.exchange(true)) {
+                admission_pauses++;
+                write_log(log_level::info, log_event::admission_paused, 0, string_view(), string_view(), pending, queued_bytes);
+            }
+            admission_timer.expires_after(ADMISSION_RETRY);
+            admission_timer.async_wait([&] (boost::system::error_code error) {
+                if(!error)
+                    async_accept();
+            });
+            return;
+        }
+        if(admission_paused.exchange(false))
+            write_log(log_level::info, log_event::admission_resumed, 0, string_view(), string_view(), pending, queued_bytes);
+
+        socket.emplace(io_context);
+
+        acceptor.async_accept(*socket,
+
+        // Lambda function for accepting client
+        [&] (boost::system::error_code error)
+        {
+            //The acceptor was closed for shutdown
+            if(!acceptor.is_open())
+                return;
+
+            // New shared pointer to the same socket (instead of copying)
+            shared_ptr<session> curr_session = make_shared<session>(move(*socket));
+
+            // start client message loop
+            curr_session->read_username();
+            curr_session->start_handshake_deadline();
+
+            // Insert this shared pointer into sessions (add the client connection)
+            session_mutex.lock();
+            pending_sessions.insert(pair<int, shared_ptr<session>> (curr_session->id, curr_session));
+            session_mutex.unlock();
+            write_log(log_level::info, log_event::client_accepted, curr_session->id);
+            capture(capture_event::connected, curr_session->id);
+
+            // Get ready to accept the next connection
+            async_accept();
+        });
+    }
+
+    /* Stops accepting new clients, which then wait in the listen backlog until the server exits */
+    void stop()
+    {
+        boost::system::error_code ignored;
+        acceptor.close(ignored);
+        admission_timer.cancel();
+    }
+
+    /* Whether there are config.max_pending_handshakes clients in the handshake, or config.overload_queue_bytes
+        waiting to be written to clients. Sets how many there are of each */
+    static bool overloaded(size_t& pending, size_t& queued_bytes)
+    {
+        session_mutex.lock();
+        pending = pending_sessions.size();
+        session_mutex.unlock();
+        queued_bytes = max<int64_t>(outbound_stats.queued_bytes.load(), 0);
+        return (config.max_pending_handshakes != 0 && pending >= config.max_pending_handshakes)
+            || (config.overload_queue_bytes != 0 && queued_bytes >= config.overload_queue_bytes);
+    }
+};
+
+/*
+* The shard receiver takes the place of the client listener in a shard. It receives connections
+* that the front end has handed off, along with the username line and the rest of what the client
+* has sent, and continues their handshake at the spreadsheet choice
+*/
+class shard_receiver
+{
+    boost::asio::io_context& io_context;
+    boost::asio::generic::seq_packet_protocol::socket channel;
+
+public:
+    shard_receiver(boost::asio::io_context& io_context, int fd)
+    : io_context(io_context),
+    channel(io_context, boost::asio::generic::seq_packet_protocol(AF_UNIX, 0), fd)
+    {
+    }
+
+    void async_receive()
+    {
+        channel.async_wait(boost::asio::socket_base::wait_read,
+
+        // Lambda function for receiving every connection that is waiting
+        [&] (boost::system::error_code error)
+        {
+            if(error)
+                return;
+
+            int fd;
+            string data;
+            int result;
+            while((result = receive_connection(channel.native_handle(), &fd, data)) > 0)
+                adopt(fd, data);
+
+            //The front end has gone away. Clients already here keep working on their spreadsheets
+            if(result < 0)
+                return;
+            async_receive();
+        });
+    }
+
+    void adopt(int fd, const string& data)
+    {
+        const char *pos = data.data();
+        string_view line;
+        boost::system::error_code error;
+        boost::asio::ip::tcp::socket client(io_context);
+        if(get_string(pos, data.data() + data.size(), &line))
+            client.assign(boost::asio::ip::tcp::v4(), fd, error);
+        if(!client.is_open() || error) {
+            close(fd);
+            return;
+        }
+
+        shared_ptr<session> curr_session = make_shared<session>(move(client));
+        session_mutex.lock();
+        pending_sessions.insert(pair<int, shared_ptr<session>> (curr_session->id, curr_session));
+        session_mutex.unlock();
+        write_log(log_level::info, log_event::client_accepted, curr_session->id);
+        capture(capture_event::connected, curr_session->id);
+
+        curr_session->resume_handshake(string(line), string(pos, data.data() + data.size() - pos));
+        curr_session->start_handshake_deadline();
+    }
+};
+
+/*
+* The admin listener accepts local connections on config.admin_port. Each connection is sent
+* the current server metrics as a single JSON document and then closed
+*/
+class admin_listener
+{
+    boost::asio::io_context& io_context;
+    boost::asio::ip::tcp::acceptor acceptor;
+    experimental::optional<boost::asio::ip::tcp::socket> socket;
+
+public:
+    admin_listener(boost::asio::io_context& io_context, uint16_t port)
+    : io_context(io_context),
+    acceptor  (io_context, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), port))
+    {
+    }
+
+    void async_accept()
+    {
+        socket.emplace(io_context);
+
+        acceptor.async_accept(*socket,
+
+        // Lambda function for answering an admin connection
+        [&] (boost::system::error_code error)
+        {
+            if(!error) {
+                shared_ptr<boost::asio::ip::tcp::socket> admin = make_shared<boost::asio::ip::tcp::socket>(move(*socket));
+                shared_ptr<string> snapshot = make_shared<string>(metrics_snapshot().dump(2) + "\n");
+
+                boost::asio::async_write(*admin, boost::asio::buffer(*snapshot),
+                [admin, snapshot] (boost::system::error_code error, size_t bytes_transferred)
+                {
+                    boost::system::error_code ignored;
+                    admin->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+                });
+            }
+
+            // Get ready to accept the next connection
+            async_accept();
+        });
+    }
+};
+
+/*
+* When the server is sent SIGINT (ctrl-C) or SIGTERM, it shuts down from the io thread rather than from
+* the signal handler, which could interrupt a thread holding a lock that shutting down needs. New clients
+* are no longer accepted, every client is told, and clients get config.shutdown_drain_ms to be sent what
+* is waiting for them. Then every spreadsheet is saved and synced at once, and the server exits. How long
+* each phase took is reported as it ends. A second signal cuts the wait for clients short
+*/
+class error_catcher {
+    boost::asio::signal_set exit_signals;
+    boost::asio::signal_set log_signals;
+    // Checks every DRAIN_POLL whether every client has been sent what is waiting for it
+    boost::asio::steady_timer drain_timer;
+    // Closes the listeners of this process
+    function<void()> stop_accepting;
+    uint64_t started_at = 0;
+    uint64_t drain_started_at = 0;
+    uint64_t drain_deadline = 0;
+
+    const chrono::milliseconds DRAIN_POLL{10};
+
+    public:
+    error_catcher(boost::asio::io_context& io_context, function<void()> stop_accepting)
+    : exit_signals(io_context, SIGINT, SIGTERM),
+    log_signals(io_context, SIGUSR1),
+    drain_timer(io_context),
+    stop_accepting(stop_accepting)
+    {
+    }
+
+    void async_wait()
+    {
+        exit_signals.async_wait([this] (boost::system::error_code error, int signal) {
+            if(!error)
+                exit_handler(signal);
+        });
+        wait_for_log_signal();
+    }
+
+    private:
+    void exit_handler(int signal)
+    {
+        started_at = now_ns();
+        shutting_down.store(true);
+        cout << endl << "[shutdown] server shutting down, saving current spreadsheets" << endl;
+
+        stop_accepting();
+        //The front end holds no spreadsheets. Each shard shuts down alongside it, and is waited for at the end
+        for(int i = 0; i < shard_pids.size(); i++)
+            kill(shard_pids[i], signal);
+        cout << "[shutdown] stopped accepting clients in " << elapsed_ms(started_at) << " ms" << endl;
+
+        //Each room sends the message to its clients after everything already queued for them
+        message_batch disconnect_message(server_message::server_error(
+            "Server has been signaled to shut down. Saving spreadsheets and ending all connections."));
+        vector<shared_ptr<sheet_room>> all_rooms;
+        session_mutex.lock();
+        for(unordered_map<spreadsheet*, shared_ptr<sheet_room>>::iterator it = rooms.begin(); it != rooms.end(); it++)
+            all_rooms.push_back(it->second);
+        session_mutex.unlock();
+        for(int i = 0; i < all_rooms.size(); i++)
+            all_rooms[i]->broadcast(disconnect_message);
+
+        exit_signals.async_wait([this] (boost::system::error_code error, int signal) {
+            if(error)
+                return;
+            cout << "[shutdown] signaled again, no longer waiting for clients" << endl;
+            drain_deadline = 0;
+            drain_timer.cancel();
+        });
+
+        drain_started_at = now_ns();
+        drain_deadline = drain_started_at + config.shutdown_drain_ms * 1000000;
+        wait_for_drain();
+    }
+
+    void wait_for_drain()
+    {
+        size_t waiting = 0, total;
+        session_mutex.lock();
+        total = sessions.size();
+        for(unordered_map<int, shared_ptr<session>>::iterator it = sessions.begin(); it != sessions.end(); it++)
+            if(!it->second->drained())
+                waiting++;
+        session_mutex.unlock();
+
+        if(waiting > 0 && now_ns() < drain_deadline) {
+            drain_timer.expires_after(DRAIN_POLL);
+            drain_timer.async_wait([this] (boost::system::error_code error) {
+                wait_for_drain();
+            });
+            return;
+        }
+
+        if(waiting == 0)
+            cout << "[shutdown] drained " << total << " clients in " << elapsed_ms(drain_started_at) << " ms" << endl;
+        else
+            cout << "[shutdown] " << waiting << " of " << total << " clients were not drained after "
+                << elapsed_ms(drain_started_at) << " ms" << endl;
+        save_and_exit();
+    }
+
+    void save_and_exit()
+    {
+        //A checkpoint still being written must not land on top of the final save
+        if(!front_end()) {
+            uint64_t save_started_at = now_ns();
+            if(disk)
+                disk->wait();
+            size_t count = sheets.size();
+            size_t failed = save_sheets();
+            cout << "[shutdown] saved " << count - failed << " of " << count << " spreadsheets in "
+                << elapsed_ms(save_started_at) << " ms" << endl;
+        }
+
+        //The capture ends with the spreadsheets as they were saved, which a replay must end up matching
+        if(capturing.load()) {
+            capture_sheets();
+            stop_capture();
+        }
+
+        if(!shard_pids.empty()) {
+            uint64_t shards_started_at = now_ns();
+            for(int i = 0; i < shard_pids.size(); i++)
+                waitpid(shard_pids[i], nullptr, 0);
+            cout << "[shutdown] waited " << elapsed_ms(shards_started_at) << " ms for " << shard_pids.size() << " shards" << endl;
+        }
+
+        //Everything logged or traced while shutting down is written before exiting
+        stop_logger();
+        stop_tracing();
+        cout << "[shutdown] done in " << elapsed_ms(started_at) << " ms" << endl;
+        exit(0);
+    }
+
+    /* Saves every spreadsheet. The spreadsheets are encoded by a thread for each core and written by the disk thread,
+        which writes and syncs the files at once with uring storage, and one at a time with stream storage. Without
+        checkpoints there is no disk thread yet, so one is started for the save. Returns how many spreadsheets could not
+        be saved */
+    static size_t save_sheets()
+    {
+        disk_io* saver = disk.get();
+        unique_ptr<disk_io> blocking_disk;
+        if(saver == nullptr) {
+            blocking_disk.reset(new disk_io(disk_backend::blocking));
+            saver = blocking_disk.get();
+        }
+
+        vector<pair<string, spreadsheet*>> all(sheets.begin(), sheets.end());
+        for(int i = 0; i < all.size(); i++)
+            cout << "[shutdown] saving file " << all[i].first << " to ./spreadsheets/" << all[i].first << ".sht" << endl;
+
+        atomic<size_t> next(0);
+        atomic<size_t> failed(0);
+        auto encode = [&] {
+            for(size_t i = next++; i < all.size(); i = next++) {
+                shared_ptr<string> contents = make_shared<string>();
+                all[i].second->encode_file(*contents);
+                string name = all[i].first;
+                saver->write_file("./spreadsheets/" + name + ".sht", contents, true, [name, &failed] (int error) {
+                    if(error != 0) {
+                        failed++;
+                        cout << "[error] unable to save " << name << ": " << strerror(error) << endl;
+                    }
+                });
+            }
+        };
+        size_t encoders = min<size_t>(all.size(), max(1u, thread::hardware_concurrency()));
+        vector<thread> threads;
+        for(size_t i = 1; i < encoders; i++)
+            threads.emplace_back(encode);
+        encode();
+        for(int i = 0; i < threads.size(); i++)
+            threads[i].join();
+
+        saver->wait();
+        return failed.load();
+    }
+
+    /* When the server is sent SIGUSR1, logging switches between the configured level and
+        debug, which logs every request as it is received */
+    void wait_for_log_signal()
+    {
+        log_signals.async_wait([this] (boost::system::error_code error, int signal) {
+            if(error)
+                return;
+            if(current_log_level.load() == log_level::debug)
+                current_log_level.store(config.log_threshold);
+            else
+                current_log_level.store(log_level::debug);
+            wait_for_log_signal();
+        });
+    }
+
+    static string elapsed_ms(uint64_t since)
+    {
+        ostringstream out;
+        out << fixed << setprecision(1) << (now_ns() - since) / 1e6;
+        return out.str();
+    }
+};
+
+void take_over(boost::asio::io_context& io_context, experimental::optional<client_listener>& srv, int port);
+
+/*
+* Begins the listener for new clients
+*/
+void begin_listening(int port) {
+    boost::asio::io_context io_context;
+    //A shard gets its clients from the front end rather than the port
+    experimental::optional<client_listener> srv;
+    experimental::optional<shard_receiver> receiver;
+    experimental::optional<replication_follower> follower;
+    if(!config.follow.empty()) {
+        follower.emplace(io_context, config.follow, apply_replication, [&] { take_over(io_context, srv, port); });
+        follower->start();
+    }
+    else if(shard_index < 0) {
+        srv.emplace(io_context, port);
+        srv->async_accept();
+    }
+    else {
+        receiver.emplace(io_context, shard_channel);
+        receiver->async_receive();
+    }
+
+    experimental::optional<replication_leader> leader;
+    if(!config.replicate_socket.empty()) {
+        try {
+            leader.emplace(io_context, config.replicate_socket, replication_snapshot);
+        }
+        catch(...) {
+            cout << "[error] unable to listen for followers on " << config.replicate_socket << endl;
+            return;
+        }
+        leader->async_accept();
+    }
+
+    experimental::optional<admin_listener> admin;
+    if(config.admin_port != 0) {
+        admin.emplace(io_context, shard_index < 0 ? config.admin_port : config.admin_port + 1 + shard_index);
+        admin->async_accept();
+    }
+    boost::asio::steady_timer checkpoint_timer(io_context);
+    if(config.checkpoint_ms > 0 && !front_end())
+        checkpoint(checkpoint_timer);
+
+    //Followers keep being sent changes, and the admin endpoint keeps answering, until the exit
+    error_catcher catcher(io_context, [&] {
+        if(srv)
+            srv->stop();
+        checkpoint_timer.cancel();
+    });
+    catcher.async_wait();
+
+    if(!follower)
+        write_log(log_level::info, log_event::listening, 0);
+    io_context.run();
+}
+
+/*
+* A follower whose leader has gone away starts accepting clients. The leader may not have let go of
+* the port yet, so this tries again until it can listen on it
+*/
+void take_over(boost::asio::io_context& io_context, experimental::optional<client_listener>& srv, int port) {
+    if(shutting_down.load())
+        return;
+    try {
+        srv.emplace(io_context, port);
+    }
+    catch(boost::system::system_error& error) {
+        shared_ptr<boost::asio::steady_timer> retry = make_shared<boost::asio::steady_timer>(io_context, chrono::milliseconds(100));
+        retry->async_wait([&io_context, &srv, port, retry] (boost::system::error_code error) {
+            take_over(io_context, srv, port);
+        });
+        return;
+    }
+    srv->async_accept();
+    write_log(log_level::info, log_event::listening, 0);
+}
+
+/*
+* Read all .sht files and create spreadsheets out of them. This is called on server startup
+*/
+void read_sheets() {
+    //Names and file names of the spreadsheets this process holds
+    vector<pair<string, string>> files;
+    boost::filesystem::path p("./spreadsheets/");
+    for (auto i = boost::filesystem::directory_iterator(p); i != boost::filesystem::directory_iterator(); i++)
+    {
+        //Files left part way through being written (see disk_io::write_file) are skipped
+        if (!boost::filesystem::is_directory(i->path()) && i->path().extension() == ".sht")
+        {
+            regex rem_period("\\..*$");
+            string name = regex_replace(i->path().filename().string(), rem_period, "");
+
+            //When sharding, the front end only needs the names, and each shard only reads its own spreadsheets
+            if(front_end()) {
+                shard_sheet_names.insert(name);
+                continue;
+            }
+            if(shard_index >= 0 && shard_ring.owner(name) != shard_index)
+                continue;
+            files.push_back(make_pair(name, i->path().filename().string()));
+        }
+        else
+            continue;
+    }
+
+    //With io_uring every file is read at once, then each is parsed here
+    vector<string> contents(files.size());
+    vector<int> errors(files.size());
+    if(config.uring_storage) {
+        for(int i = 0; i < files.size(); i++)
+            disk->read_file("./spreadsheets/" + files[i].second, [&contents, &errors, i] (int error, string& data) {
+                errors[i] = error;
+                contents[i].swap(data);
+            });
+        disk->wait();
+    }
+
+    for(int i = 0; i < files.size(); i++) {
+        try {
+            spreadsheet *new_sheet;
+            if(config.uring_storage) {
+                if(errors[i] != 0)
+                    throw runtime_error(strerror(errors[i]));
+                new_sheet = new spreadsheet(files[i].first);
+                new_sheet->decode_file(contents[i]);
+            }
+            else
+                new_sheet = new spreadsheet("./spreadsheets/" + files[i].second, true);
+            sheets.insert(pair<string, spreadsheet*> (files[i].first, new_sheet));
+            cout << "[startup] server reading file " << files[i].second << endl;
+        }
+        catch(...){
+            cout << "[error] unable to read file " << files[i].second << ", that .sht may be corrupted or saved incorrectly" << endl;
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if(!parse_arguments(argc, argv))
+        return 1;
+
+    //Shards are started before anything else, so that no threads or files are shared with them
+    if(config.shards > 0 && !start_shards())
+        return 1;
+
+    //Requests are logged by a background thread
+    current_log_level.store(config.log_threshold);
+    start_logger();
+
+    //Requests are traced only when asked for
+    if(!config.trace_file.empty() && !start_tracing(config.trace_file)) {
+        cout << "[error] unable to open trace file " << config.trace_file << endl;
+        stop_logger();
+        return 1;
+    }
+
+    //SIGINT, SIGTERM and SIGUSR1 are handled on the io thread once listening begins (see error_catcher)
+
+    //Ignore broken pipes -- broken client should not break server
+    signal(SIGPIPE, SIG_IGN);
+
+    //Spreadsheets are read and saved by the disk thread when using io_uring or checkpoints
+    if(config.uring_storage || config.checkpoint_ms > 0) {
+        disk.reset(new disk_io(config.uring_storage ? disk_backend::uring : disk_backend::blocking));
+        if(config.uring_storage && disk->backend() != disk_backend::uring)
+            cout << "[startup] io_uring is not available, the disk thread will use blocking calls" << endl;
+    }
+
+    /* read spreadsheets located in ./saved_sheets/. A follower gets its spreadsheets from the leader instead */
+    if(config.follow.empty())
+        read_sheets();
+
+    //The capture starts with the spreadsheets as they were read, so a replay can start from the same state
+    if(!config.capture_file.empty()) {
+        if(!start_capture(config.capture_file)) {
+            cout << "[error] unable to open capture file " << config.capture_file << endl;
+            stop_logger();
+            return 1;
+        }
+        capture_sheets();
+    }
+
+    /* begin listening for clients on other thread */
+    begin_listening(1100);
+
+    //while(1);
+
+    return 0;
+}
+
+/* Helper functions */
+
+/*
+* Returns the names of all spreadsheets currently on the server, each seperated
+* by a newline character, with another newline character at the end of the string
+*/
+string get_ss_names() {
+    stringstream ss;
+    //The front end lists the spreadsheets of every shard
+    if(front_end()) {
+        session_mutex.lock();
+        for(set<string>::iterator name = shard_sheet_names.begin(); name != shard_sheet_names.end(); name++)
+            ss << *name << "\n";
+        session_mutex.unlock();
+        ss << "\n";
+        return ss.str();
+    }
+
+    unordered_map<string, spreadsheet*>::iterator it;
+    for(it = sheets.begin(); it != sheets.end(); it++) {
+        ss << it->first << "\n";
+    }
+    ss << "\n";
+    return ss.str();
+}
+
+/*
+* Appends a message, encoded in the given wire protocol, to the last chunk of a bulk transfer,
+* starting a new chunk when the last one has reached BULK_CHUNK_SIZE
+*/
+void append_bulk(vector<string>& chunks, const server_message& message, wire_protocol protocol) {
+    if(chunks.empty() || chunks.back().size() >= BULK_CHUNK_SIZE) {
+        chunks.emplace_back();
+        chunks.back().reserve(BULK_CHUNK_SIZE + BULK_CHUNK_SIZE / 4);
+    }
+    encode_message(message, protocol, chunks.back());
+}
+
+/*
+* Reads command line options of the form --name=value into config. Returns false, after printing
+* the problem, on an unknown option or a bad value
+*/
+bool parse_arguments(int argc, char** argv) {
+    for(int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        size_t equals = arg.find('=');
+        if(arg.compare(0, 2, "--") != 0 || equals == string::npos) {
+            cout << "[error] options must be of the form --name=value: " << arg << endl;
+            return false;
+        }
+        string name = arg.substr(2, equals - 2);
+        string value = arg.substr(equals + 1);
+
+        try {
+            if(name == "selection-tick-ms")
+                config.selection_tick_ms = stoul(value);
+            else if(name == "observer-tick-ms")
+                config.observer_tick_ms = stoul(value);
+            else if(name == "resync-tail")
+                config.resync_tail = stoul(value);
+            else if(name == "viewport-margin")
+                config.viewport_margin = stoul(value);
+            else if(name == "storage") {
+                if(value != "stream" && value != "uring")
+                    throw invalid_argument(value);
+                config.uring_storage = value == "uring";
+            }
+            else if(name == "checkpoint-ms")
+                config.checkpoint_ms = stoul(value);
+            else if(name == "soft-queue-bytes")
+                config.soft_queue_bytes = stoul(value);
+            else if(name == "soft-queue-messages")
+                config.soft_queue_messages = stoul(value);
+            else if(name == "hard-queue-bytes")
+                config.hard_queue_bytes = stoul(value);
+            else if(name == "hard-queue-messages")
+                config.hard_queue_messages = stoul(value);
+            else if(name == "max-contents-bytes")
+                config.max_contents_bytes = stoul(value);
+            else if(name == "max-history-bytes")
+                config.max_history_bytes = stoul(value);
+            else if(name == "max-sheet-bytes")
+                config.max_sheet_bytes = stoul(value);
+            else if(name == "session-rate")
+                config.session_rate = stod(value);
+            else if(name == "session-burst")
+                config.session_burst = stod(value);
+            else if(name == "sheet-rate")
+                config.sheet_rate = stod(value);
+            else if(name == "sheet-burst")
+                config.sheet_burst = stod(value);
+            else if(name == "max-pending-handshakes")
+                config.max_pending_handshakes = stoul(value);
+            else if(name == "overload-queue-bytes")
+                config.overload_queue_bytes = stoul(value);
+            else if(name == "handshake-timeout-ms")
+                config.handshake_timeout_ms = stoi(value);
+            else if(name == "shutdown-drain-ms")
+                config.shutdown_drain_ms = stoul(value);
+            else if(name == "capture-file")
+                config.capture_file = value;
+            else if(name == "trace-file")
+                config.trace_file = value;
+            else if(name == "admin-port")
+                config.admin_port = stoul(value);
+            else if(name == "replicate-socket")
+                config.replicate_socket = value;
+            else if(name == "follow")
+                config.follow = value;
+            else if(name == "shards") {
+                config.shards = stoul(value);
+                if(config.shards > INT_MAX / SHARD_ID_RANGE - 1)
+                    throw out_of_range(value);
+            }
+            else if(name == "log-level") {
+                if(!parse_log_level(value, config.log_threshold))
+                    throw invalid_argument(value);
+            }
+            else {
+                cout << "[error] unknown option " << name << endl;
+                return false;
+            }
+        }
+        catch(...) {
+            cout << "[error] bad value for option " << name << ": " << value << endl;
+            return false;
+        }
+    }
+    if(config.shards > 0 && (!config.replicate_socket.empty() || !config.follow.empty())) {
+        cout << "[error] replication cannot be combined with shards" << endl;
+        return false;
+    }
+    return true;
+}
+
+/*
+* Collects the server metrics: request counts and latencies for the server and for each
+* spreadsheet with clients, lock wait and hold times, and the state of the outbound queues
+*/
+json metrics_snapshot() {
+    json snapshot;
+    if(config.shards > 0)
+        snapshot["shard"] = shard_index;
+    snapshot["requests"] = all_requests.summary();
+
+    snapshot["locks"]["session_mutex"] = session_lock_metrics.summary();
+    snapshot["locks"]["ss_mutex"] = sheet_lock_metrics.summary();
+    snapshot["locks"]["cell_history_mutex"] = cell_history_lock_metrics.summary();
+
+    snapshot["outbound"]["queued_messages"] = outbound_stats.queued_messages.load();
+    snapshot["outbound"]["queued_bytes"] = outbound_stats.queued_bytes.load();
+    snapshot["outbound"]["coalesced"] = outbound_stats.coalesced.load();
+    snapshot["outbound"]["slow_disconnects"] = outbound_stats.slow_disconnects.load();
+    snapshot["outbound"]["full_syncs"] = outbound_stats.full_syncs.load();
+    snapshot["outbound"]["incremental_syncs"] = outbound_stats.incremental_syncs.load();
+    snapshot["outbound"]["viewport_skipped"] = outbound_stats.viewport_skipped.load();
+    snapshot["outbound"]["compressed_transfers"] = outbound_stats.compressed_transfers.load();
+    snapshot["outbound"]["compressed_plain_bytes"] = outbound_stats.compressed_plain_bytes.load();
+    snapshot["outbound"]["compressed_sent_bytes"] = outbound_stats.compressed_sent_bytes.load();
+    snapshot["admission"]["throttled"] = outbound_stats.throttled.load();
+    snapshot["admission"]["paused"] = admission_paused.load();
+    snapshot["admission"]["pauses"] = admission_pauses.load();
+    snapshot["admission"]["handshake_timeouts"] = outbound_stats.handshake_timeouts.load();
+    snapshot["dropped_log_records"] = dropped_log_records();
+    if(!config.replicate_socket.empty() || !config.follow.empty())
+        snapshot["replication"] = replication_summary();
+    if(disk) {
+        snapshot["storage"]["backend"] = disk->backend() == disk_backend::uring ? "uring" : "blocking";
+        snapshot["storage"]["checkpoints_written"] = checkpoints_written.load();
+        snapshot["storage"]["checkpoint_failures"] = checkpoint_failures.load();
+        snapshot["storage"]["checkpoint_latency"] = checkpoint_latency.summary();
+    }
+
+    //Copy the rooms so the session_mutex is not held while reading each room
+    vector<shared_ptr<sheet_room>> current_rooms;
+    session_mutex.lock();
+    snapshot["clients"] = sessions.size();
+    snapshot["pending_clients"] = pending_sessions.size();
+    unordered_map<spreadsheet*, shared_ptr<sheet_room>>::iterator it;
+    for(it = rooms.begin(); it != rooms.end(); it++)
+        current_rooms.push_back(it->second);
+    session_mutex.unlock();
+
+    //Every spreadsheet is listed with its memory, including those that have not had clients
+    snapshot["sheets"] = json::object();
+    unordered_map<string, spreadsheet*>::iterator sheet_it;
+    for(sheet_it = sheets.begin(); sheet_it != sheets.end(); sheet_it++) {
+        sheet_memory memory = sheet_it->second->memory_usage();
+        json& sheet = snapshot["sheets"][sheet_it->first];
+        sheet["memory"]["cells"] = memory.cells;
+        sheet["memory"]["general_history"] = memory.general_history;
+        sheet["memory"]["selections"] = memory.selections;
+        sheet["memory"]["shared_cells"] = memory.shared_cells;
+        sheet["memory"]["buffers"] = 0;
+        sheet["memory"]["total"] = memory.total();
+    }
+    for(int i = 0; i < current_rooms.size(); i++) {
+        json& sheet = snapshot["sheets"][current_rooms[i]->name];
+        sheet["clients"] = current_rooms[i]->size();
+        sheet["viewers"] = current_rooms[i]->viewer_count();
+        sheet["observers"] = current_rooms[i]->observer_count();
+        sheet["seq"] = current_rooms[i]->current_seq();
+        sheet["requests"] = current_rooms[i]->requests.summary();
+        sheet["throttled"] = current_rooms[i]->throttled_count();
+        size_t buffers = current_rooms[i]->buffered_bytes();
+        sheet["memory"]["buffers"] = buffers;
+        sheet["memory"]["total"] = sheet["memory"]["total"].get<size_t>() + buffers;
+    }
+    return snapshot;
+}
+
+/*
+* Records the current cells of every spreadsheet in the capture
+*/
+void capture_sheets() {
+    unordered_map<string, spreadsheet*>::iterator it;
+    for(it = sheets.begin(); it != sheets.end(); it++) {
+        string state;
+        encode_sheet_state(it->first, it->second->all_cells(), state);
+        capture(capture_event::sheet_state, 0, state);
+    }
+}
+
+/*
+* True in the front end of a sharded server, which hands clients off instead of holding spreadsheets
+*/
+bool front_end() {
+    return config.shards > 0 && shard_index < 0;
+}
+
+/*
+* Forks a process for each shard, connected to the front end by a Unix socket. Returns false in the
+* front end if a shard could not be started. A shard returns true with shard_index set, and carries on
+* starting up as a server of its own spreadsheets. Capture and trace files get the shard index appended
+*/
+bool start_shards() {
+    for(int i = 0; i < config.shards; i++)
+        shard_ring.add(i);
+
+    cout.flush();
+    for(int i = 0; i < config.shards; i++) {
+        int channel[2];
+        if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, channel) != 0) {
+            cout << "[error] unable to create a channel to shard " << i << endl;
+            return false;
+        }
+
+        pid_t pid = fork();
+        if(pid < 0) {
+            cout << "[error] unable to start shard " << i << endl;
+            return false;
+        }
+
+        if(pid == 0) {
+            //A shard that outlives the front end is told to save and exit
+            prctl(PR_SET_PDEATHSIG, SIGINT);
+            for(int j = 0; j < shard_channels.size(); j++)
+                close(shard_channels[j]);
+            shard_channels.clear();
+            shard_pids.clear();
+            close(channel[0]);
+
+            shard_index = i;
+            shard_channel = channel[1];
+            curr_id = (i + 1) * SHARD_ID_RANGE + 1;
+            if(!config.capture_file.empty())
+                config.capture_file += "." + to_string(i);
+            if(!config.trace_file.empty())
+                config.trace_file += "." + to_string(i);
+            return true;
+        }
+
+        close(channel[1]);
+        shard_channels.push_back(channel[0]);
+        shard_pids.push_back(pid);
+    }
+    return true;
+}
+
+/*
+* Sends the state of every spreadsheet to a follower that has just connected. Each spreadsheet is
+* locked while its state is taken, so no change to it is missed or sent twice. Returns the number
+* of spreadsheets sent
+*/
+size_t replication_snapshot() {
+    unordered_map<string, spreadsheet*>::iterator it;
+    for(it = sheets.begin(); it != sheets.end(); it++) {
+        it->second->spreadsheet_mutex()->lock();
+        string state;
+        it->second->encode_state(state);
+        replicate(replication_op::sheet_state, it->first, state);
+        it->second->spreadsheet_mutex()->unlock();
+    }
+    return sheets.size();
+}
+
+/*
+* Makes a change streamed from the leader to this server's copy of the spreadsheet, and passes it
+* on to this server's own follower, if it has one
+*/
+void apply_replication(const replication_record& record) {
+    spreadsheet *sheet;
+    unordered_map<string, spreadsheet*>::iterator it = sheets.find(record.sheet);
+    if(it == sheets.end()) {
+        //A fork shares the cells of its source here too
+        unordered_map<string, spreadsheet*>::iterator source = sheets.find(record.first);
+        if(record.op == replication_op::fork && source != sheets.end())
+            sheet = source->second->fork(record.sheet);
+        else
+            sheet = new spreadsheet(record.sheet);
+        sheets.insert(pair<string, spreadsheet*> (record.sheet, sheet));
+    }
+    else
+        sheet = it->second;
+
+    sheet->spreadsheet_mutex()->lock();
+    switch(record.op) {
+        case replication_op::sheet_state:
+            if(!sheet->decode_state(record.first))
+                cout << "[error] unable to read the replicated state of spreadsheet " << record.sheet << endl;
+            break;
+        case replication_op::create:
+        case replication_op::fork:
+            break;
+        case replication_op::set_cell:
+            sheet->set_cell(record.first, record.second);
+            break;
+        case replication_op::revert_cell: {
+            string contents;
+            sheet->revert_cell(record.first, &contents);
+            break;
+        }
+        case replication_op::undo:
+            sheet->undo();
+            break;
+    }
+    replicate(record.op, record.sheet, record.first, record.second);
+    sheet->spreadsheet_mutex()->unlock();
+}
+
+/*
+* Creates a spreadsheet as a fork of another one held by this process (see spreadsheet::fork), which takes
+* the same time however many cells the other one has. Returns false, creating nothing, if there is no such
+* spreadsheet, which is the case when sharding puts the two on different shards
+*/
+bool fork_sheet(int client, const string& source, const string& name) {
+    unordered_map<string, spreadsheet*>::iterator it = sheets.find(source);
+    if(it == sheets.end()) {
+        write_log(log_level::error, log_event::spreadsheet_forked, client, name, source, 0);
+        return false;
+    }
+
+    //A batch edit to the source is either all in the fork or not in it at all, and is replicated on the same side of it
+    it->second->spreadsheet_mutex()->lock();
+    spreadsheet *copy = it->second->fork(name);
+    sheets.insert(pair<string, spreadsheet*> (name, copy));
+    replicate(replication_op::fork, name, source);
+    it->second->spreadsheet_mutex()->unlock();
+    write_log(log_level::info, log_event::spreadsheet_forked, client, name, source, 1);
+    return true;
+}
+
+/*
+* Every config.checkpoint_ms, saves the spreadsheets with clients that have changed since they were last
+* saved. Each spreadsheet is encoded here, which only holds its cell_history_mutex, and written and synced
+* by the disk thread, so a slow disk never holds up the io thread
+*/
+void checkpoint(boost::asio::steady_timer& timer) {
+    timer.expires_after(chrono::milliseconds(config.checkpoint_ms));
+    timer.async_wait([&timer] (boost::system::error_code error) {
+        if(error)
+            return;
+        if(checkpoints_in_flight.load() > 0) {
+            checkpoint(timer);
+            return;
+        }
+
+        vector<shared_ptr<sheet_room>> current_rooms;
+        session_mutex.lock();
+        unordered_map<spreadsheet*, shared_ptr<sheet_room>>::iterator it;
+        for(it = rooms.begin(); it != rooms.end(); it++)
+            current_rooms.push_back(it->second);
+        session_mutex.unlock();
+
+        for(int i = 0; i < current_rooms.size(); i++) {
+            uint64_t seq = current_rooms[i]->current_seq();
+            if(seq == current_rooms[i]->checkpointed_seq.load())
+                continue;
+            current_rooms[i]->checkpointed_seq.store(seq);
+
+            shared_ptr<sheet_room> room = current_rooms[i];
+            shared_ptr<string> contents = make_shared<string>();
+            room->sheet->encode_file(*contents);
+            string name = room->name;
+            uint64_t started = now_ns();
+            checkpoints_in_flight++;
+            disk->write_file("./spreadsheets/" + name + ".sht", contents, true, [room, name, started, contents] (int error) {
+                if(error != 0) {
+                    room->checkpointed_seq.store(0);
+                    checkpoint_failures++;
+                    write_log(log_level::error, log_event::checkpoint_failed, 0, name, string_view(), error);
+                }
+                else {
+                    uint64_t elapsed = now_ns() - started;
+                    checkpoints_written++;
+                    checkpoint_latency.record(elapsed);
+                    write_log(log_level::debug, log_event::checkpoint_written, 0, name, string_view(), contents->size(), elapsed / 1000);
+                }
+                checkpoints_in_flight--;
+            });
+        }
+        checkpoint(timer);
+    });
+}
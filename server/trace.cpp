@@ -0,0 +1,170 @@
+#include "trace.h"
+
+#include <cstdio>
+#include <vector>
+#include <mutex>
+#include <unistd.h>
+
+// Spans a thread holds before they are written to the trace file
+const size_t TRACE_BUFFER_SPANS = 1024;
+
+struct trace_event {
+  const char *name;
+  uint64_t start_ns;
+  uint64_t end_ns;
+  trace_context context;
+};
+
+/* Spans recorded by one thread. The buffer_mutex is only contended when the trace is stopped
+  while the thread is recording */
+struct trace_buffer {
+  mutex buffer_mutex;
+  vector<trace_event> events;
+  int thread_id;
+};
+
+atomic<bool> tracing(false);
+thread_local trace_context current_trace;
+thread_local trace_buffer *thread_buffer = nullptr;
+
+atomic<uint64_t> next_request(1);
+atomic<int> next_thread_id(1);
+
+/* Every buffer ever created, and the trace file. Accesses must be done in a thread safe manner
+  using the trace_mutex */
+vector<trace_buffer*> buffers;
+FILE *trace_file = nullptr;
+uint64_t trace_start_ns = 0;
+mutex trace_mutex;
+
+/**
+  * write_events
+  * Writes spans as complete ("X") events. Must be called with the trace_mutex locked
+  */
+static void write_events(const vector<trace_event>& events, int thread_id)
+{
+  if(trace_file == nullptr)
+    return;
+
+  int pid = getpid();
+  for(int i = 0; i < events.size(); i++) {
+    const trace_event& event = events[i];
+    double start = (double) (event.start_ns - trace_start_ns) / 1000.0;
+    double duration = (double) (event.end_ns - event.start_ns) / 1000.0;
+
+    fprintf(trace_file, "{\"name\":\"%s\",\"cat\":\"server\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{",
+      event.name, start, duration, pid, thread_id);
+    const char *separator = "";
+    if(event.context.request != 0) {
+      fprintf(trace_file, "\"request\":%llu", (unsigned long long) event.context.request);
+      separator = ",";
+    }
+    if(event.context.client != 0) {
+      fprintf(trace_file, "%s\"client\":%d", separator, event.context.client);
+      separator = ",";
+    }
+    // Sheet names are written as they are, other than the characters JSON does not allow in a string
+    if(event.context.sheet != nullptr) {
+      fprintf(trace_file, "%s\"sheet\":\"", separator);
+      for(const char *c = event.context.sheet; *c != '\0'; c++) {
+        if(*c == '"' || *c == '\\')
+          fprintf(trace_file, "\\%c", *c);
+        else if((unsigned char) *c < 0x20)
+          fprintf(trace_file, "\\u%04x", *c);
+        else
+          fputc(*c, trace_file);
+      }
+      fputc('"', trace_file);
+    }
+    fprintf(trace_file, "}},\n");
+  }
+}
+
+/**
+  * record_span
+  */
+void record_span(const char *name, uint64_t start_ns, uint64_t end_ns)
+{
+  if(thread_buffer == nullptr) {
+    thread_buffer = new trace_buffer();
+    thread_buffer->thread_id = next_thread_id++;
+    thread_buffer->events.reserve(TRACE_BUFFER_SPANS);
+    trace_mutex.lock();
+    buffers.push_back(thread_buffer);
+    trace_mutex.unlock();
+  }
+
+  vector<trace_event> full;
+  thread_buffer->buffer_mutex.lock();
+  thread_buffer->events.push_back(trace_event{ name, start_ns, end_ns, current_trace });
+  if(thread_buffer->events.size() >= TRACE_BUFFER_SPANS) {
+    full.swap(thread_buffer->events);
+    thread_buffer->events.reserve(TRACE_BUFFER_SPANS);
+  }
+  thread_buffer->buffer_mutex.unlock();
+
+  if(!full.empty()) {
+    trace_mutex.lock();
+    write_events(full, thread_buffer->thread_id);
+    trace_mutex.unlock();
+  }
+}
+
+/**
+  * start_tracing
+  * The trace is a JSON array of events. The closing bracket is written when tracing stops, but
+  * trace viewers also accept the file without it, so a trace cut short by a crash can still be read
+  */
+bool start_tracing(const string& path)
+{
+  trace_mutex.lock();
+  trace_file = fopen(path.c_str(), "w");
+  if(trace_file != nullptr) {
+    fprintf(trace_file, "[\n");
+    trace_start_ns = now_ns();
+    tracing.store(true);
+  }
+  trace_mutex.unlock();
+  return trace_file != nullptr;
+}
+
+/**
+  * stop_tracing
+  */
+void stop_tracing()
+{
+  if(!tracing.exchange(false))
+    return;
+
+  trace_mutex.lock();
+  for(int i = 0; i < buffers.size(); i++) {
+    vector<trace_event> events;
+    buffers[i]->buffer_mutex.lock();
+    events.swap(buffers[i]->events);
+    buffers[i]->buffer_mutex.unlock();
+    write_events(events, buffers[i]->thread_id);
+  }
+
+  // Metadata events name the process and end the array, since the last span ends with a comma
+  fprintf(trace_file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"spreadsheet server\"}}\n]\n", getpid());
+  fclose(trace_file);
+  trace_file = nullptr;
+  trace_mutex.unlock();
+}
+
+/**
+  * trace_request
+  */
+trace_request::trace_request(int client, const char *sheet)
+{
+  if(tracing.load(memory_order_relaxed))
+    current_trace = trace_context{ next_request++, client, sheet };
+}
+
+/**
+  * ~trace_request
+  */
+trace_request::~trace_request()
+{
+  current_trace = trace_context();
+}
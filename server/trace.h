@@ -0,0 +1,63 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <atomic>
+#include <cstdint>
+#include <chrono>
+
+using namespace std;
+
+/* Nanoseconds on the steady clock */
+inline uint64_t now_ns()
+{
+  return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Tracing is off unless the server is started with a trace file. While it is off, a span costs
+  one relaxed atomic load */
+extern atomic<bool> tracing;
+
+/* The request the calling thread is working on. Spans take their request id, client and sheet
+  from here, so code deep inside a request, such as the spreadsheet, does not need to be told */
+struct trace_context {
+  uint64_t request = 0;
+  int client = 0;
+  const char *sheet = nullptr;
+};
+extern thread_local trace_context current_trace;
+
+// Records a span that ran from start_ns to end_ns on the calling thread
+void record_span(const char *name, uint64_t start_ns, uint64_t end_ns);
+
+// Starts writing spans to the file at path in Chrome trace event format
+bool start_tracing(const string& path);
+
+// Writes every recorded span and closes the trace file
+void stop_tracing();
+
+/* Marks the calling thread as working on a new request until the end of the scope. sheet must
+  outlive the trace */
+class trace_request {
+  public:
+    trace_request(int client, const char *sheet);
+    ~trace_request();
+};
+
+/* Records the time from its construction to the end of the scope as a span with the given name.
+  name must be a string literal */
+class trace_span {
+  const char *name;
+  uint64_t start;
+
+  public:
+    trace_span(const char *name) : name(name), start(tracing.load(memory_order_relaxed) ? now_ns() : 0) {}
+
+    ~trace_span()
+    {
+      if(start != 0)
+        record_span(name, start, now_ns());
+    }
+};
+
+#endif
@@ -0,0 +1,236 @@
+#include "viewport.h"
+
+#include <algorithm>
+#include <cctype>
+
+// Largest column and row a cell name may have. Bigger ones are refused rather than wrapped
+const uint32_t MAX_VIEWPORT_COLUMN = 1 << 24;
+const uint32_t MAX_VIEWPORT_ROW = 1 << 30;
+
+/**
+  * contains
+  */
+bool cell_rect::contains(uint32_t column, uint32_t row) const
+{
+  return column >= first_column && column <= last_column && row >= first_row && row <= last_row;
+}
+
+/**
+  * grown
+  */
+cell_rect cell_rect::grown(uint32_t margin) const
+{
+  cell_rect rect;
+  rect.first_column = first_column > margin ? first_column - margin : 1;
+  rect.first_row = first_row > margin ? first_row - margin : 1;
+  rect.last_column = min<uint64_t>((uint64_t) last_column + margin, MAX_VIEWPORT_COLUMN);
+  rect.last_row = min<uint64_t>((uint64_t) last_row + margin, MAX_VIEWPORT_ROW);
+  return rect;
+}
+
+/**
+  * cell_position
+  */
+bool cell_position(string_view name, uint32_t *column, uint32_t *row)
+{
+  size_t pos = 0;
+  if(pos < name.size() && name[pos] == '$')
+    pos++;
+
+  uint64_t letters = 0;
+  size_t letters_start = pos;
+  while(pos < name.size() && isalpha((unsigned char) name[pos]) && letters <= MAX_VIEWPORT_COLUMN) {
+    letters = letters * 26 + (toupper((unsigned char) name[pos]) - 'A' + 1);
+    pos++;
+  }
+  if(pos == letters_start)
+    return false;
+
+  if(pos < name.size() && name[pos] == '$')
+    pos++;
+
+  uint64_t digits = 0;
+  size_t digits_start = pos;
+  while(pos < name.size() && isdigit((unsigned char) name[pos]) && digits <= MAX_VIEWPORT_ROW) {
+    digits = digits * 10 + (name[pos] - '0');
+    pos++;
+  }
+  if(pos == digits_start || pos != name.size() || letters > MAX_VIEWPORT_COLUMN || digits > MAX_VIEWPORT_ROW)
+    return false;
+
+  *column = letters;
+  *row = digits;
+  return true;
+}
+
+/**
+  * parse_cell_rect
+  */
+bool parse_cell_rect(string_view first, string_view last, cell_rect &rect)
+{
+  uint32_t first_column, first_row, last_column, last_row;
+  if(!cell_position(first, &first_column, &first_row) || !cell_position(last, &last_column, &last_row))
+    return false;
+
+  rect.first_column = min(first_column, last_column);
+  rect.last_column = max(first_column, last_column);
+  rect.first_row = min(first_row, last_row);
+  rect.last_row = max(first_row, last_row);
+  return true;
+}
+
+/**
+  * parse_cell_range
+  */
+bool parse_cell_range(string_view range, cell_rect &rect)
+{
+  size_t colon = range.find(':');
+  if(colon == string_view::npos)
+    return false;
+  return parse_cell_rect(range.substr(0, colon), range.substr(colon + 1), rect);
+}
+
+/**
+  * tile_key
+  */
+static uint64_t tile_key(uint32_t tile_column, uint32_t tile_row)
+{
+  return (uint64_t) tile_column << 32 | tile_row;
+}
+
+/**
+  * is_large
+  */
+bool viewport_index::is_large(const cell_rect &cover)
+{
+  uint64_t columns = cover.last_column / VIEWPORT_TILE_COLUMNS - cover.first_column / VIEWPORT_TILE_COLUMNS + 1;
+  uint64_t rows = cover.last_row / VIEWPORT_TILE_ROWS - cover.first_row / VIEWPORT_TILE_ROWS + 1;
+  return columns * rows > VIEWPORT_MAX_TILES;
+}
+
+/**
+  * unlink
+  * Removes the client from every tile of its cover, and frees tiles nobody is left in
+  */
+void viewport_index::unlink(int id, const cell_rect &cover)
+{
+  if(is_large(cover)) {
+    large.erase(std::find(large.begin(), large.end(), id));
+    return;
+  }
+
+  for(uint32_t x = cover.first_column / VIEWPORT_TILE_COLUMNS; x <= cover.last_column / VIEWPORT_TILE_COLUMNS; x++)
+    for(uint32_t y = cover.first_row / VIEWPORT_TILE_ROWS; y <= cover.last_row / VIEWPORT_TILE_ROWS; y++) {
+      unordered_map<uint64_t, vector<int>>::iterator tile = tiles.find(tile_key(x, y));
+      vector<int> &ids = tile->second;
+      vector<int>::iterator entry = std::find(ids.begin(), ids.end(), id);
+      *entry = ids.back();
+      ids.pop_back();
+      if(ids.empty())
+        tiles.erase(tile);
+    }
+}
+
+/**
+  * set
+  */
+void viewport_index::set(int id, const cell_rect &cover)
+{
+  unordered_map<int, cell_rect>::iterator current = covers.find(id);
+  if(current != covers.end())
+    unlink(id, current->second);
+  covers[id] = cover;
+
+  if(is_large(cover)) {
+    large.push_back(id);
+    return;
+  }
+
+  for(uint32_t x = cover.first_column / VIEWPORT_TILE_COLUMNS; x <= cover.last_column / VIEWPORT_TILE_COLUMNS; x++)
+    for(uint32_t y = cover.first_row / VIEWPORT_TILE_ROWS; y <= cover.last_row / VIEWPORT_TILE_ROWS; y++)
+      tiles[tile_key(x, y)].push_back(id);
+}
+
+/**
+  * remove
+  */
+void viewport_index::remove(int id)
+{
+  unordered_map<int, cell_rect>::iterator current = covers.find(id);
+  if(current == covers.end())
+    return;
+  unlink(id, current->second);
+  covers.erase(current);
+}
+
+/**
+  * find
+  * A tile only says the cover overlaps it, so each client found there is checked against the cell
+  */
+void viewport_index::find(uint32_t column, uint32_t row, vector<int> &ids) const
+{
+  unordered_map<uint64_t, vector<int>>::const_iterator tile = tiles.find(tile_key(column / VIEWPORT_TILE_COLUMNS, row / VIEWPORT_TILE_ROWS));
+  if(tile != tiles.end())
+    for(int i = 0; i < tile->second.size(); i++)
+      if(covers.at(tile->second[i]).contains(column, row))
+        ids.push_back(tile->second[i]);
+
+  for(int i = 0; i < large.size(); i++)
+    if(covers.at(large[i]).contains(column, row))
+      ids.push_back(large[i]);
+}
+
+/**
+  * size
+  */
+size_t viewport_index::size() const
+{
+  return covers.size();
+}
+
+/**
+  * add
+  */
+void cell_position_index::add(const string &name)
+{
+  uint32_t column, row;
+  if(cell_position(name, &column, &row))
+    tiles[tile_key(column / VIEWPORT_TILE_COLUMNS, row / VIEWPORT_TILE_ROWS)].insert(name);
+}
+
+/**
+  * find
+  * Looks up each tile the area overlaps, unless the area spans more tiles than there are cells in
+  * the index, in which case every tile of the index is looked at instead
+  */
+void cell_position_index::find(const cell_rect &area, const cell_rect *except, vector<string> &names) const
+{
+  uint32_t first_x = area.first_column / VIEWPORT_TILE_COLUMNS, last_x = area.last_column / VIEWPORT_TILE_COLUMNS;
+  uint32_t first_y = area.first_row / VIEWPORT_TILE_ROWS, last_y = area.last_row / VIEWPORT_TILE_ROWS;
+  uint64_t area_tiles = (uint64_t) (last_x - first_x + 1) * (last_y - first_y + 1);
+
+  vector<const unordered_set<string> *> overlapped;
+  if(area_tiles <= tiles.size()) {
+    for(uint32_t x = first_x; x <= last_x; x++)
+      for(uint32_t y = first_y; y <= last_y; y++) {
+        unordered_map<uint64_t, unordered_set<string>>::const_iterator tile = tiles.find(tile_key(x, y));
+        if(tile != tiles.end())
+          overlapped.push_back(&tile->second);
+      }
+  }
+  else {
+    for(unordered_map<uint64_t, unordered_set<string>>::const_iterator tile = tiles.begin(); tile != tiles.end(); tile++) {
+      uint32_t x = tile->first >> 32, y = (uint32_t) tile->first;
+      if(x >= first_x && x <= last_x && y >= first_y && y <= last_y)
+        overlapped.push_back(&tile->second);
+    }
+  }
+
+  for(int i = 0; i < overlapped.size(); i++)
+    for(unordered_set<string>::const_iterator name = overlapped[i]->begin(); name != overlapped[i]->end(); name++) {
+      uint32_t column, row;
+      cell_position(*name, &column, &row);
+      if(area.contains(column, row) && (except == nullptr || !except->contains(column, row)))
+        names.push_back(*name);
+    }
+}
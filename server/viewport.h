@@ -0,0 +1,74 @@
+#ifndef VIEWPORT_H
+#define VIEWPORT_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdint>
+
+using namespace std;
+
+/* A client may subscribe to a rectangle of the spreadsheet rather than all of it, usually the part it
+  shows on screen. Its viewport is grown by a margin, so cells just out of view are already there when
+  it scrolls a little, and it is only sent changes to cells inside that cover */
+
+/* Columns (A = 1) and rows of a rectangle of cells, both ends included */
+struct cell_rect {
+  uint32_t first_column;
+  uint32_t first_row;
+  uint32_t last_column;
+  uint32_t last_row;
+
+  bool contains(uint32_t column, uint32_t row) const;
+  // The rectangle with margin more columns and rows on every side, stopping at A1
+  cell_rect grown(uint32_t margin) const;
+};
+
+// Column and row of a cell name such as B7 or $AA$30. Returns false for anything else
+bool cell_position(string_view name, uint32_t *column, uint32_t *row);
+// The rectangle between two corner cells, which may be given in any order
+bool parse_cell_rect(string_view first, string_view last, cell_rect &rect);
+// A range such as A1:J40
+bool parse_cell_range(string_view range, cell_rect &rect);
+
+/* The index splits the spreadsheet into tiles of VIEWPORT_TILE_COLUMNS by VIEWPORT_TILE_ROWS cells and
+  lists under each tile the clients whose cover overlaps it, so finding who to send a change to looks at
+  one tile rather than every client. A cover spanning more than VIEWPORT_MAX_TILES tiles is not split
+  up, but checked against every change */
+const uint32_t VIEWPORT_TILE_COLUMNS = 16;
+const uint32_t VIEWPORT_TILE_ROWS = 64;
+const size_t VIEWPORT_MAX_TILES = 1024;
+
+class viewport_index {
+  unordered_map<uint64_t, vector<int>> tiles;
+  unordered_map<int, cell_rect> covers;
+  vector<int> large;
+
+  static bool is_large(const cell_rect &cover);
+  void unlink(int id, const cell_rect &cover);
+
+  public:
+    // Adds a client, or replaces its cover
+    void set(int id, const cell_rect &cover);
+    void remove(int id);
+    // Appends every client whose cover contains the cell
+    void find(uint32_t column, uint32_t row, vector<int> &ids) const;
+    size_t size() const;
+};
+
+/* The names of the cells of a spreadsheet under the same tiles, so the cells that come into a cover when it
+  moves are found by looking at the tiles the new cover overlaps rather than at every cell. A cell can be
+  named more than one way, such as A1, a1 or $A$1, and each name it has been given is listed */
+class cell_position_index {
+  unordered_map<uint64_t, unordered_set<string>> tiles;
+
+  public:
+    // Lists the name under its tile. Names that are not a cell position are left out
+    void add(const string &name);
+    // Appends every name inside area that is not inside except, when there is one
+    void find(const cell_rect &area, const cell_rect *except, vector<string> &names) const;
+};
+
+#endif